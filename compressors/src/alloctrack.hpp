@@ -0,0 +1,225 @@
+/*
+ * alloctrack.hpp
+ * @brief count heap allocations made by codec calls
+ *
+ * Build with -DTRACK_ALLOCS to enable. On glibc, malloc/calloc/realloc/free
+ * are interposed (operator new goes through malloc), and every call made
+ * between AllocTracker::begin() and end() is counted. Elsewhere, or without
+ * the flag, tracking reports itself unavailable.
+ *
+ * @author ishafer
+ */
+
+#ifndef ALLOCTRACK_HPP_
+#define ALLOCTRACK_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include "util.hpp"
+
+#if defined TRACK_ALLOCS && defined __GLIBC__
+#include <malloc.h>
+#define ALLOCTRACK_ENABLED 1
+#endif
+
+using namespace std;
+
+/**
+ * Heap use over a tracked region
+ */
+struct alloc_stats {
+	//false if allocations weren't tracked
+	bool valid;
+	//calls to malloc/calloc/realloc (including via new)
+	uint64_t nallocs;
+	//bytes handed out by those calls
+	uint64_t bytes;
+	//most heap in use at once, above what was in use at begin()
+	uint64_t peak_bytes;
+
+	alloc_stats() :
+		valid(false),
+		nallocs(0),
+		bytes(0),
+		peak_bytes(0)
+	{
+	}
+
+	/**
+	 * Combine with the stats of another call
+	 */
+	void add(const alloc_stats &other) {
+		valid = valid || other.valid;
+		nallocs += other.nallocs;
+		bytes += other.bytes;
+		peak_bytes = max(peak_bytes, other.peak_bytes);
+	}
+};
+
+/**
+ * Counters updated by the interposed allocator; shared by all threads
+ */
+struct alloc_counters {
+	volatile int enabled;
+	volatile uint64_t nallocs;
+	volatile uint64_t bytes;
+	volatile int64_t live;
+	volatile int64_t peak;
+};
+static alloc_counters g_alloc_counters = {0, 0, 0, 0, 0};
+
+#ifdef ALLOCTRACK_ENABLED
+static inline void alloctrack_on_alloc(void *p) {
+	if (!g_alloc_counters.enabled || NULL == p) {
+		return;
+	}
+	int64_t n = malloc_usable_size(p);
+	__sync_fetch_and_add(&g_alloc_counters.nallocs, 1);
+	__sync_fetch_and_add(&g_alloc_counters.bytes, n);
+	int64_t live = __sync_add_and_fetch(&g_alloc_counters.live, n);
+	int64_t peak = g_alloc_counters.peak;
+	while (live > peak) {
+		int64_t seen = __sync_val_compare_and_swap(&g_alloc_counters.peak, peak, live);
+		if (seen == peak) {
+			break;
+		}
+		peak = seen;
+	}
+}
+
+static inline void alloctrack_on_free(void *p) {
+	if (g_alloc_counters.enabled && NULL != p) {
+		__sync_sub_and_fetch(&g_alloc_counters.live, static_cast<int64_t>(malloc_usable_size(p)));
+	}
+}
+
+extern "C" {
+void* __libc_malloc(size_t n);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void *p, size_t n);
+void __libc_free(void *p);
+
+void* malloc(size_t n) {
+	void *p = __libc_malloc(n);
+	alloctrack_on_alloc(p);
+	return p;
+}
+
+void* calloc(size_t n, size_t size) {
+	void *p = __libc_calloc(n, size);
+	alloctrack_on_alloc(p);
+	return p;
+}
+
+void* realloc(void *p, size_t n) {
+	alloctrack_on_free(p);
+	void *res = __libc_realloc(p, n);
+	if (NULL == res && n > 0) {
+		//the old block is still ours
+		alloctrack_on_alloc(p);
+		return res;
+	}
+	alloctrack_on_alloc(res);
+	return res;
+}
+
+void free(void *p) {
+	alloctrack_on_free(p);
+	__libc_free(p);
+}
+}
+#endif
+
+/**
+ * @brief measure the heap use of a region of code.
+ * Regions don't nest; allocations from every thread are counted.
+ */
+class AllocTracker {
+public:
+	static bool available() {
+#ifdef ALLOCTRACK_ENABLED
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	static void begin() {
+		g_alloc_counters.enabled = 0;
+		g_alloc_counters.nallocs = 0;
+		g_alloc_counters.bytes = 0;
+		g_alloc_counters.live = 0;
+		g_alloc_counters.peak = 0;
+		__sync_synchronize();
+		g_alloc_counters.enabled = available();
+	}
+
+	/**
+	 * @returns heap use since begin()
+	 */
+	static alloc_stats end() {
+		g_alloc_counters.enabled = 0;
+		__sync_synchronize();
+		alloc_stats st;
+		st.valid = available();
+		st.nallocs = g_alloc_counters.nallocs;
+		st.bytes = g_alloc_counters.bytes;
+		int64_t peak = g_alloc_counters.peak;
+		st.peak_bytes = max(static_cast<int64_t>(0), peak);
+		return st;
+	}
+};
+
+void test_alloc_stats() {
+	alloc_stats a;
+	alloc_stats b;
+	b.valid = true;
+	b.nallocs = 2;
+	b.bytes = 100;
+	b.peak_bytes = 60;
+	a.add(b);
+	b.peak_bytes = 40;
+	a.add(b);
+	assert( a.valid );
+	assert( a.nallocs == 4 );
+	assert( a.bytes == 200 );
+	assert( a.peak_bytes == 60 );
+}
+
+void test_alloc_tracker() {
+	//volatile so the compiler can't fold or drop the calls
+	void* volatile before = malloc(4096);
+
+	AllocTracker::begin();
+	void* volatile p = malloc(1000);
+	char* volatile q = new char[3000];
+	p = realloc(p, 2000);
+	free(before);
+	delete[] q;
+	free(p);
+	alloc_stats st = AllocTracker::end();
+
+	if (AllocTracker::available()) {
+		assert( st.valid );
+		assert( st.nallocs == 3 );
+		assert( st.bytes >= 6000 );
+		assert( st.peak_bytes >= 5000 && st.peak_bytes < 6000 + 256 );
+	} else {
+		assert( !st.valid );
+		assert( st.nallocs == 0 );
+	}
+
+	//nothing counted outside a region
+	p = malloc(10);
+	free(p);
+	assert( AllocTracker::end().nallocs == st.nallocs );
+}
+
+void test_alloctrack() {
+	test_alloc_stats();
+	test_alloc_tracker();
+}
+
+#endif /* ALLOCTRACK_HPP_ */
@@ -0,0 +1,719 @@
+/*
+ * bench.hpp
+ * @brief repeated-trial codec benchmarks
+ * @author ishafer
+ */
+
+#ifndef BENCH_HPP_
+#define BENCH_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#if defined WIN32 || defined __CYGWIN__
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
+#if defined __x86_64__ || defined __i386__
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+
+#include "alloctrack.hpp"
+#include "compressor.hpp"
+#include "metastore.hpp"
+#include "perfcounters.hpp"
+#include "resultstore.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+/**
+ * Benchmark settings
+ */
+struct bench_opts {
+	//untimed runs before measuring
+	uint32_t warmup;
+	//timed runs
+	uint32_t trials;
+	//pin to this cpu; -1 to leave affinity alone
+	int cpu;
+	//time with the TSC (calibrated to ns) rather than the OS clock
+	bool use_tsc;
+	//collect hardware performance counters, if we can
+	bool counters;
+	//transform to run in front of every coder
+	TransformName transform;
+	//if positive, quantize to within this (in each stream's units) first
+	double eps;
+
+	bench_opts() :
+		warmup(2),
+		trials(15),
+		cpu(-1),
+		use_tsc(false),
+		counters(true),
+		transform(NO_TRANSFORM),
+		eps(0)
+	{
+	}
+};
+
+/**
+ * @returns monotonic time in nanoseconds
+ */
+uint64_t monotonic_ns() {
+#if defined WIN32 || defined __CYGWIN__
+	LARGE_INTEGER tick, ticksPerSecond;
+	QueryPerformanceFrequency(&ticksPerSecond);
+	QueryPerformanceCounter(&tick);
+	return static_cast<uint64_t>(tick.QuadPart * (1e9 / ticksPerSecond.QuadPart));
+#else
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief nanosecond interval clock for benchmarks.
+ * Uses the TSC where asked and available, otherwise the OS monotonic clock.
+ */
+class BenchClock {
+private:
+	bool tsc;
+	double ns_per_tick;
+
+#ifdef BENCH_HAVE_TSC
+	/**
+	 * Measure TSC ticks against the monotonic clock
+	 */
+	static double calibrate_tsc() {
+		uint64_t ns0 = monotonic_ns();
+		uint64_t t0 = __rdtsc();
+		while (monotonic_ns() - ns0 < 20000000) {
+		}
+		uint64_t ns1 = monotonic_ns();
+		uint64_t t1 = __rdtsc();
+		return static_cast<double>(ns1 - ns0) / (t1 - t0);
+	}
+#endif
+
+public:
+	BenchClock(bool use_tsc) :
+		tsc(false),
+		ns_per_tick(1.0)
+	{
+#ifdef BENCH_HAVE_TSC
+		if (use_tsc) {
+			static double tsc_ns = calibrate_tsc();
+			tsc = true;
+			ns_per_tick = tsc_ns;
+		}
+#endif
+	}
+
+	uint64_t ticks() const {
+#ifdef BENCH_HAVE_TSC
+		if (tsc) {
+			return __rdtsc();
+		}
+#endif
+		return monotonic_ns();
+	}
+
+	double to_ns(uint64_t dticks) const {
+		return dticks * ns_per_tick;
+	}
+};
+
+/**
+ * @param samples trial times; reordered
+ * @returns min, median and 95th percentile of samples
+ */
+trial_stats compute_stats(vector<double> &samples) {
+	trial_stats st;
+	st.ntrials = samples.size();
+	if (samples.empty()) {
+		st.min_ns = st.median_ns = st.p95_ns = 0;
+		return st;
+	}
+	sort(samples.begin(), samples.end());
+	size_t n = samples.size();
+	st.min_ns = samples[0];
+	st.median_ns = (n % 2) ? samples[n/2] : (samples[n/2 - 1] + samples[n/2]) / 2;
+	//nearest-rank percentile
+	size_t rank = (95*n + 99) / 100;
+	st.p95_ns = samples[max(static_cast<size_t>(1), rank) - 1];
+	return st;
+}
+
+/**
+ * @param cpu cpu to run this thread on
+ * @returns true if pinned
+ */
+bool pin_to_cpu(int cpu) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (0 != sched_setaffinity(0, sizeof(set), &set)) {
+		cerr << "couldn't pin to cpu " << cpu << endl;
+		return false;
+	}
+	return true;
+#else
+	cerr << "cpu pinning not supported here" << endl;
+	return false;
+#endif
+}
+
+/**
+ * @returns MB/s for moving nbytes in ns nanoseconds
+ */
+double throughput_mbs(uint64_t nbytes, double ns) {
+	return ns > 0 ? nbytes / ns * 1e3 : 0;
+}
+
+/**
+ * @returns counts totalled over ntrials, averaged per trial
+ */
+perf_counts per_trial(const perf_counts &total, uint32_t ntrials) {
+	perf_counts res = total;
+	for (int ev = 0; ev < N_PERF_EVENTS; ++ev) {
+		if (res.counts[ev] >= 0 && ntrials > 0) {
+			res.counts[ev] /= ntrials;
+		}
+	}
+	return res;
+}
+
+/**
+ * @returns allocation counts totalled over ntrials, averaged per trial
+ */
+alloc_stats per_trial(const alloc_stats &total, uint32_t ntrials) {
+	alloc_stats res = total;
+	if (ntrials > 0) {
+		res.nallocs /= ntrials;
+		res.bytes /= ntrials;
+	}
+	return res;
+}
+
+/**
+ * Encode/decode with repeated trials
+ * @param rawbytes raw data; left untouched
+ * @param qeps if positive, quantize to within this of the raw values first
+ * @returns sizes and per-trial timing stats; ok only if the error bound holds
+ */
+template<typename vT, typename bsT>
+roundtrip_result bench_roundtrip_inner(
+		bool deltaenc, CoderName name, const void *rawbytes, uint64_t npoints,
+		uint32_t nthreads, const bench_opts &opts, int64_t qeps) {
+	const Coder<vT, bsT> *coder = get_pipeline<vT, bsT>(opts.transform, name);
+	if (nthreads > 1) {
+		coder = new BlockCoder<vT, bsT>(coder, nthreads);
+	}
+	BenchClock clock(opts.use_tsc);
+	PerfCounters pc;
+	if (opts.counters) {
+		pc.open();
+	}
+	perf_counts enc_counts;
+	perf_counts dec_counts;
+	alloc_stats enc_allocs;
+	alloc_stats dec_allocs;
+
+	vT *quant = NULL;
+	vT *in = static_cast<vT*>(const_cast<void*>(rawbytes));
+	if (qeps > 0) {
+		quant = static_cast<vT*>(malloc(sizeof(vT)*npoints));
+		quantize(quant, in, npoints, qeps);
+		in = quant;
+	}
+	vT *deltas = NULL;
+	if (deltaenc) {
+		deltas = static_cast<vT*>(malloc(sizeof(vT)*npoints));
+		delta_enc(deltas, in, npoints);
+		in = deltas;
+	}
+
+	uint64_t bufsize = sizeof(vT)*(npoints*BUF_SCALE_FACTOR+12);
+	unsigned char *outbits = static_cast<unsigned char*>(malloc(bufsize));
+	uint64_t outsize = 0;
+	vector<double> samples;
+	for (uint32_t t = 0; t < opts.warmup + opts.trials; ++t) {
+		//bitstream coders OR into their output
+		memset(outbits, 0, bufsize);
+		outsize = bufsize;
+		AllocTracker::begin();
+		pc.start();
+		uint64_t t0 = clock.ticks();
+		unsigned char *res = coder->enc(outbits, &outsize, in, npoints);
+		uint64_t t1 = clock.ticks();
+		perf_counts counts = pc.stop();
+		alloc_stats allocs = AllocTracker::end();
+		if (res != outbits) {
+			//the coder grew the buffer; keep the bigger one
+			outbits = res;
+			bufsize = max(bufsize, outsize);
+		}
+		if (t >= opts.warmup) {
+			samples.push_back(clock.to_ns(t1 - t0));
+			enc_counts.add(counts);
+			enc_allocs.add(allocs);
+		}
+	}
+
+	roundtrip_result res;
+	res.rawbytes = npoints*sizeof(vT);
+	res.encbytes = outsize;
+	res.enc = compute_stats(samples);
+
+	vT *dout = static_cast<vT*>(malloc(sizeof(vT)*(npoints*BUF_SCALE_FACTOR+12)));
+	samples.clear();
+	res.ok = true;
+	for (uint32_t t = 0; t < opts.warmup + opts.trials; ++t) {
+		uint64_t n = npoints;
+		AllocTracker::begin();
+		pc.start();
+		uint64_t t0 = clock.ticks();
+		vT *decoded = coder->dec(dout, &n, outbits, outsize);
+		uint64_t t1 = clock.ticks();
+		perf_counts counts = pc.stop();
+		alloc_stats allocs = AllocTracker::end();
+		dout = decoded;
+		if (t >= opts.warmup) {
+			samples.push_back(clock.to_ns(t1 - t0));
+			dec_counts.add(counts);
+			dec_allocs.add(allocs);
+		}
+		res.ok = res.ok && (0 == memcmp(dout, in, npoints*sizeof(vT)));
+	}
+	if (res.ok && qeps > 0) {
+		res.ok = quantize_bound_holds(static_cast<const vT*>(rawbytes), dout, npoints, deltaenc, qeps);
+	}
+	res.dec = compute_stats(samples);
+	res.enc_counts = per_trial(enc_counts, opts.trials);
+	res.dec_counts = per_trial(dec_counts, opts.trials);
+	res.enc_allocs = per_trial(enc_allocs, opts.trials);
+	res.dec_allocs = per_trial(dec_allocs, opts.trials);
+
+	free(outbits);
+	free(dout);
+	free(deltas);
+	free(quant);
+	delete coder;
+
+	return res;
+}
+
+roundtrip_result bench_roundtrip(
+		bool deltaenc, CoderName name, vstream vs, uint32_t nthreads, const bench_opts &opts) {
+	roundtrip_result res;
+
+	MappedStream mapped;
+	if (!mapped.open(vs)) {
+		return res;
+	}
+	const void *bytes = mapped.data();
+	const int64_t qeps = quantize_eps(opts.eps, vs.vscale);
+	switch (vs.vsize) {
+	case 1:
+		res = bench_roundtrip_inner<int8_t, uint8_t>(deltaenc, name, bytes, vs.npoints, nthreads, opts, qeps);
+		break;
+	case 2:
+		res = bench_roundtrip_inner<int16_t, uint16_t>(deltaenc, name, bytes, vs.npoints, nthreads, opts, qeps);
+		break;
+	case 4:
+		res = bench_roundtrip_inner<int32_t, uint32_t>(deltaenc, name, bytes, vs.npoints, nthreads, opts, qeps);
+		break;
+	case 8:
+		res = bench_roundtrip_inner<int64_t, uint64_t>(deltaenc, name, bytes, vs.npoints, nthreads, opts, qeps);
+		break;
+	default:
+		cerr << "Unknown value size:" << vs.vsize << endl;
+		break;
+	}
+	return res;
+}
+
+void print_bench_header() {
+	cout << "vname,vsize,codec,ok,rawbytes,encbytes,ratio,trials," <<
+			"enc_ns_med,enc_ns_p95,enc_ns_min,dec_ns_med,dec_ns_p95,dec_ns_min," <<
+			"enc_mbs,dec_mbs,enc_vals_s,dec_vals_s";
+	const char *phases[] = {"enc", "dec"};
+	for (int p = 0; p < 2; ++p) {
+		cout << "," << phases[p] << "_cpv," << phases[p] << "_ipc";
+		for (int ev = PERF_BRANCH_MISSES; ev < N_PERF_EVENTS; ++ev) {
+			cout << "," << phases[p] << "_" << static_cast<PerfEvent>(ev) << "_pv";
+		}
+	}
+	//print_allocs columns, which are there (if empty) without TRACK_ALLOCS too
+	for (int p = 0; p < 2; ++p) {
+		cout << "," << phases[p] << "_allocs," << phases[p] << "_alloc_bytes," <<
+				phases[p] << "_alloc_peak";
+	}
+	cout << endl;
+}
+
+/**
+ * Print per-value counter columns; empty where counters weren't available
+ */
+void print_counts(const perf_counts &counts, uint64_t nvals) {
+	double cols[N_PERF_EVENTS];
+	cols[0] = counts.per_value(PERF_CYCLES, nvals);
+	cols[1] = counts.ipc();
+	for (int ev = PERF_BRANCH_MISSES; ev < N_PERF_EVENTS; ++ev) {
+		cols[ev] = counts.per_value(static_cast<PerfEvent>(ev), nvals);
+	}
+	for (int i = 0; i < N_PERF_EVENTS; ++i) {
+		cout << ",";
+		if (cols[i] >= 0) {
+			cout << cols[i];
+		}
+	}
+}
+
+/**
+ * Print per-trial allocation columns; empty unless built with TRACK_ALLOCS
+ */
+void print_allocs(const alloc_stats &allocs) {
+	if (allocs.valid) {
+		cout << "," << allocs.nallocs << "," << allocs.bytes << "," << allocs.peak_bytes;
+	} else {
+		cout << ",,,";
+	}
+}
+
+void print_bench_result(const vstream &vs, const string &codec, const roundtrip_result &res) {
+	uint64_t nvals = vs.npoints;
+	cout << vs.vname << "," << vs.vsize << "," << codec << "," << res.ok << "," <<
+			res.rawbytes << "," << res.encbytes << "," <<
+			(res.encbytes > 0 ? static_cast<double>(res.rawbytes) / res.encbytes : 0) << "," <<
+			res.enc.ntrials << "," <<
+			res.enc.median_ns << "," << res.enc.p95_ns << "," << res.enc.min_ns << "," <<
+			res.dec.median_ns << "," << res.dec.p95_ns << "," << res.dec.min_ns << "," <<
+			throughput_mbs(res.rawbytes, res.enc.median_ns) << "," <<
+			throughput_mbs(res.rawbytes, res.dec.median_ns) << "," <<
+			(res.enc.median_ns > 0 ? nvals / res.enc.median_ns * 1e9 : 0) << "," <<
+			(res.dec.median_ns > 0 ? nvals / res.dec.median_ns * 1e9 : 0);
+	print_counts(res.enc_counts, nvals);
+	print_counts(res.dec_counts, nvals);
+	print_allocs(res.enc_allocs);
+	print_allocs(res.dec_allocs);
+	cout << endl;
+}
+
+/**
+ * Sizes and median times summed over a run, for one coder
+ */
+struct bench_totals {
+	uint64_t rawbytes;
+	uint64_t encbytes;
+	double enc_ns;
+	double dec_ns;
+
+	bench_totals() :
+		rawbytes(0),
+		encbytes(0),
+		enc_ns(0),
+		dec_ns(0)
+	{
+	}
+
+	void add(const roundtrip_result &res) {
+		if (res.ok) {
+			rawbytes += res.rawbytes;
+			encbytes += res.encbytes;
+			enc_ns += res.enc.median_ns;
+			dec_ns += res.dec.median_ns;
+		}
+	}
+
+	double ratio() const {
+		return encbytes > 0 ? static_cast<double>(rawbytes) / encbytes : 0;
+	}
+};
+
+/**
+ * Coders that trade speed for ratio, and the coders they're judged against
+ */
+static const CoderName ARCHIVAL_CODERS[] = {LOG_ARITH};
+static const CoderName BASELINE_CODERS[] = {ZLIB, LOG_HUFFMAN};
+
+/**
+ * Print ratio gain and time cost of each archival coder over each baseline
+ * @param totals run totals, indexed like ALL_CODERS
+ */
+void print_bench_relative(const vector<bench_totals> &totals) {
+	cout << "codec,baseline,ratio,baseline_ratio,ratio_gain,enc_cost,dec_cost" << endl;
+	const unsigned narchival = sizeof(ARCHIVAL_CODERS)/sizeof(CoderName);
+	const unsigned nbaseline = sizeof(BASELINE_CODERS)/sizeof(CoderName);
+	for (unsigned a = 0; a < narchival; ++a) {
+		for (unsigned b = 0; b < nbaseline; ++b) {
+			const bench_totals *arch = NULL;
+			const bench_totals *base = NULL;
+			for (unsigned cdx = 0; cdx < N_CODERS; ++cdx) {
+				if (ALL_CODERS[cdx] == ARCHIVAL_CODERS[a]) {
+					arch = &totals[cdx];
+				}
+				if (ALL_CODERS[cdx] == BASELINE_CODERS[b]) {
+					base = &totals[cdx];
+				}
+			}
+			if (NULL == arch || NULL == base || 0 == arch->encbytes || 0 == base->encbytes) {
+				continue;
+			}
+			cout << ARCHIVAL_CODERS[a] << "," << BASELINE_CODERS[b] << "," <<
+					arch->ratio() << "," << base->ratio() << "," <<
+					(base->ratio() > 0 ? arch->ratio() / base->ratio() : 0) << "," <<
+					(base->enc_ns > 0 ? arch->enc_ns / base->enc_ns : 0) << "," <<
+					(base->dec_ns > 0 ? arch->dec_ns / base->dec_ns : 0) << endl;
+		}
+	}
+}
+
+/**
+ * Benchmark every coder that fits the transform on every stream, then compare
+ *  the archival coders against their baselines
+ * @param store if not NULL, record results here and skip stream/codec
+ *  pairs it already has
+ */
+void bench_streams(const vector<vstream> &streams, bool deltaenc,
+		const bench_opts &opts, ResultStore *store) {
+	if (opts.cpu >= 0) {
+		pin_to_cpu(opts.cpu);
+	}
+	print_bench_header();
+	vector<bench_totals> totals(N_CODERS);
+	for (vector<vstream>::const_iterator it = streams.begin(); it != streams.end(); ++it) {
+		for (unsigned cdx = 0; cdx < N_CODERS; ++cdx) {
+			CoderName name = ALL_CODERS[cdx];
+			if (!transform_fits(opts.transform, name)) {
+				continue;
+			}
+			string codec = pipeline_name(opts.transform, name, opts.eps);
+			if (NULL != store && store->has(*it, codec.c_str(), coder_version(name), deltaenc, 1)) {
+				continue;
+			}
+			roundtrip_result res = bench_roundtrip(deltaenc, name, *it, 1, opts);
+			print_bench_result(*it, codec, res);
+			totals[cdx].add(res);
+			if (NULL != store) {
+				store->add(*it, codec.c_str(), coder_version(name), deltaenc, 1, res);
+			}
+		}
+	}
+	cout << endl;
+	print_bench_relative(totals);
+}
+
+void test_bench_stats() {
+	double s1[] = {5, 1, 3, 2, 4};
+	vector<double> v1(s1, s1 + 5);
+	trial_stats st = compute_stats(v1);
+	assert( st.ntrials == 5 );
+	assert( st.min_ns == 1 );
+	assert( st.median_ns == 3 );
+	assert( st.p95_ns == 5 );
+
+	vector<double> v2;
+	for (int i = 100; i >= 1; --i) {
+		v2.push_back(i);
+	}
+	st = compute_stats(v2);
+	assert( st.min_ns == 1 );
+	assert( st.median_ns == 50.5 );
+	assert( st.p95_ns == 95 );
+}
+
+void test_bench_clock() {
+	BenchClock os(false);
+	uint64_t t0 = os.ticks();
+	uint64_t t1 = os.ticks();
+	assert( t1 >= t0 );
+
+	BenchClock tsc(true);
+	t0 = tsc.ticks();
+	uint64_t ns0 = monotonic_ns();
+	while (monotonic_ns() - ns0 < 1000000) {
+	}
+	double ns = tsc.to_ns(tsc.ticks() - t0);
+	//loose: just check the scale is right
+	assert( ns > 0.5e6 && ns < 100e6 );
+}
+
+void test_bench_roundtrip() {
+	bench_opts opts;
+	opts.warmup = 1;
+	opts.trials = 3;
+	vstream vs = get_test_stream();
+	roundtrip_result res = bench_roundtrip(true, LOG_HUFFMAN, vs, 1, opts);
+	assert( res.ok );
+	assert( res.rawbytes == static_cast<uint64_t>(vs.npoints) * vs.vsize );
+	assert( res.encbytes > 0 && res.encbytes < res.rawbytes );
+	assert( res.enc.ntrials == 3 && res.dec.ntrials == 3 );
+	assert( res.enc.min_ns <= res.enc.median_ns && res.enc.median_ns <= res.enc.p95_ns );
+
+	//the predictor stands in for delta encoding
+	opts.transform = PREDICT;
+	roundtrip_result pres = bench_roundtrip(false, LOG_HUFFMAN, vs, 1, opts);
+	assert( pres.ok );
+	assert( pres.encbytes > 0 && pres.encbytes < pres.rawbytes );
+
+	//the shuffles go on top of it
+	opts.transform = BITSHUFFLE;
+	roundtrip_result sres = bench_roundtrip(true, ZLIB, vs, 1, opts);
+	assert( sres.ok );
+	assert( sres.encbytes > 0 && sres.encbytes < sres.rawbytes );
+
+	//a loose error bound buys smaller residuals, and is checked
+	opts.transform = NO_TRANSFORM;
+	opts.eps = 1e-3 * pow(10.0, vs.vscale) * (vs.vmax - vs.vmin);
+	roundtrip_result qres = bench_roundtrip(true, LOG_HUFFMAN, vs, 1, opts);
+	assert( qres.ok );
+	assert( qres.encbytes < res.encbytes );
+}
+
+/**
+ * The elias coders work in caller buffers; catch them starting to allocate
+ */
+void test_bench_allocs() {
+	bench_opts opts;
+	opts.warmup = 1;
+	opts.trials = 2;
+	opts.counters = false;
+	vstream vs = get_test_stream();
+	CoderName names[] = {ELIAS_GAMMA, ELIAS_DELTA};
+	for (int i = 0; i < 2; ++i) {
+		roundtrip_result res = bench_roundtrip(true, names[i], vs, 1, opts);
+		assert( res.ok );
+		assert( res.enc_allocs.valid == AllocTracker::available() );
+		assert( 0 == res.enc_allocs.nallocs );
+		assert( 0 == res.dec_allocs.nallocs );
+	}
+
+	if (AllocTracker::available()) {
+		//zlib keeps its streams per thread, so only the warmup allocates
+		roundtrip_result zres = bench_roundtrip(true, ZLIB, vs, 1, opts);
+		assert( zres.ok );
+		assert( 0 == zres.enc_allocs.nallocs );
+		assert( 0 == zres.dec_allocs.nallocs );
+
+		//the huffman tree is built per call
+		roundtrip_result res = bench_roundtrip(true, LOG_HUFFMAN, vs, 1, opts);
+		assert( res.enc_allocs.nallocs > 0 );
+		assert( res.enc_allocs.peak_bytes > 0 );
+	}
+}
+
+/**
+ * Rows must have a column for each header name
+ */
+void test_bench_columns() {
+	ostringstream os;
+	streambuf *saved = cout.rdbuf(os.rdbuf());
+	print_bench_header();
+	roundtrip_result res;
+	print_bench_result(get_test_stream(), "zlib", res);
+	cout.rdbuf(saved);
+
+	string header;
+	string row;
+	istringstream lines(os.str());
+	getline(lines, header);
+	getline(lines, row);
+	assert( count(header.begin(), header.end(), ',') == count(row.begin(), row.end(), ',') );
+}
+
+/**
+ * @returns number of rows bench_streams prints for vs
+ */
+uint64_t bench_rows(const vstream &vs, const bench_opts &opts, ResultStore *store) {
+	ostringstream os;
+	streambuf *saved = cout.rdbuf(os.rdbuf());
+	bench_streams(vector<vstream>(1, vs), true, opts, store);
+	cout.rdbuf(saved);
+
+	string prefix = string(vs.vname) + ",";
+	uint64_t nrows = 0;
+	string line;
+	istringstream lines(os.str());
+	while (getline(lines, line)) {
+		nrows += (0 == line.compare(0, prefix.size(), prefix));
+	}
+	return nrows;
+}
+
+/**
+ * A rerun against the same store measures only what's missing
+ */
+void test_bench_store() {
+	const char *fname = "test-bench-results.db";
+	remove(fname);
+	bench_opts opts;
+	opts.warmup = 0;
+	opts.trials = 1;
+	opts.counters = false;
+	vstream vs = get_test_stream();
+	{
+		ResultStore store(fname);
+		assert( store.open() );
+		assert( bench_rows(vs, opts, &store) > 0 );
+		assert( 0 == bench_rows(vs, opts, &store) );
+	}
+	remove(fname);
+	remove("test-bench-results.db-wal");
+	remove("test-bench-results.db-shm");
+}
+
+/**
+ * The archival coder should beat both baselines on ratio, on real streams
+ */
+void test_bench_archival() {
+	bench_opts opts;
+	opts.warmup = 0;
+	opts.trials = 1;
+	opts.counters = false;
+	vector<vstream> streams = get_test_streams();
+	bench_totals arch;
+	bench_totals zlib;
+	bench_totals huff;
+	for (vector<vstream>::iterator it = streams.begin(); it != streams.end(); ++it) {
+		roundtrip_result res = bench_roundtrip(true, LOG_ARITH, *it, 1, opts);
+		assert( res.ok );
+		arch.add(res);
+		zlib.add(bench_roundtrip(true, ZLIB, *it, 1, opts));
+		huff.add(bench_roundtrip(true, LOG_HUFFMAN, *it, 1, opts));
+	}
+	assert( arch.rawbytes == zlib.rawbytes && arch.rawbytes == huff.rawbytes );
+	assert( arch.ratio() > zlib.ratio() );
+	assert( arch.ratio() > huff.ratio() );
+}
+
+void test_bench() {
+	test_bench_stats();
+	test_bench_clock();
+	test_bench_roundtrip();
+	test_bench_allocs();
+	test_bench_columns();
+	test_bench_store();
+	test_bench_archival();
+}
+
+#endif /* BENCH_HPP_ */
@@ -9,19 +9,35 @@
 
 #include <unistd.h>
 #include <cstdlib>
+#include <cmath>
+#include <sstream>
+#include <string>
 
 #include "compressor/coder.hpp"
 #include "compressor/bitstream.hpp"
+#include "compressor/arith.hpp"
+#include "compressor/block.hpp"
 #include "compressor/delta.hpp"
+#include "compressor/dict.hpp"
 #include "compressor/eliasgamma.hpp"
 #include "compressor/eliasdelta.hpp"
+#include "compressor/expgolomb.hpp"
+#include "compressor/fcm.hpp"
 #include "compressor/loghuffman.hpp"
+#include "compressor/lz.hpp"
+#include "compressor/predict.hpp"
+#include "compressor/quantize.hpp"
+#include "compressor/rans.hpp"
+#include "compressor/rle.hpp"
+#include "compressor/shuffle.hpp"
+#include "compressor/timeindex.hpp"
 #include "compressor/zigzag.hpp"
 #include "compressor/zlib.hpp"
 
 #include "../inc/timer.h"
 
 #include "metastore.hpp"
+#include "resultstore.hpp"
 
 using namespace std;
 
@@ -30,9 +46,43 @@ enum CoderName {
 	ELIAS_DELTA,
 	LOG_HUFFMAN,
 	LOG_HUFFMAN_RLE,
-	ZLIB
+	ZLIB,
+	LOG_RANS,
+	LOG_ARITH,
+	LOG_HUFFMAN_RUNS,
+	EXP_GOLOMB,
+	DICT,
+	ZLIB_FAST,
+	ZLIB_BEST,
+	ZLIB_FILTERED,
+	ZLIB_RLE,
+	ZLIB_STREAMING,
+	WORD_LZ
 };
 
+/**
+ * Every coder, in the order the harness runs them
+ */
+static const CoderName ALL_CODERS[] = {
+	ELIAS_GAMMA,
+	ELIAS_DELTA,
+	LOG_HUFFMAN,
+	LOG_HUFFMAN_RLE,
+	ZLIB,
+	LOG_RANS,
+	LOG_ARITH,
+	LOG_HUFFMAN_RUNS,
+	EXP_GOLOMB,
+	DICT,
+	ZLIB_FAST,
+	ZLIB_BEST,
+	ZLIB_FILTERED,
+	ZLIB_RLE,
+	ZLIB_STREAMING,
+	WORD_LZ
+};
+static const unsigned N_CODERS = sizeof(ALL_CODERS)/sizeof(CoderName);
+
 ostream& operator<<(ostream& os, const CoderName& coder)
 {
 	switch(coder) {
@@ -41,10 +91,164 @@ ostream& operator<<(ostream& os, const CoderName& coder)
 		case LOG_HUFFMAN: os << "log-huffman"; break;
 		case LOG_HUFFMAN_RLE: os << "log-huffman-rle"; break;
 		case ZLIB: os << "zlib"; break;
+		case LOG_RANS: os << "log-rans"; break;
+		case LOG_ARITH: os << "log-arith"; break;
+		case LOG_HUFFMAN_RUNS: os << "log-huffman-runs"; break;
+		case EXP_GOLOMB: os << "exp-golomb"; break;
+		case DICT: os << "dict"; break;
+		case ZLIB_FAST: os << "zlib-1"; break;
+		case ZLIB_BEST: os << "zlib-9"; break;
+		case ZLIB_FILTERED: os << "zlib-filtered"; break;
+		case ZLIB_RLE: os << "zlib-rle"; break;
+		case ZLIB_STREAMING: os << "zlib-streaming"; break;
+		case WORD_LZ: os << "lz"; break;
 	}
 	return os;
 }
 
+string coder_name(CoderName coder) {
+	ostringstream os;
+	os << coder;
+	return os.str();
+}
+
+/**
+ * Version of each coder's implementation, stored with its results.
+ * Bump a coder's version when its output or speed changes, so that
+ *  stored results for it are measured again.
+ */
+int coder_version(CoderName name) {
+	switch (name) {
+	case ELIAS_GAMMA:
+	case ELIAS_DELTA:
+		//table-driven decoding
+		return 2;
+	case ZLIB:
+		//reused per-thread streams
+		return 2;
+	case LOG_HUFFMAN:
+	case LOG_HUFFMAN_RLE:
+	case LOG_RANS:
+	case LOG_ARITH:
+	case LOG_HUFFMAN_RUNS:
+	case EXP_GOLOMB:
+	case DICT:
+	case ZLIB_FAST:
+	case ZLIB_BEST:
+	case ZLIB_FILTERED:
+	case ZLIB_RLE:
+	case ZLIB_STREAMING:
+	case WORD_LZ:
+	default:
+		return 1;
+	}
+}
+
+/**
+ * Transforms that can run in front of any coder
+ */
+enum TransformName {
+	NO_TRANSFORM,
+	PREDICT,
+	FCM,
+	SHUFFLE,
+	BITSHUFFLE,
+	N_TRANSFORMS
+};
+
+ostream& operator<<(ostream& os, const TransformName& transform)
+{
+	switch(transform) {
+		case NO_TRANSFORM: os << "none"; break;
+		case PREDICT: os << "predict"; break;
+		case FCM: os << "fcm"; break;
+		case SHUFFLE: os << "shuffle"; break;
+		case BITSHUFFLE: os << "bitshuffle"; break;
+		default: os << "unknown"; break;
+	}
+	return os;
+}
+
+/**
+ * @returns whether transform goes on top of delta encoding, rather than
+ *  predicting values itself
+ */
+bool transform_keeps_delta(TransformName transform) {
+	return NO_TRANSFORM == transform || SHUFFLE == transform || BITSHUFFLE == transform;
+}
+
+/**
+ * @returns whether name codes bytes rather than values; shuffled values
+ *  are just bytes, so the value coders can't take them
+ */
+bool coder_is_bytewise(CoderName name) {
+	switch (name) {
+	case ZLIB:
+	case ZLIB_FAST:
+	case ZLIB_BEST:
+	case ZLIB_FILTERED:
+	case ZLIB_RLE:
+	case ZLIB_STREAMING:
+	case WORD_LZ:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * @returns whether transform can go in front of coder
+ */
+bool transform_fits(TransformName transform, CoderName coder) {
+	if (SHUFFLE == transform || BITSHUFFLE == transform) {
+		return coder_is_bytewise(coder);
+	}
+	return true;
+}
+
+/**
+ * @returns the transform called name, or N_TRANSFORMS if there isn't one
+ */
+TransformName parse_transform(const string &name) {
+	for (int t = 0; t < N_TRANSFORMS; ++t) {
+		ostringstream os;
+		os << static_cast<TransformName>(t);
+		if (os.str() == name) {
+			return static_cast<TransformName>(t);
+		}
+	}
+	return N_TRANSFORMS;
+}
+
+/**
+ * @returns the coder called name, or N_CODERS if there isn't one
+ */
+CoderName parse_coder(const string &name) {
+	for (unsigned cdx = 0; cdx < N_CODERS; ++cdx) {
+		if (coder_name(ALL_CODERS[cdx]) == name) {
+			return ALL_CODERS[cdx];
+		}
+	}
+	return static_cast<CoderName>(N_CODERS);
+}
+
+/**
+ * @param eps error bound of lossy quantization in front; 0 for lossless
+ * @returns e.g. "predict+log-huffman", or just the coder without a transform;
+ *  lossy pipelines start with the bound, as in "q0.001+log-huffman"
+ */
+string pipeline_name(TransformName transform, CoderName coder, double eps = 0) {
+	ostringstream os;
+	if (eps > 0) {
+		os << "q" << eps << "+";
+	}
+	if (NO_TRANSFORM != transform) {
+		os << transform << "+";
+	}
+	os << coder;
+	return os.str();
+}
+
 template<typename vT, typename bsT>
 const Coder<vT, bsT> *get_coder(CoderName name) {
 	switch (name) {
@@ -58,28 +262,163 @@ const Coder<vT, bsT> *get_coder(CoderName name) {
 		return new LogHuffmanRLE<vT, bsT>;
 	case ZLIB:
 		return new ZLib<vT, bsT>;
+	case LOG_RANS:
+		return new LogRANS<vT, bsT>;
+	case LOG_ARITH:
+		return new LogArith<vT, bsT>;
+	case LOG_HUFFMAN_RUNS:
+		return new LogHuffmanRuns<vT, bsT>;
+	case EXP_GOLOMB:
+		return new ExpGolomb<vT, bsT>;
+	case DICT:
+		return new DictCoder<vT, bsT>;
+	case ZLIB_FAST:
+		return new ZLib<vT, bsT>(1);
+	case ZLIB_BEST:
+		return new ZLib<vT, bsT>(9);
+	case ZLIB_FILTERED:
+		return new ZLib<vT, bsT>(Z_DEFAULT_COMPRESSION, Z_FILTERED);
+	case ZLIB_RLE:
+		return new ZLib<vT, bsT>(Z_DEFAULT_COMPRESSION, Z_RLE);
+	case ZLIB_STREAMING:
+		return new ZLib<vT, bsT>(Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, true);
+	case WORD_LZ:
+		return new WordLZ<vT, bsT>;
 	default:
 		cerr << "Unknown coder type:" << name << endl;
 		return new EliasGamma<vT, bsT>;
 	}
 }
 
+/**
+ * @returns the coder for name, behind transform
+ */
+template<typename vT, typename bsT>
+const Coder<vT, bsT> *get_pipeline(TransformName transform, CoderName name) {
+	const Coder<vT, bsT> *coder = get_coder<vT, bsT>(name);
+	switch (transform) {
+	case NO_TRANSFORM:
+		return coder;
+	case PREDICT:
+		return new PredictCoder<vT, bsT>(coder);
+	case FCM:
+		return new FcmCoder<vT, bsT>(coder);
+	case SHUFFLE:
+		return new ShuffleCoder<vT, bsT>(coder);
+	case BITSHUFFLE:
+		return new ShuffleCoder<vT, bsT>(coder, true);
+	default:
+		cerr << "Unknown transform:" << transform << endl;
+		return coder;
+	}
+}
+
+/**
+ * The first level of zone map: a stream's meta row bounds all its values
+ * @returns whether any value of vs could match pred
+ */
+bool stream_may_match(const vstream &vs, const value_predicate &pred) {
+	return pred.may_match(vs.vmin, vs.vmax);
+}
+
+template<typename tT>
+void widen_timestamps(int64_t *ts, const void *raw, uint64_t n) {
+	const tT *src = static_cast<const tT*>(raw);
+	for (uint64_t i = 0; i < n; ++i) {
+		ts[i] = src[i];
+	}
+}
+
+/**
+ * @returns the timestamps of vs widened to 64 bits, or NULL if they
+ *  can't be read; free when done
+ */
+int64_t* load_timestamps(const vstream &vs) {
+	if (1 != vs.tsize && 2 != vs.tsize && 4 != vs.tsize && 8 != vs.tsize) {
+		cerr << "Unknown timestamp size:" << vs.tsize << endl;
+		return NULL;
+	}
+	MappedStream mapped;
+	if (!mapped.open_times(vs)) {
+		return NULL;
+	}
+	uint64_t n = vs.npoints;
+	int64_t *ts = static_cast<int64_t*>(malloc(sizeof(int64_t)*n));
+	if (NULL == ts) {
+		cerr << "Couldn't allocate " << n << " timestamps" << endl;
+		return NULL;
+	}
+	switch (vs.tsize) {
+	case 1: widen_timestamps<int8_t>(ts, mapped.data(), n); break;
+	case 2: widen_timestamps<int16_t>(ts, mapped.data(), n); break;
+	case 4: widen_timestamps<int32_t>(ts, mapped.data(), n); break;
+	default: widen_timestamps<int64_t>(ts, mapped.data(), n); break;
+	}
+	return ts;
+}
+
+/**
+ * Convert [t0, t1] in the stream's time units to stored timestamps, which
+ *  are the times 10^-tscale
+ * @returns false if the meta row's [tmin, tmax] rules out any overlap, so
+ *  there's no need to touch the series at all
+ */
+bool stored_time_range(const vstream &vs, double t0, double t1, int64_t *st0, int64_t *st1) {
+	double scale = pow(10.0, -vs.tscale);
+	double x0 = t0 * scale;
+	double x1 = t1 * scale;
+	//allow a few ulps for times that are exact in decimal but not in binary;
+	// kept absolute and well under a tick, even for epoch-sized timestamps
+	const double ulps = 4 * numeric_limits<double>::epsilon();
+	double s0 = ceil(x0 - min(0.25, fabs(x0) * ulps + 1e-9));
+	double s1 = floor(x1 + min(0.25, fabs(x1) * ulps + 1e-9));
+	if (s0 > s1 || s0 > vs.tmax || s1 < vs.tmin) {
+		return false;
+	}
+	*st0 = static_cast<int64_t>(max(s0, static_cast<double>(vs.tmin)));
+	*st1 = static_cast<int64_t>(min(s1, static_cast<double>(vs.tmax)));
+	return true;
+}
+
 /**
  * @param deltaenc should we delta-encode?
  * @param name the name of the encoder
- * @param asbytes raw data
+ * @param rawbytes raw data; left untouched, so it may be a read-only mapping
  * @param npoints number of points in the raw data
+ * @param nthreads if more than one, code independent blocks on this many threads
+ * @param transform transform to run in front of the coder (in each block)
+ * @param eps if positive, quantize to within this of the raw values first
+ * @param vscale raw values are the stream's times 10^-vscale
+ * @returns sizes and timings of the roundtrip; ok only if the error bound holds
  */
 template<typename vT, typename bsT>
-void test_roundtrip_inner(
-		const char* toprint, bool deltaenc, CoderName name, void *asbytes, uint64_t npoints) {
+roundtrip_result test_roundtrip_inner(
+		const char* toprint, bool deltaenc, CoderName name, const void *rawbytes, uint64_t npoints,
+		uint32_t nthreads = 1, TransformName transform = NO_TRANSFORM, double eps = 0, int vscale = 0) {
 	//npoints = 20;
-	const Coder<vT, bsT> *coder = get_coder<vT, bsT>(name);
+	const Coder<vT, bsT> *coder = get_pipeline<vT, bsT>(transform, name);
+	if (nthreads > 1) {
+		coder = new BlockCoder<vT, bsT>(coder, nthreads);
+	}
 
 	Timer timer;
 
+	//coders only read their input, so without a transform they work
+	// straight from the raw bytes
+	//quantizing comes first, so that delta and prediction see bin indices
+	const int64_t qeps = quantize_eps(eps, vscale);
+	vT *quant = NULL;
+	void *asbytes = const_cast<void*>(rawbytes);
+	if (qeps > 0) {
+		quant = static_cast<vT*>(malloc(sizeof(vT)*npoints));
+		quantize(quant, static_cast<const vT*>(rawbytes), npoints, qeps);
+		asbytes = quant;
+	}
+	vT *deltas = NULL;
 	if (deltaenc) {
-		delta_enc_inplace((vT*) asbytes, npoints);
+		deltas = static_cast<vT*>(malloc(sizeof(vT)*npoints));
+		delta_enc(deltas, static_cast<const vT*>(asbytes), npoints);
+		asbytes = deltas;
 	}
 
 	unsigned char *outbits = (unsigned char*) calloc(npoints*BUF_SCALE_FACTOR+12, sizeof(vT));
@@ -96,11 +435,21 @@ void test_roundtrip_inner(
 
 	double tdec = timer.elapsed();
 
-	if ( 0 == memcmp(dout, asbytes, npoints*sizeof(vT)) ) {
-		cout << toprint << name << "," << npoints*sizeof(vT) <<
+	roundtrip_result res;
+	res.rawbytes = npoints*sizeof(vT);
+	res.encbytes = outsize;
+	res.enc = single_trial(tenc);
+	res.dec = single_trial(tdec);
+	res.ok = (0 == memcmp(dout, asbytes, npoints*sizeof(vT)));
+	if (res.ok && qeps > 0) {
+		res.ok = quantize_bound_holds(static_cast<const vT*>(rawbytes), dout, npoints, deltaenc, qeps);
+	}
+
+	if (res.ok) {
+		cout << toprint << pipeline_name(transform, name, eps) << "," << npoints*sizeof(vT) <<
 				"," << outsize << "," << tenc << "," << tdec << endl;
 	} else {
-		cout << toprint << name << "FAIL" << endl;
+		cout << toprint << pipeline_name(transform, name, eps) << "FAIL" << endl;
 		if (false) {
 			print_arr((vT*) asbytes, npoints);
 			cout << endl;
@@ -111,59 +460,189 @@ void test_roundtrip_inner(
 
 	free(outbits);
 	free(dout);
+	free(deltas);
+	free(quant);
 	delete coder;
+
+	return res;
 }
 
-void test_roundtrip(bool deltaenc, CoderName name, vstream vs) {
-	void *bytes = read_fully(vs);
+/**
+ * @param eps if positive, the absolute error allowed, in the stream's units
+ */
+roundtrip_result test_roundtrip(bool deltaenc, CoderName name, vstream vs, uint32_t nthreads = 1,
+		TransformName transform = NO_TRANSFORM, double eps = 0) {
+	roundtrip_result res;
+
+	MappedStream mapped;
+	if (!mapped.open(vs)) {
+		return res;
+	}
+	const void *bytes = mapped.data();
 	//surely there must be a cleaner way of doing this?
 	switch (vs.vsize) {
 	case 1:
-		test_roundtrip_inner<int8_t, uint8_t>("", deltaenc, name, bytes, vs.npoints);
+		res = test_roundtrip_inner<int8_t, uint8_t>("", deltaenc, name, bytes, vs.npoints, nthreads, transform,
+				eps, vs.vscale);
 		break;
 	case 2:
-		test_roundtrip_inner<int16_t, uint16_t>("", deltaenc, name, bytes, vs.npoints);
+		res = test_roundtrip_inner<int16_t, uint16_t>("", deltaenc, name, bytes, vs.npoints, nthreads, transform,
+				eps, vs.vscale);
 		break;
 	case 4:
-		test_roundtrip_inner<int32_t, uint32_t>("", deltaenc, name, bytes, vs.npoints);
+		res = test_roundtrip_inner<int32_t, uint32_t>("", deltaenc, name, bytes, vs.npoints, nthreads, transform,
+				eps, vs.vscale);
 		break;
 	case 8:
-		test_roundtrip_inner<int64_t, uint64_t>("", deltaenc, name, bytes, vs.npoints);
+		res = test_roundtrip_inner<int64_t, uint64_t>("", deltaenc, name, bytes, vs.npoints, nthreads, transform,
+				eps, vs.vscale);
 		break;
 	default:
 		cerr << "Unknown value size:" << vs.vsize << endl;
 		break;
 	}
+	return res;
 }
 
 void test_roundtrips(bool deltaenc) {
 	vector<vstream> streams = get_test_streams();
 	for (vector<vstream>::iterator it = streams.begin(); it != streams.end(); ++it) {
-		test_roundtrip(deltaenc, ELIAS_GAMMA, *it);
-		test_roundtrip(deltaenc, ELIAS_DELTA, *it);
-		test_roundtrip(deltaenc, LOG_HUFFMAN, *it);
-		test_roundtrip(deltaenc, LOG_HUFFMAN_RLE, *it);
-		test_roundtrip(deltaenc, ZLIB, *it);
+		for (unsigned cdx = 0; cdx < N_CODERS; ++cdx) {
+			test_roundtrip(deltaenc, ALL_CODERS[cdx], *it);
+		}
+		//predictors replace delta encoding, shuffles go on top of it
+		for (int t = NO_TRANSFORM + 1; t < N_TRANSFORMS; ++t) {
+			TransformName transform = static_cast<TransformName>(t);
+			for (unsigned cdx = 0; cdx < N_CODERS; ++cdx) {
+				if (!transform_fits(transform, ALL_CODERS[cdx])) {
+					continue;
+				}
+				test_roundtrip(transform_keeps_delta(transform), ALL_CODERS[cdx], *it, 1, transform);
+			}
+		}
+		//lossy, ahead of delta encoding and of prediction
+		for (unsigned cdx = 0; cdx < N_CODERS; ++cdx) {
+			test_roundtrip(true, ALL_CODERS[cdx], *it, 1, NO_TRANSFORM, 1e-4);
+			test_roundtrip(false, ALL_CODERS[cdx], *it, 1, PREDICT, 1e-4);
+		}
+	}
+}
+
+template<typename vT, typename bsT>
+void test_timed_stream_inner(const vstream &vs, const int64_t *ts, const void *rawbytes) {
+	test_timed_series_stream<vT, bsT>(ts, static_cast<const vT*>(rawbytes), vs.npoints);
+}
+
+/**
+ * Range queries over the test streams, in their own time units
+ */
+void test_timed_streams() {
+	vector<vstream> streams = get_test_streams();
+	for (vector<vstream>::iterator it = streams.begin(); it != streams.end(); ++it) {
+		int64_t *ts = load_timestamps(*it);
+		assert( NULL != ts );
+		assert( ts[0] == it->tmin && ts[it->npoints - 1] == it->tmax );
+		MappedStream mapped;
+		assert( mapped.open(*it) );
+		switch (it->vsize) {
+		case 2: test_timed_stream_inner<int16_t, uint16_t>(*it, ts, mapped.data()); break;
+		case 4: test_timed_stream_inner<int32_t, uint32_t>(*it, ts, mapped.data()); break;
+		case 8: test_timed_stream_inner<int64_t, uint64_t>(*it, ts, mapped.data()); break;
+		}
+
+		double unit = pow(10.0, it->tscale);
+		int64_t st0 = 0;
+		int64_t st1 = 0;
+		assert( stored_time_range(*it, it->tmin * unit, it->tmax * unit, &st0, &st1) );
+		assert( st0 == it->tmin && st1 == it->tmax );
+		assert( stored_time_range(*it, (it->tmin - 1000) * unit, (it->tmin + 3) * unit, &st0, &st1) );
+		assert( st0 == it->tmin && st1 == it->tmin + 3 );
+		assert( !stored_time_range(*it, (it->tmax + 1) * unit, (it->tmax + 9) * unit, &st0, &st1) );
+		free(ts);
+	}
+
+	//millisecond epochs: the bounds must stay on their ticks
+	vstream epoch = streams[0];
+	epoch.tmin = 1700000000000ll;
+	epoch.tmax = 1700000100000ll;
+	epoch.tscale = -3;
+	int64_t st0 = 0;
+	int64_t st1 = 0;
+	assert( stored_time_range(epoch, 1700000050, 1700000060, &st0, &st1) );
+	assert( 1700000050000ll == st0 && 1700000060000ll == st1 );
+	assert( stored_time_range(epoch, 1700000050.001, 1700000059.999, &st0, &st1) );
+	assert( 1700000050001ll == st0 && 1700000059999ll == st1 );
+	assert( stored_time_range(epoch, 1700000050.0005, 1700000050.0015, &st0, &st1) );
+	assert( 1700000050001ll == st0 && 1700000050001ll == st1 );
+}
+
+void test_stream_may_match() {
+	vector<vstream> streams = get_test_streams();
+	assert( !streams.empty() );
+	for (vector<vstream>::iterator it = streams.begin(); it != streams.end(); ++it) {
+		assert( stream_may_match(*it, value_predicate::above(it->vmax)) );
+		assert( !stream_may_match(*it, value_predicate::above(it->vmax + 1)) );
+		assert( !stream_may_match(*it, value_predicate::below(it->vmin - 1)) );
 	}
 }
 
 void test_compressor()  {
+	//arith
+	test_arith();
+
 	//bitstream
 	test_bitstream();
+	test_bitio();
+
+	//block
+	test_block();
+	test_stream_may_match();
 
 	//delta
 	test_delta_basic();
 	test_delta_overflow();
 
+	//dict
+	test_dict();
+
 	//eliasgamma
+	test_elias_lut();
 	test_elias_gamma();
 
 	//eliasdelta
 	test_elias_delta();
 
+	//expgolomb
+	test_expgolomb();
+
+	//fcm
+	test_fcm();
+
 	//loghuffman
 	test_loghuffman();
 
+	//lz
+	test_lz();
+
+	//predict
+	test_predict();
+
+	//quantize
+	test_quantize();
+
+	//rans
+	test_rans();
+
+	//rle
+	test_rle();
+
+	//shuffle
+	test_shuffle();
+
+	//timeindex
+	test_timed_series();
+	test_timed_streams();
+
 	//zigzag
 	test_zigzag();
 
@@ -0,0 +1,372 @@
+/*
+ * arith.hpp
+ * @brief context-modelled adaptive arithmetic coder for cold data
+ * @author ishafer
+ */
+
+#ifndef ARITH_HPP_
+#define ARITH_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include "coder.hpp"
+#include "zigzag.hpp"
+#include "../util.hpp"
+
+//adaptive probabilities are 11-bit, and move 1/32 of the way per update
+static const uint32_t ARITH_PROB_BITS = 11;
+static const uint16_t ARITH_PROB_INIT = 1 << (ARITH_PROB_BITS - 1);
+static const uint32_t ARITH_ADAPT_SHIFT = 5;
+static const uint32_t ARITH_TOP = 1u << 24;
+
+//buckets are coded MSB-first down a binary tree of this depth
+static const int ARITH_BUCKET_BITS = 7;
+//buckets (0..64), times the direction of the previous step
+static const int ARITH_NCTX = 65*3;
+//mantissa bits below the leading one that are modelled; the rest are raw
+static const int ARITH_MANTISSA_BITS = 2;
+
+/**
+ * @brief binary range encoder with carry propagation (as in LZMA)
+ */
+class RangeEncoder {
+private:
+	unsigned char *out;
+	uint64_t cap;
+	uint64_t pos;
+	uint64_t low;
+	uint32_t range;
+	unsigned char cache;
+	uint64_t cachesize;
+
+	void put(unsigned char b) {
+		if (pos >= cap) {
+			uint64_t newcap = cap + cap/2 + 16;
+			out = static_cast<unsigned char*>(realloc(out, newcap));
+			cap = newcap;
+		}
+		out[pos++] = b;
+	}
+
+	void shift_low() {
+		if (static_cast<uint32_t>(low) < 0xFF000000u || (low >> 32) != 0) {
+			unsigned char carry = static_cast<unsigned char>(low >> 32);
+			unsigned char b = cache;
+			do {
+				put(b + carry);
+				b = 0xFF;
+			} while (--cachesize != 0);
+			cache = static_cast<unsigned char>(low >> 24);
+		}
+		++cachesize;
+		low = (low & 0x00FFFFFFu) << 8;
+	}
+
+public:
+	/**
+	 * @param _out buffer to write to; may be reallocated
+	 * @param _cap size of the buffer in bytes
+	 */
+	RangeEncoder(unsigned char *_out, uint64_t _cap) :
+		out(_out),
+		cap(_cap),
+		pos(0),
+		low(0),
+		range(0xFFFFFFFFu),
+		cache(0),
+		cachesize(1)
+	{
+	}
+
+	void encode_bit(uint16_t *prob, uint32_t bit) {
+		uint32_t bound = (range >> ARITH_PROB_BITS) * (*prob);
+		if (0 == bit) {
+			range = bound;
+			*prob += ((1 << ARITH_PROB_BITS) - *prob) >> ARITH_ADAPT_SHIFT;
+		} else {
+			low += bound;
+			range -= bound;
+			*prob -= *prob >> ARITH_ADAPT_SHIFT;
+		}
+		while (range < ARITH_TOP) {
+			range <<= 8;
+			shift_low();
+		}
+	}
+
+	/**
+	 * Code the low nb bits of v, MSB first, at probability 1/2
+	 */
+	void encode_direct(uint64_t v, int nb) {
+		for (int i = nb - 1; i >= 0; --i) {
+			range >>= 1;
+			if ((v >> i) & 1) {
+				low += range;
+			}
+			while (range < ARITH_TOP) {
+				range <<= 8;
+				shift_low();
+			}
+		}
+	}
+
+	void flush() {
+		for (int i = 0; i < 5; ++i) {
+			shift_low();
+		}
+	}
+
+	unsigned char* get_backing() {
+		return out;
+	}
+
+	uint64_t written_size() const {
+		return pos;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(RangeEncoder);
+};
+
+/**
+ * @brief decoder for RangeEncoder output; reads zeros past the end
+ */
+class RangeDecoder {
+private:
+	const unsigned char *in;
+	uint64_t size;
+	uint64_t pos;
+	uint32_t range;
+	uint32_t code;
+
+	unsigned char next() {
+		return (pos < size) ? in[pos++] : 0;
+	}
+
+public:
+	RangeDecoder(const unsigned char *_in, uint64_t _size) :
+		in(_in),
+		size(_size),
+		pos(0),
+		range(0xFFFFFFFFu),
+		code(0)
+	{
+		for (int i = 0; i < 5; ++i) {
+			code = (code << 8) | next();
+		}
+	}
+
+	uint32_t decode_bit(uint16_t *prob) {
+		uint32_t bound = (range >> ARITH_PROB_BITS) * (*prob);
+		uint32_t bit;
+		if (code < bound) {
+			range = bound;
+			*prob += ((1 << ARITH_PROB_BITS) - *prob) >> ARITH_ADAPT_SHIFT;
+			bit = 0;
+		} else {
+			code -= bound;
+			range -= bound;
+			*prob -= *prob >> ARITH_ADAPT_SHIFT;
+			bit = 1;
+		}
+		while (range < ARITH_TOP) {
+			range <<= 8;
+			code = (code << 8) | next();
+		}
+		return bit;
+	}
+
+	uint64_t decode_direct(int nb) {
+		uint64_t v = 0;
+		for (int i = 0; i < nb; ++i) {
+			range >>= 1;
+			uint32_t bit = (code >= range);
+			if (bit) {
+				code -= range;
+			}
+			v = (v << 1) | bit;
+			while (range < ARITH_TOP) {
+				range <<= 8;
+				code = (code << 8) | next();
+			}
+		}
+		return v;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(RangeDecoder);
+};
+
+/**
+ * Adaptive probabilities for LogArith; reset for every call
+ */
+struct arith_model {
+	//bucket trees, by context
+	uint16_t buckets[ARITH_NCTX][1 << ARITH_BUCKET_BITS];
+	//top mantissa bit trees, by bucket
+	uint16_t mantissa[65][1 << ARITH_MANTISSA_BITS];
+
+	arith_model() {
+		uint16_t *p = &buckets[0][0];
+		for (size_t i = 0; i < sizeof(buckets)/sizeof(uint16_t); ++i) {
+			p[i] = ARITH_PROB_INIT;
+		}
+		p = &mantissa[0][0];
+		for (size_t i = 0; i < sizeof(mantissa)/sizeof(uint16_t); ++i) {
+			p[i] = ARITH_PROB_INIT;
+		}
+	}
+
+	/**
+	 * @returns context for the next bucket, from the last two
+	 */
+	static uint32_t context(uint32_t prev, uint32_t prev2) {
+		uint32_t dir = (prev2 < prev) ? 0 : ((prev2 == prev) ? 1 : 2);
+		return prev*3 + dir;
+	}
+};
+
+/**
+ * Archival coder: adaptive binary arithmetic coding of each value's log
+ *  bucket (as LogHuffman), in the context of the previous bucket and the
+ *  direction of the step before it, then the top ARITH_MANTISSA_BITS of
+ *  the mantissa under a per-bucket model, then the remaining bits raw.
+ * Much slower than LogHuffman, for data that is written once and rarely read.
+ */
+template<typename vT, typename bsT>
+class LogArith : public Coder<vT, bsT> {
+public:
+	LogArith() {};
+	~LogArith() {};
+
+	unsigned char* enc(
+			unsigned char *out,
+			uint64_t *outsize,
+			vT *in,
+			uint64_t insize) const {
+		arith_model *model = new arith_model();
+		RangeEncoder rc(out, *outsize);
+		uint32_t prev = 0;
+		uint32_t prev2 = 0;
+		for (uint64_t i = 0; i < insize; ++i) {
+			uint64_t v = ZIGZAG_ENC(static_cast<int64_t>(in[i])) + 1;
+			uint32_t nb = nbits(v);
+
+			uint16_t *probs = model->buckets[arith_model::context(prev, prev2)];
+			uint32_t node = 1;
+			for (int b = ARITH_BUCKET_BITS - 1; b >= 0; --b) {
+				uint32_t bit = (nb >> b) & 1;
+				rc.encode_bit(&probs[node], bit);
+				node = (node << 1) | bit;
+			}
+
+			int mbits = nb - 1;
+			int modelled = min(mbits, ARITH_MANTISSA_BITS);
+			node = 1;
+			for (int b = mbits - 1; b >= mbits - modelled; --b) {
+				uint32_t bit = (v >> b) & 1;
+				rc.encode_bit(&model->mantissa[nb][node], bit);
+				node = (node << 1) | bit;
+			}
+			rc.encode_direct(v, mbits - modelled);
+
+			prev2 = prev;
+			prev = nb;
+		}
+		rc.flush();
+		delete model;
+
+		*outsize = rc.written_size();
+		return rc.get_backing();
+	}
+
+	vT* dec(vT *out,
+			uint64_t *outsize,
+			unsigned char *in,
+			uint64_t insize) const {
+		arith_model *model = new arith_model();
+		RangeDecoder rc(in, insize);
+		uint32_t prev = 0;
+		uint32_t prev2 = 0;
+		for (uint64_t i = 0; i < *outsize; ++i) {
+			uint16_t *probs = model->buckets[arith_model::context(prev, prev2)];
+			uint32_t node = 1;
+			for (int b = 0; b < ARITH_BUCKET_BITS; ++b) {
+				node = (node << 1) | rc.decode_bit(&probs[node]);
+			}
+			uint32_t nb = node - (1 << ARITH_BUCKET_BITS);
+
+			int mbits = nb - 1;
+			int modelled = min(mbits, ARITH_MANTISSA_BITS);
+			node = 1;
+			for (int b = 0; b < modelled; ++b) {
+				node = (node << 1) | rc.decode_bit(&model->mantissa[nb][node]);
+			}
+			uint64_t v = node;
+			v = (v << (mbits - modelled)) | rc.decode_direct(mbits - modelled);
+			out[i] = ZIGZAG_DEC(v - 1);
+
+			prev2 = prev;
+			prev = nb;
+		}
+		delete model;
+		return out;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(LogArith);
+};
+
+void test_range_coder() {
+	const int n = 2000;
+	uint64_t seed = 99;
+	unsigned char *buf = static_cast<unsigned char*>(malloc(4));
+	RangeEncoder enc(buf, 4);
+	uint16_t prob = ARITH_PROB_INIT;
+	for (int i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		enc.encode_bit(&prob, (seed >> 60) == 0);
+		enc.encode_direct(seed >> 40, 13);
+	}
+	enc.flush();
+	//started tiny, so it must have grown
+	buf = enc.get_backing();
+	assert( enc.written_size() > 4 );
+
+	seed = 99;
+	prob = ARITH_PROB_INIT;
+	RangeDecoder dec(buf, enc.written_size());
+	for (int i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		assert( dec.decode_bit(&prob) == ((seed >> 60) == 0) );
+		assert( dec.decode_direct(13) == ((seed >> 40) & 0x1FFF) );
+	}
+	free(buf);
+}
+
+void test_arith_basic() {
+	LogArith<int8_t, uint8_t> coder8;
+	LogArith<int32_t, uint32_t> coder32;
+	LogArith<int64_t, uint64_t> coder64;
+
+	int32_t din[] = {1, 2, 4, 5, 6, -3, 8};
+	test_coder_array(coder32, (int32_t*) din, sizeof(din)/sizeof(int32_t));
+
+	int32_t din2[] = {0, 181817, 363636, 545454, 363636, 363636, 545454, 1, 2, 3, 4, 5};
+	test_coder_array(coder32, (int32_t*) din2, sizeof(din2)/sizeof(int32_t));
+
+	int64_t din3[] = {31014740000, 31000620000, 30985390000, 30968450000, 30950330000};
+	test_coder_array(coder64, (int64_t*) din3, sizeof(din3)/sizeof(int64_t));
+
+	int8_t din4[] = {-128, 127, 0, 0, 0, -1, 1, 5};
+	test_coder_array(coder8, (int8_t*) din4, sizeof(din4)/sizeof(int8_t));
+}
+
+void test_arith() {
+	test_range_coder();
+	test_arith_basic();
+}
+
+#endif /* ARITH_HPP_ */
@@ -0,0 +1,358 @@
+/**
+ * bitio.hpp
+ * @brief word-at-a-time bit reader and writer, in BitStream's format
+ * @author ishafer
+ */
+
+#ifndef BITIO_HPP_
+#define BITIO_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include "bitstream.hpp"
+#include "../util.hpp"
+
+/**
+ * @returns the 8 bytes at p as a big-endian word
+ */
+inline uint64_t load_be64(const unsigned char *p) {
+	uint64_t w;
+	memcpy(&w, p, sizeof(w));
+#if defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	return w;
+}
+
+inline void store_be64(unsigned char *p, uint64_t w) {
+#if defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	memcpy(p, &w, sizeof(w));
+}
+
+/**
+ * @brief reads the MSB-first bytes a BitStream<unsigned char, *> writes,
+ *  keeping up to 64 bits buffered so that peeks and skips are shifts.
+ * Reads zeros past the end of the input.
+ */
+class BitReader {
+private:
+	const unsigned char *cur;
+	const unsigned char *end;
+	//buffered bits, left aligned; everything below them is zero or
+	// a copy of the bits that follow
+	uint64_t buf;
+	//number of valid bits in buf; at most 63
+	int32_t avail;
+
+public:
+	//most bits peek() can return
+	static const int32_t MAX_PEEK = 56;
+
+	BitReader(const unsigned char *in, uint64_t insize) :
+		cur(in),
+		end(in + insize),
+		buf(0),
+		avail(0)
+	{
+		refill();
+	}
+
+	/**
+	 * Top up the buffer to at least MAX_PEEK bits
+	 */
+	inline void refill() {
+		if (end - cur >= 8) {
+			buf |= load_be64(cur) >> avail;
+			int32_t nbytes = (63 - avail) >> 3;
+			cur += nbytes;
+			avail += 8*nbytes;
+		} else {
+			while (avail < MAX_PEEK) {
+				uint64_t b = (cur < end) ? *cur++ : 0;
+				buf |= b << (56 - avail);
+				avail += 8;
+			}
+		}
+	}
+
+	/**
+	 * @returns the next nb (1 to MAX_PEEK) bits without consuming them
+	 */
+	inline uint64_t peek(int32_t nb) {
+		if (avail < nb) {
+			refill();
+		}
+		return buf >> (64 - nb);
+	}
+
+	inline void skip(int32_t nb) {
+		buf <<= nb;
+		avail -= nb;
+	}
+
+	/**
+	 * @returns the next nb (0 to 64) bits
+	 */
+	inline uint64_t read(int32_t nb) {
+		if (0 == nb) {
+			return 0;
+		}
+		if (nb > MAX_PEEK) {
+			uint64_t hi = read(nb - 32);
+			return (hi << 32) | read(32);
+		}
+		uint64_t v = peek(nb);
+		skip(nb);
+		return v;
+	}
+
+	/**
+	 * Consume zero bits up to and including the next one
+	 * @returns number of zeros; if there are more than limit, only limit
+	 *  of them are consumed
+	 */
+	inline uint32_t read_unary(uint32_t limit) {
+		uint32_t nz = 0;
+		for (;;) {
+			if (avail <= MAX_PEEK) {
+				refill();
+			}
+			uint64_t top = buf | (static_cast<uint64_t>(1) << (63 - avail));
+			uint32_t z = __builtin_clzll(top);
+			if (z < static_cast<uint32_t>(avail)) {
+				if (z > limit - nz) {
+					skip(limit - nz);
+					return limit;
+				}
+				//a run of exactly limit still has its one consumed
+				skip(z + 1);
+				return nz + z;
+			}
+			//all zeros; start the buffer over
+			if (nz + avail > limit) {
+				skip(limit - nz);
+				return limit;
+			}
+			nz += avail;
+			buf = 0;
+			avail = 0;
+		}
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(BitReader);
+};
+
+/**
+ * @brief writes the same MSB-first bytes as BitStream<unsigned char, *>,
+ *  gathering bits in a word and storing whole words at a time.
+ * Unlike BitStream, it overwrites the buffer rather than ORing into it.
+ */
+class BitWriter {
+private:
+	unsigned char *out;
+	uint64_t cap;
+	uint64_t pos;
+	//pending bits, left aligned; everything below them is zero
+	uint64_t acc;
+	//number of pending bits
+	int32_t nacc;
+
+	/**
+	 * Store the whole bytes of acc
+	 */
+	inline void flush_bytes() {
+		if (pos + sizeof(uint64_t) > cap) {
+			uint64_t newcap = cap + cap/2 + 16;
+			out = static_cast<unsigned char*>(realloc(out, newcap));
+			cap = newcap;
+		}
+		store_be64(out + pos, acc);
+		int32_t nbytes = nacc >> 3;
+		pos += nbytes;
+		acc = (8 == nbytes) ? 0 : (acc << (8*nbytes));
+		nacc -= 8*nbytes;
+	}
+
+public:
+	//most bits write() takes at once
+	static const int32_t MAX_WRITE = 56;
+
+	/**
+	 * @param _out buffer to write to; may be reallocated
+	 * @param _cap size of the buffer in bytes
+	 */
+	BitWriter(unsigned char *_out, uint64_t _cap) :
+		out(_out),
+		cap(_cap),
+		pos(0),
+		acc(0),
+		nacc(0)
+	{
+	}
+
+	/**
+	 * Write the low nb (0 to MAX_WRITE) bits of v
+	 */
+	inline void write(uint64_t v, int32_t nb) {
+		if (0 == nb) {
+			return;
+		}
+		if (nacc + nb > 64) {
+			flush_bytes();
+		}
+		v &= (static_cast<uint64_t>(1) << nb) - 1;
+		acc |= v << (64 - nacc - nb);
+		nacc += nb;
+	}
+
+	/**
+	 * Write the low nb (0 to 64) bits of v
+	 */
+	inline void write_wide(uint64_t v, int32_t nb) {
+		if (nb > MAX_WRITE) {
+			write(v >> 32, nb - 32);
+			nb = 32;
+		}
+		write(v, nb);
+	}
+
+	/**
+	 * Store any pending bits, padding the last byte with zeros
+	 * @returns bytes written
+	 */
+	uint64_t finish() {
+		flush_bytes();
+		if (nacc > 0) {
+			out[pos++] = static_cast<unsigned char>(acc >> 56);
+			acc = 0;
+			nacc = 0;
+		}
+		return pos;
+	}
+
+	unsigned char* get_backing() {
+		return out;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(BitWriter);
+};
+
+void test_bitreader_basic() {
+	BitStream<unsigned char, uint64_t> bs(4);
+	uint64_t seed = 5;
+	const int n = 500;
+	for (int i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		int32_t nb = 1 + (seed >> 58) % 63;
+		bs.write_bits(seed & ((static_cast<uint64_t>(1) << nb) - 1), nb);
+	}
+
+	BitReader br(bs.get_backing(), bs.written_size());
+	seed = 5;
+	for (int i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		int32_t nb = 1 + (seed >> 58) % 63;
+		uint64_t expect = seed & ((static_cast<uint64_t>(1) << nb) - 1);
+		if (i % 2 || nb > BitReader::MAX_PEEK) {
+			assert( br.read(nb) == expect );
+		} else {
+			assert( br.peek(nb) == expect );
+			br.skip(nb);
+		}
+	}
+	//zeros past the end
+	for (int i = 0; i < 10; ++i) {
+		assert( br.read(64) == 0 );
+	}
+}
+
+void test_bitreader_unary() {
+	//1, 01, 001, ... then 70 zeros and a one
+	unsigned char bytes[64];
+	memset(bytes, 0, sizeof(bytes));
+	BitStream<unsigned char, uint32_t> bs(bytes, sizeof(bytes), WRITE);
+	for (int z = 0; z < 20; ++z) {
+		bs.write_bits(1, z + 1);
+	}
+	bs.write_bits(0, 30);
+	bs.write_bits(0, 30);
+	bs.write_bits(1, 11);
+
+	BitReader br(bytes, sizeof(bytes));
+	for (uint32_t z = 0; z < 20; ++z) {
+		assert( br.read_unary(64) == z );
+	}
+	assert( br.read_unary(64) == 64 );
+	assert( br.read_unary(64) == 6 );
+	assert( br.read_unary(64) == 64 );
+
+	//runs of exactly the limit, as in 64-bit gamma codes, then a marker
+	memset(bytes, 0, sizeof(bytes));
+	BitStream<unsigned char, uint32_t> bs2(bytes, sizeof(bytes), WRITE);
+	for (int r = 0; r < 2; ++r) {
+		bs2.write_bits(0, 31);
+		bs2.write_bits(0, 31);
+		bs2.write_bits(1, 2);
+	}
+	bs2.write_bits(5, 3);
+	BitReader br2(bytes, sizeof(bytes));
+	assert( br2.read_unary(63) == 63 );
+	//a longer run leaves the rest of its zeros
+	assert( br2.read_unary(32) == 32 );
+	assert( br2.read_unary(31) == 31 );
+	assert( br2.read_unary(1) == 0 );
+	assert( br2.read(2) == 1 );
+}
+
+/**
+ * BitWriter output must be byte-identical to BitStream's
+ */
+void test_bitwriter() {
+	BitStream<unsigned char, uint64_t> bs(4);
+	//start tiny, to check it grows
+	unsigned char *buf = static_cast<unsigned char*>(malloc(2));
+	BitWriter bw(buf, 2);
+	uint64_t seed = 11;
+	for (int i = 0; i < 700; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		int32_t nb = (seed >> 58) % 65;
+		uint64_t v = (64 == nb) ? seed : seed & ((static_cast<uint64_t>(1) << nb) - 1);
+		if (nb > 63) {
+			bs.write_bits(v >> 32, nb - 32);
+			bs.write_bits(v & 0xFFFFFFFF, 32);
+		} else {
+			bs.write_bits(v, nb);
+		}
+		//high garbage bits must be ignored
+		uint64_t garbage = (nb < 64) ? (seed << nb) : 0;
+		bw.write_wide(v | garbage, nb);
+	}
+	uint64_t nbytes = bw.finish();
+	buf = bw.get_backing();
+	assert( nbytes == (bs.written_bits() + 7) / 8 );
+	assert( 0 == memcmp(buf, bs.get_backing(), nbytes) );
+
+	BitReader br(buf, nbytes);
+	seed = 11;
+	for (int i = 0; i < 700; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		int32_t nb = (seed >> 58) % 65;
+		uint64_t v = (64 == nb) ? seed : seed & ((static_cast<uint64_t>(1) << nb) - 1);
+		assert( br.read(nb) == v );
+	}
+	free(buf);
+}
+
+void test_bitio() {
+	test_bitreader_basic();
+	test_bitreader_unary();
+	test_bitwriter();
+}
+
+#endif /* BITIO_HPP_ */
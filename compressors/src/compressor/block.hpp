@@ -0,0 +1,1008 @@
+/**
+ * block.hpp
+ * @brief split a stream into independently coded blocks
+ *  and encode/decode them in parallel
+ * @author ishafer
+ */
+
+#ifndef BLOCK_HPP_
+#define BLOCK_HPP_
+
+#include <unistd.h>
+#include <pthread.h>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "coder.hpp"
+#include "eliasgamma.hpp"
+#include "eliasdelta.hpp"
+#include "loghuffman.hpp"
+#include "lz.hpp"
+#include "zlib.hpp"
+#include "../util.hpp"
+
+using namespace std;
+
+const uint32_t DEFAULT_BLOCK_VALUES = 1 << 16;
+
+/**
+ * Header at the start of a blocked stream.
+ * Followed by (nblocks + 1) uint64_t byte offsets into the payload,
+ *  then a block_summary for each block,
+ *  then the concatenated block payloads.
+ */
+struct block_header {
+	uint64_t nvalues;
+	uint32_t block_values;
+	uint32_t nblocks;
+};
+
+/**
+ * Aggregates of some values, as coded (so of deltas, if the caller delta
+ *  encoded). The sum wraps past 64 bits, like the values themselves.
+ */
+struct block_summary {
+	int64_t min_value;
+	int64_t max_value;
+	int64_t sum;
+	int64_t first;
+	int64_t last;
+	uint64_t count;
+
+	block_summary() :
+		min_value(numeric_limits<int64_t>::max()),
+		max_value(numeric_limits<int64_t>::min()),
+		sum(0),
+		first(0),
+		last(0),
+		count(0)
+	{
+	}
+
+	void add(int64_t v) {
+		if (0 == count) {
+			first = v;
+		}
+		min_value = min(min_value, v);
+		max_value = max(max_value, v);
+		sum = static_cast<int64_t>(static_cast<uint64_t>(sum) + static_cast<uint64_t>(v));
+		last = v;
+		++count;
+	}
+
+	/**
+	 * Add the values of o, which come after ours
+	 */
+	void merge(const block_summary &o) {
+		if (0 == o.count) {
+			return;
+		}
+		if (0 == count) {
+			first = o.first;
+		}
+		min_value = min(min_value, o.min_value);
+		max_value = max(max_value, o.max_value);
+		sum = static_cast<int64_t>(static_cast<uint64_t>(sum) + static_cast<uint64_t>(o.sum));
+		last = o.last;
+		count += o.count;
+	}
+};
+
+template<typename vT>
+block_summary summarize(const vT *vals, uint64_t n) {
+	block_summary res;
+	for (uint64_t i = 0; i < n; ++i) {
+		res.add(vals[i]);
+	}
+	return res;
+}
+
+/**
+ * @returns bytes before the payload of a blocked stream
+ */
+inline uint64_t block_header_size(uint32_t nblocks) {
+	return sizeof(block_header) + sizeof(uint64_t)*(static_cast<uint64_t>(nblocks) + 1) +
+			sizeof(block_summary)*static_cast<uint64_t>(nblocks);
+}
+
+/**
+ * Reads the header, offsets and summaries of a blocked stream in place
+ */
+struct block_index {
+	block_header hdr;
+	const unsigned char *offsets;
+	const unsigned char *summaries;
+	const unsigned char *payload;
+
+	/**
+	 * @returns false if in is too short for its header, or the header
+	 *  doesn't describe whole blocks within in
+	 */
+	bool open(const unsigned char *in, uint64_t insize) {
+		memset(&hdr, 0, sizeof(hdr));
+		if (insize < sizeof(hdr)) {
+			cerr << "block stream truncated" << endl;
+			return false;
+		}
+		memcpy(&hdr, in, sizeof(hdr));
+		if (block_header_size(hdr.nblocks) > insize) {
+			cerr << "block stream truncated" << endl;
+			hdr.nblocks = 0;
+			hdr.nvalues = 0;
+			return false;
+		}
+		offsets = in + sizeof(hdr);
+		summaries = offsets + sizeof(uint64_t)*(static_cast<uint64_t>(hdr.nblocks) + 1);
+		payload = in + block_header_size(hdr.nblocks);
+		if (!fits(insize - block_header_size(hdr.nblocks))) {
+			cerr << "block stream corrupt" << endl;
+			hdr.nblocks = 0;
+			hdr.nvalues = 0;
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * @returns whether the blocks cover nvalues, and their offsets rise from
+	 *  0 within a payload of paysize bytes
+	 */
+	bool fits(uint64_t paysize) const {
+		if (0 == hdr.block_values ||
+				hdr.nvalues / hdr.block_values + (0 != hdr.nvalues % hdr.block_values) != hdr.nblocks ||
+				0 != offset(0)) {
+			return false;
+		}
+		for (uint32_t bdx = 0; bdx < hdr.nblocks; ++bdx) {
+			if (offset(bdx + 1) < offset(bdx)) {
+				return false;
+			}
+		}
+		return offset(hdr.nblocks) <= paysize;
+	}
+
+	uint64_t block_start(uint32_t bdx) const {
+		return static_cast<uint64_t>(bdx) * hdr.block_values;
+	}
+
+	uint64_t block_len(uint32_t bdx) const {
+		return min(static_cast<uint64_t>(hdr.block_values), hdr.nvalues - block_start(bdx));
+	}
+
+	uint64_t offset(uint32_t bdx) const {
+		uint64_t off;
+		memcpy(&off, offsets + sizeof(uint64_t)*bdx, sizeof(off));
+		return off;
+	}
+
+	block_summary summary(uint32_t bdx) const {
+		block_summary bs;
+		memcpy(&bs, summaries + sizeof(block_summary)*bdx, sizeof(bs));
+		return bs;
+	}
+};
+
+/**
+ * Bucket b of n over len values starts at len*b/n, so sizes differ by at most one
+ */
+inline uint64_t bucket_start(uint64_t len, uint32_t nbuckets, uint64_t b) {
+	return len*b / nbuckets;
+}
+
+/**
+ * @returns the bucket holding value p of len
+ */
+inline uint32_t bucket_of(uint64_t len, uint32_t nbuckets, uint64_t p) {
+	return static_cast<uint32_t>(((p + 1)*nbuckets + len - 1) / len - 1);
+}
+
+/**
+ * Values in [lo, hi]; checked against block summaries as zone maps
+ */
+struct value_predicate {
+	int64_t lo;
+	int64_t hi;
+
+	value_predicate(int64_t _lo, int64_t _hi) :
+		lo(_lo),
+		hi(_hi)
+	{
+	}
+
+	static value_predicate above(int64_t t) {
+		return value_predicate(t, numeric_limits<int64_t>::max());
+	}
+
+	static value_predicate below(int64_t t) {
+		return value_predicate(numeric_limits<int64_t>::min(), t);
+	}
+
+	bool matches(int64_t v) const {
+		return lo <= v && v <= hi;
+	}
+
+	/**
+	 * @returns whether a value in [vmin, vmax] could match
+	 */
+	bool may_match(int64_t vmin, int64_t vmax) const {
+		return lo <= vmax && vmin <= hi && lo <= hi;
+	}
+
+	bool may_match(const block_summary &bs) const {
+		return bs.count > 0 && may_match(bs.min_value, bs.max_value);
+	}
+
+	bool all_match(const block_summary &bs) const {
+		return lo <= bs.min_value && bs.max_value <= hi;
+	}
+};
+
+/**
+ * @returns number of online cores (at least 1)
+ */
+uint32_t num_cores() {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? static_cast<uint32_t>(n) : 1;
+}
+
+/**
+ * Work shared by all threads of a single enc/dec call.
+ * Threads claim blocks from next_block until all are done.
+ */
+template<typename vT, typename bsT>
+struct block_job {
+	const Coder<vT, bsT> *inner;
+	uint64_t nvalues;
+	uint32_t block_values;
+	uint32_t nblocks;
+	volatile uint32_t next_block;
+
+	//raw values (enc input, dec output)
+	vT *vals;
+	//per-block encoded bytes, sizes and summaries (enc output)
+	unsigned char **bufs;
+	uint64_t *sizes;
+	block_summary *summaries;
+	//encoded payload and offsets (dec input)
+	unsigned char *payload;
+	uint64_t *offsets;
+	//blocks the inner coder decoded short (dec output)
+	volatile uint32_t nfailed;
+
+	uint64_t block_len(uint32_t bdx) const {
+		uint64_t start = static_cast<uint64_t>(bdx) * block_values;
+		return min(static_cast<uint64_t>(block_values), nvalues - start);
+	}
+};
+
+template<typename vT, typename bsT>
+void* block_enc_worker(void *arg) {
+	block_job<vT, bsT> *job = static_cast<block_job<vT, bsT>*>(arg);
+	uint32_t bdx;
+	while ((bdx = __sync_fetch_and_add(&job->next_block, 1)) < job->nblocks) {
+		uint64_t len = job->block_len(bdx);
+		vT *src = job->vals + static_cast<uint64_t>(bdx)*job->block_values;
+		job->summaries[bdx] = summarize(src, len);
+		//bitstream coders OR into their output, so it must start zeroed
+		unsigned char *buf = static_cast<unsigned char*>(
+				calloc(len*BUF_SCALE_FACTOR+12, sizeof(vT)));
+		uint64_t bufsize = sizeof(vT)*(len*BUF_SCALE_FACTOR+12);
+		job->bufs[bdx] = job->inner->enc(buf, &bufsize, src, len);
+		job->sizes[bdx] = bufsize;
+	}
+	return NULL;
+}
+
+template<typename vT, typename bsT>
+void* block_dec_worker(void *arg) {
+	block_job<vT, bsT> *job = static_cast<block_job<vT, bsT>*>(arg);
+	uint32_t bdx;
+	while ((bdx = __sync_fetch_and_add(&job->next_block, 1)) < job->nblocks) {
+		uint64_t len = job->block_len(bdx);
+		vT *dst = job->vals + static_cast<uint64_t>(bdx)*job->block_values;
+		vT *res = job->inner->dec(dst, &len,
+				job->payload + job->offsets[bdx],
+				job->offsets[bdx+1] - job->offsets[bdx]);
+		if (len != job->block_len(bdx)) {
+			__sync_fetch_and_add(&job->nfailed, 1);
+			len = min(len, job->block_len(bdx));
+		}
+		if (res != dst) {
+			memcpy(dst, res, len*sizeof(vT));
+			free(res);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Run worker over job on nthreads threads (including this one)
+ */
+template<typename vT, typename bsT>
+void run_block_job(block_job<vT, bsT> &job, uint32_t nthreads, void* (*worker)(void*)) {
+	nthreads = min(nthreads, job.nblocks);
+	pthread_t *threads = new pthread_t[nthreads];
+	uint32_t nstarted = 0;
+	for (uint32_t t = 1; t < nthreads; ++t) {
+		if (0 != pthread_create(&threads[nstarted], NULL, worker, &job)) {
+			cerr << "couldn't start block thread; continuing with "
+					<< nstarted + 1 << endl;
+			break;
+		}
+		++nstarted;
+	}
+	worker(&job);
+	for (uint32_t t = 0; t < nstarted; ++t) {
+		pthread_join(threads[t], NULL);
+	}
+	delete[] threads;
+}
+
+/**
+ * Chunk-parallel wrapper around any other coder.
+ * Input is split into blocks of block_values values; each block is
+ *  coded independently by the inner coder, so blocks can be encoded
+ *  and decoded on separate cores.
+ * Each block's summary is kept in the header, so aggregates over a range
+ *  only decode the blocks at its edges.
+ * Owns (and deletes) the inner coder.
+ */
+template<typename vT, typename bsT>
+class BlockCoder : public Coder<vT, bsT> {
+public:
+	/**
+	 * @param _inner coder to use for each block
+	 * @param _nthreads number of threads to use; 0 for one per core
+	 * @param _block_values number of values in each block
+	 */
+	BlockCoder(const Coder<vT, bsT> *_inner,
+			uint32_t _nthreads = 0,
+			uint32_t _block_values = DEFAULT_BLOCK_VALUES) :
+		inner(_inner),
+		nthreads(_nthreads == 0 ? num_cores() : _nthreads),
+		block_values(_block_values)
+	{
+		assert(block_values > 0);
+	}
+
+	~BlockCoder() {
+		delete inner;
+	}
+
+	unsigned char* enc(
+			unsigned char *out,
+			uint64_t *outsize,
+			vT *in,
+			uint64_t insize) const {
+		block_job<vT, bsT> job;
+		init_job(job, in, insize);
+		job.bufs = new unsigned char*[job.nblocks];
+		job.sizes = new uint64_t[job.nblocks];
+		job.summaries = new block_summary[job.nblocks];
+
+		run_block_job(job, nthreads, block_enc_worker<vT, bsT>);
+
+		uint64_t hdrsize = block_header_size(job.nblocks);
+		uint64_t total = hdrsize;
+		for (uint32_t bdx = 0; bdx < job.nblocks; ++bdx) {
+			total += job.sizes[bdx];
+		}
+		if (total > *outsize) {
+			unsigned char *res = static_cast<unsigned char*>(realloc(out, total));
+			if (NULL == res) {
+				cerr << "failed to expand block output" << endl;
+				*outsize = 0;
+				free_bufs(job);
+				return out;
+			}
+			out = res;
+		}
+
+		block_header hdr;
+		hdr.nvalues = job.nvalues;
+		hdr.block_values = job.block_values;
+		hdr.nblocks = job.nblocks;
+		memcpy(out, &hdr, sizeof(hdr));
+
+		unsigned char *offp = out + sizeof(hdr);
+		unsigned char *payload = out + hdrsize;
+		uint64_t off = 0;
+		for (uint32_t bdx = 0; bdx < job.nblocks; ++bdx) {
+			memcpy(offp, &off, sizeof(off));
+			offp += sizeof(off);
+			memcpy(payload + off, job.bufs[bdx], job.sizes[bdx]);
+			off += job.sizes[bdx];
+		}
+		memcpy(offp, &off, sizeof(off));
+		offp += sizeof(off);
+		memcpy(offp, job.summaries, sizeof(block_summary)*job.nblocks);
+
+		free_bufs(job);
+		*outsize = total;
+		return out;
+	}
+
+	vT* dec(vT *out,
+			uint64_t *outsize,
+			unsigned char *in,
+			uint64_t insize) const {
+		block_index idx;
+		uint64_t nvalues = *outsize;
+		*outsize = 0;
+		if (!idx.open(in, insize)) {
+			return out;
+		}
+		if (idx.hdr.nvalues > nvalues) {
+			cerr << "block stream has " << idx.hdr.nvalues <<
+					" values but only " << nvalues << " requested" << endl;
+			return out;
+		}
+
+		//open() checked the blocks follow from the count, so they can't run past out
+		block_job<vT, bsT> job;
+		init_job(job, out, idx.hdr.nvalues);
+		job.block_values = idx.hdr.block_values;
+		job.nblocks = idx.hdr.nblocks;
+		job.offsets = new uint64_t[job.nblocks + 1];
+		memcpy(job.offsets, idx.offsets, sizeof(uint64_t)*(job.nblocks + 1));
+		job.payload = const_cast<unsigned char*>(idx.payload);
+
+		run_block_job(job, nthreads, block_dec_worker<vT, bsT>);
+
+		delete[] job.offsets;
+		if (job.nfailed > 0) {
+			cerr << job.nfailed << " blocks failed to decode" << endl;
+			return out;
+		}
+		*outsize = job.nvalues;
+		return out;
+	}
+
+	/**
+	 * Decode only block bdx of a stream this coder encoded
+	 * @param out room for a block of values
+	 * @returns number of values decoded; 0 if there's no such block, or it
+	 *  fails to decode
+	 */
+	uint64_t decode_one(const unsigned char *in, uint64_t insize, uint32_t bdx, vT *out) const {
+		block_index idx;
+		if (!idx.open(in, insize) || bdx >= idx.hdr.nblocks || !decode_into(idx, bdx, out)) {
+			return 0;
+		}
+		return idx.block_len(bdx);
+	}
+
+	/**
+	 * Aggregate values [from, to) of a stream this coder encoded.
+	 * Blocks wholly in the range are answered from their summaries;
+	 *  only the (at most two) partly covered ones are decoded.
+	 * @param ndecoded if not NULL, set to the number of blocks decoded
+	 * @returns an empty summary if a block fails to decode
+	 */
+	block_summary aggregate(const unsigned char *in, uint64_t insize,
+			uint64_t from, uint64_t to, uint32_t *ndecoded = NULL) const {
+		block_summary res;
+		uint32_t decoded = 0;
+		block_index idx;
+		to = idx.open(in, insize) ? min(to, idx.hdr.nvalues) : 0;
+		vT *tmp = NULL;
+		for (uint64_t start = (from < to) ? from - from % idx.hdr.block_values : to;
+				start < to; start += idx.hdr.block_values) {
+			uint32_t bdx = static_cast<uint32_t>(start / idx.hdr.block_values);
+			uint64_t len = idx.block_len(bdx);
+			if (from <= start && start + len <= to) {
+				res.merge(idx.summary(bdx));
+				continue;
+			}
+			if (!decode_block(idx, bdx, tmp)) {
+				res = block_summary();
+				break;
+			}
+			uint64_t lo = max(from, start) - start;
+			uint64_t hi = min(to, start + len) - start;
+			res.merge(summarize(tmp + lo, hi - lo));
+			++decoded;
+		}
+		free(tmp);
+		if (NULL != ndecoded) {
+			*ndecoded = decoded;
+		}
+		return res;
+	}
+
+	/**
+	 * Positions of the values of a stream this coder encoded that match
+	 *  pred. Blocks whose summary (zone map) rules out a match are skipped,
+	 *  and blocks whose summary guarantees one are not decoded either.
+	 * @param ndecoded if not NULL, set to the number of blocks decoded
+	 * @returns no positions if a block fails to decode
+	 */
+	vector<uint64_t> find(const unsigned char *in, uint64_t insize,
+			const value_predicate &pred, uint32_t *ndecoded = NULL) const {
+		vector<uint64_t> res;
+		uint32_t decoded = 0;
+		block_index idx;
+		uint32_t nblocks = idx.open(in, insize) ? idx.hdr.nblocks : 0;
+		vT *tmp = NULL;
+		for (uint32_t bdx = 0; bdx < nblocks; ++bdx) {
+			block_summary bs = idx.summary(bdx);
+			if (!pred.may_match(bs)) {
+				continue;
+			}
+			uint64_t start = idx.block_start(bdx);
+			uint64_t len = idx.block_len(bdx);
+			if (pred.all_match(bs)) {
+				for (uint64_t i = 0; i < len; ++i) {
+					res.push_back(start + i);
+				}
+				continue;
+			}
+			if (!decode_block(idx, bdx, tmp)) {
+				res.clear();
+				break;
+			}
+			for (uint64_t i = 0; i < len; ++i) {
+				if (pred.matches(tmp[i])) {
+					res.push_back(start + i);
+				}
+			}
+			++decoded;
+		}
+		free(tmp);
+		if (NULL != ndecoded) {
+			*ndecoded = decoded;
+		}
+		return res;
+	}
+
+	/**
+	 * Downsample values [from, to) of a stream this coder encoded into
+	 *  nbuckets equal buckets, keeping the min, max, first and last of each
+	 *  (M4), which is all a line plot of the bucket shows.
+	 * Blocks within one bucket are answered from their summaries; the
+	 *  blocks that bucket edges cut through are decoded one at a time, so
+	 *  the cost follows the number of buckets, not of values.
+	 * @param ndecoded if not NULL, set to the number of blocks decoded
+	 * @returns empty buckets if a block fails to decode
+	 */
+	vector<block_summary> downsample(const unsigned char *in, uint64_t insize,
+			uint64_t from, uint64_t to, uint32_t nbuckets, uint32_t *ndecoded = NULL) const {
+		vector<block_summary> res(nbuckets);
+		uint32_t decoded = 0;
+		block_index idx;
+		to = idx.open(in, insize) ? min(to, idx.hdr.nvalues) : 0;
+		const uint64_t len = (from < to) ? to - from : 0;
+		vT *tmp = NULL;
+		for (uint64_t start = (len > 0 && nbuckets > 0) ? from - from % idx.hdr.block_values : to;
+				start < to; start += idx.hdr.block_values) {
+			uint32_t bdx = static_cast<uint32_t>(start / idx.hdr.block_values);
+			uint64_t blen = idx.block_len(bdx);
+			//block-relative, then range-relative
+			uint64_t lo = max(from, start);
+			uint64_t hi = min(to, start + blen);
+			uint32_t b = bucket_of(len, nbuckets, lo - from);
+			if (lo == start && hi == start + blen && b == bucket_of(len, nbuckets, hi - 1 - from)) {
+				res[b].merge(idx.summary(bdx));
+				continue;
+			}
+			if (!decode_block(idx, bdx, tmp)) {
+				res.assign(nbuckets, block_summary());
+				break;
+			}
+			while (lo < hi) {
+				uint64_t end = min(hi, from + bucket_start(len, nbuckets, b + 1));
+				res[b].merge(summarize(tmp + (lo - start), end - lo));
+				lo = end;
+				++b;
+			}
+			++decoded;
+		}
+		free(tmp);
+		if (NULL != ndecoded) {
+			*ndecoded = decoded;
+		}
+		return res;
+	}
+
+private:
+	const Coder<vT, bsT> *inner;
+	uint32_t nthreads;
+	uint32_t block_values;
+
+	/**
+	 * Decode one block into tmp, allocating it on first use
+	 * @returns false if it fails to decode
+	 */
+	bool decode_block(const block_index &idx, uint32_t bdx, vT *&tmp) const {
+		if (NULL == tmp) {
+			tmp = static_cast<vT*>(malloc(sizeof(vT)*idx.hdr.block_values));
+		}
+		return decode_into(idx, bdx, tmp);
+	}
+
+	/**
+	 * @returns false if the inner coder decodes fewer values than the block holds
+	 */
+	bool decode_into(const block_index &idx, uint32_t bdx, vT *out) const {
+		uint64_t len = idx.block_len(bdx);
+		vT *vals = inner->dec(out, &len, const_cast<unsigned char*>(idx.payload) + idx.offset(bdx),
+				idx.offset(bdx + 1) - idx.offset(bdx));
+		bool ok = (len == idx.block_len(bdx));
+		len = min(len, idx.block_len(bdx));
+		if (vals != out) {
+			memcpy(out, vals, len*sizeof(vT));
+			free(vals);
+		}
+		if (!ok) {
+			cerr << "block " << bdx << " failed to decode" << endl;
+		}
+		return ok;
+	}
+
+	void init_job(block_job<vT, bsT> &job, vT *vals, uint64_t nvalues) const {
+		job.inner = inner;
+		job.nvalues = nvalues;
+		job.block_values = block_values;
+		job.nblocks = (nvalues + block_values - 1) / block_values;
+		job.next_block = 0;
+		job.vals = vals;
+		job.bufs = NULL;
+		job.sizes = NULL;
+		job.summaries = NULL;
+		job.payload = NULL;
+		job.offsets = NULL;
+		job.nfailed = 0;
+	}
+
+	void free_bufs(block_job<vT, bsT> &job) const {
+		for (uint32_t bdx = 0; bdx < job.nblocks; ++bdx) {
+			free(job.bufs[bdx]);
+		}
+		delete[] job.bufs;
+		delete[] job.sizes;
+		delete[] job.summaries;
+	}
+
+	DISALLOW_EVIL_CONSTRUCTORS(BlockCoder);
+};
+
+/**
+ * A deterministic random walk for block tests
+ */
+template<typename T>
+T* block_test_walk(uint64_t npoints) {
+	T *arr = static_cast<T*>(malloc(sizeof(T)*npoints));
+	uint32_t state = 12345;
+	T cur = 0;
+	for (uint64_t i = 0; i < npoints; ++i) {
+		state = state * 1103515245 + 12345;
+		cur += static_cast<T>(((state >> 16) % 41) - 20);
+		arr[i] = cur;
+	}
+	return arr;
+}
+
+void test_block_header() {
+	BlockCoder<int32_t, uint32_t> coder(new EliasGamma<int32_t, uint32_t>, 2, 10);
+	int32_t din[25];
+	for (int i = 0; i < 25; ++i) {
+		din[i] = i;
+	}
+	uint64_t outsize = sizeof(din)*BUF_SCALE_FACTOR+12;
+	unsigned char *out = static_cast<unsigned char*>(calloc(outsize, 1));
+	out = coder.enc(out, &outsize, din, 25);
+
+	block_header hdr;
+	memcpy(&hdr, out, sizeof(hdr));
+	assert( hdr.nvalues == 25 );
+	assert( hdr.block_values == 10 );
+	assert( hdr.nblocks == 3 );
+
+	uint64_t offsets[4];
+	memcpy(offsets, out + sizeof(hdr), sizeof(offsets));
+	assert( offsets[0] == 0 );
+	assert( offsets[1] < offsets[2] && offsets[2] < offsets[3] );
+	assert( block_header_size(3) + offsets[3] == outsize );
+
+	block_summary sums[3];
+	memcpy(sums, out + sizeof(hdr) + sizeof(offsets), sizeof(sums));
+	assert( sums[0].min_value == 0 && sums[0].max_value == 9 && sums[0].sum == 45 );
+	assert( sums[2].first == 20 && sums[2].last == 24 && sums[2].count == 5 );
+
+	free(out);
+}
+
+/**
+ * Short output buffers and corrupt headers are refused, not overrun
+ */
+void test_block_corrupt() {
+	const uint64_t npoints = 3000;
+	int32_t *din = block_test_walk<int32_t>(npoints);
+	BlockCoder<int32_t, uint32_t> coder(new EliasGamma<int32_t, uint32_t>, 2, 1000);
+	uint64_t encsize = sizeof(int32_t)*(npoints*BUF_SCALE_FACTOR+12);
+	unsigned char *enc = static_cast<unsigned char*>(calloc(encsize, 1));
+	enc = coder.enc(enc, &encsize, din, npoints);
+	int32_t *dout = static_cast<int32_t*>(malloc(sizeof(int32_t)*npoints));
+
+	uint64_t n = npoints / 2;
+	coder.dec(dout, &n, enc, encsize);
+	assert( 0 == n );
+	n = npoints;
+	coder.dec(dout, &n, enc, encsize - 1);
+	assert( 0 == n );
+	n = npoints;
+	coder.dec(dout, &n, enc, sizeof(block_header) - 1);
+	assert( 0 == n );
+
+	unsigned char *bad = static_cast<unsigned char*>(malloc(encsize));
+	//an offset past the payload
+	memcpy(bad, enc, encsize);
+	uint64_t off = encsize;
+	memcpy(bad + sizeof(block_header) + 2*sizeof(uint64_t), &off, sizeof(off));
+	n = npoints;
+	coder.dec(dout, &n, bad, encsize);
+	assert( 0 == n );
+	assert( 0 == coder.decode_one(bad, encsize, 1, dout) );
+	//more values than its blocks hold
+	memcpy(bad, enc, encsize);
+	block_header hdr;
+	memcpy(&hdr, bad, sizeof(hdr));
+	hdr.nvalues = 5000;
+	memcpy(bad, &hdr, sizeof(hdr));
+	n = 5000;
+	coder.dec(dout, &n, bad, encsize);
+	assert( 0 == n );
+
+	n = npoints;
+	coder.dec(dout, &n, enc, encsize);
+	assert( npoints == n && 0 == memcmp(din, dout, sizeof(int32_t)*npoints) );
+
+	free(bad);
+	free(dout);
+	free(enc);
+	free(din);
+}
+
+/**
+ * A block the inner coder decodes short fails every reader
+ */
+void test_block_short_inner() {
+	const uint64_t npoints = 3000;
+	int32_t *din = block_test_walk<int32_t>(npoints);
+	BlockCoder<int32_t, uint32_t> coder(new WordLZ<int32_t, uint32_t>, 2, 1000);
+	uint64_t encsize = sizeof(int32_t)*(npoints*BUF_SCALE_FACTOR+12);
+	unsigned char *enc = static_cast<unsigned char*>(calloc(encsize, 1));
+	enc = coder.enc(enc, &encsize, din, npoints);
+	int32_t *dout = static_cast<int32_t*>(malloc(sizeof(int32_t)*npoints));
+
+	//block 1 left with no bytes; block 0 ignores the extra ones it gains
+	uint64_t off2;
+	memcpy(&off2, enc + sizeof(block_header) + 2*sizeof(uint64_t), sizeof(off2));
+	memcpy(enc + sizeof(block_header) + sizeof(uint64_t), &off2, sizeof(off2));
+
+	uint64_t n = npoints;
+	coder.dec(dout, &n, enc, encsize);
+	assert( 0 == n );
+	assert( 1000 == coder.decode_one(enc, encsize, 0, dout) );
+	assert( 0 == memcmp(din, dout, sizeof(int32_t)*1000) );
+	assert( 0 == coder.decode_one(enc, encsize, 1, dout) );
+	assert( 0 == coder.aggregate(enc, encsize, 1500, 2500).count );
+	assert( coder.find(enc, encsize, value_predicate(din[1500], din[1500])).empty() );
+	vector<block_summary> buckets = coder.downsample(enc, encsize, 0, npoints, 7);
+	assert( 7 == buckets.size() );
+	for (uint32_t b = 0; b < 7; ++b) {
+		assert( 0 == buckets[b].count );
+	}
+
+	free(dout);
+	free(enc);
+	free(din);
+}
+
+void test_block_roundtrips() {
+	const uint64_t npoints = 10007;
+	int32_t *arr32 = block_test_walk<int32_t>(npoints);
+	int64_t *arr64 = block_test_walk<int64_t>(npoints);
+
+	for (uint32_t nthreads = 1; nthreads <= 4; nthreads *= 2) {
+		BlockCoder<int32_t, uint32_t> eg32(new EliasGamma<int32_t, uint32_t>, nthreads, 1000);
+		test_coder_array(eg32, arr32, npoints);
+		BlockCoder<int32_t, uint32_t> ed32(new EliasDelta<int32_t, uint32_t>, nthreads, 1000);
+		test_coder_array(ed32, arr32, npoints);
+		BlockCoder<int32_t, uint32_t> lh32(new LogHuffman<int32_t, uint32_t>, nthreads, 4096);
+		test_coder_array(lh32, arr32, npoints);
+		BlockCoder<int32_t, uint32_t> zl32(new ZLib<int32_t, uint32_t>, nthreads, 3333);
+		test_coder_array(zl32, arr32, npoints);
+
+		BlockCoder<int64_t, uint64_t> lh64(new LogHuffman<int64_t, uint64_t>, nthreads, 512);
+		test_coder_array(lh64, arr64, npoints);
+		BlockCoder<int64_t, uint64_t> zl64(new ZLib<int64_t, uint64_t>, nthreads, npoints);
+		test_coder_array(zl64, arr64, npoints);
+	}
+
+	free(arr32);
+	free(arr64);
+}
+
+/**
+ * Aggregates must match a scan, whatever the range
+ */
+template<typename vT, typename bsT>
+void test_block_aggregate_range(const BlockCoder<vT, bsT> &coder, const unsigned char *enc,
+		uint64_t encsize, const vT *vals, uint64_t npoints, uint64_t from, uint64_t to) {
+	uint32_t ndecoded = 0;
+	block_summary got = coder.aggregate(enc, encsize, from, to, &ndecoded);
+	block_summary exp = (from < min(to, npoints)) ?
+			summarize(vals + from, min(to, npoints) - from) : block_summary();
+	assert( got.count == exp.count );
+	assert( got.sum == exp.sum );
+	if (exp.count > 0) {
+		assert( got.min_value == exp.min_value && got.max_value == exp.max_value );
+		assert( got.first == exp.first && got.last == exp.last );
+	}
+	assert( ndecoded <= 2 );
+}
+
+template<typename vT, typename bsT>
+void test_block_aggregate_stream(const BlockCoder<vT, bsT> &coder, const vT *vals, uint64_t npoints,
+		uint64_t block_values) {
+	uint64_t encsize = sizeof(vT)*(npoints*BUF_SCALE_FACTOR+12);
+	unsigned char *enc = static_cast<unsigned char*>(calloc(encsize, 1));
+	enc = coder.enc(enc, &encsize, const_cast<vT*>(vals), npoints);
+
+	uint64_t ranges[][2] = {{0, npoints}, {0, 1}, {5, 6}, {3, 900}, {999, 1001}, {17, 8123},
+			{block_values, 3*block_values}, {npoints - 1, npoints}, {npoints, npoints + 5},
+			{1234, 1234}, {1234, 1000}, {42, 1ull << 40}};
+	for (unsigned r = 0; r < sizeof(ranges)/sizeof(ranges[0]); ++r) {
+		test_block_aggregate_range(coder, enc, encsize, vals, npoints, ranges[r][0], ranges[r][1]);
+	}
+
+	//aligned ranges are answered from the header alone
+	uint32_t ndecoded = 1;
+	block_summary all = coder.aggregate(enc, encsize, 0, npoints, &ndecoded);
+	assert( 0 == ndecoded );
+	assert( all.count == npoints );
+	coder.aggregate(enc, encsize, block_values, 3*block_values, &ndecoded);
+	assert( 0 == ndecoded );
+	free(enc);
+}
+
+void test_block_aggregate() {
+	const uint64_t npoints = 10007;
+	int32_t *arr32 = block_test_walk<int32_t>(npoints);
+	int64_t *arr64 = block_test_walk<int64_t>(npoints);
+	arr64[77] = numeric_limits<int64_t>::max();
+	arr64[78] = numeric_limits<int64_t>::min();
+
+	BlockCoder<int32_t, uint32_t> lh32(new LogHuffman<int32_t, uint32_t>, 2, 1000);
+	test_block_aggregate_stream(lh32, arr32, npoints, 1000);
+	BlockCoder<int64_t, uint64_t> zl64(new ZLib<int64_t, uint64_t>, 1, 512);
+	test_block_aggregate_stream(zl64, arr64, npoints, 512);
+
+	free(arr32);
+	free(arr64);
+}
+
+template<typename vT, typename bsT>
+void test_block_find_pred(const BlockCoder<vT, bsT> &coder, const unsigned char *enc,
+		uint64_t encsize, const vT *vals, uint64_t npoints, const value_predicate &pred,
+		uint32_t max_decoded) {
+	uint32_t ndecoded = 0;
+	vector<uint64_t> got = coder.find(enc, encsize, pred, &ndecoded);
+	vector<uint64_t> exp;
+	for (uint64_t i = 0; i < npoints; ++i) {
+		if (pred.matches(vals[i])) {
+			exp.push_back(i);
+		}
+	}
+	assert( got == exp );
+	assert( ndecoded <= max_decoded );
+}
+
+void test_block_find() {
+	const uint64_t npoints = 10007;
+	int32_t *arr32 = block_test_walk<int32_t>(npoints);
+	//a few spikes for an alert to catch
+	arr32[4321] = 100000;
+	arr32[9999] = 100001;
+	BlockCoder<int32_t, uint32_t> lh32(new LogHuffman<int32_t, uint32_t>, 2, 1000);
+	uint64_t encsize = sizeof(int32_t)*(npoints*BUF_SCALE_FACTOR+12);
+	unsigned char *enc = static_cast<unsigned char*>(calloc(encsize, 1));
+	enc = lh32.enc(enc, &encsize, arr32, npoints);
+
+	//only the blocks with spikes are decoded
+	test_block_find_pred(lh32, enc, encsize, arr32, npoints, value_predicate::above(50000), 2);
+	//everything matches, so nothing needs decoding
+	test_block_find_pred(lh32, enc, encsize, arr32, npoints, value_predicate::below(100001), 0);
+	test_block_find_pred(lh32, enc, encsize, arr32, npoints, value_predicate(5, 1), 0);
+	test_block_find_pred(lh32, enc, encsize, arr32, npoints, value_predicate(-30, 30), 11);
+	test_block_find_pred(lh32, enc, encsize, arr32, npoints, value_predicate::below(-1000000), 0);
+
+	assert( value_predicate(0, 10).may_match(10, 20) );
+	assert( !value_predicate(0, 10).may_match(11, 20) );
+	assert( !value_predicate(0, 10).may_match(block_summary()) );
+
+	free(enc);
+	free(arr32);
+}
+
+void test_bucket_of() {
+	for (uint64_t len = 1; len < 40; ++len) {
+		for (uint32_t nb = 1; nb < 50; ++nb) {
+			for (uint64_t p = 0; p < len; ++p) {
+				uint32_t b = bucket_of(len, nb, p);
+				assert( b < nb );
+				assert( bucket_start(len, nb, b) <= p && p < bucket_start(len, nb, b + 1) );
+			}
+		}
+	}
+}
+
+/**
+ * Buckets must match a scan, and cost at most two decodes each
+ */
+template<typename vT, typename bsT>
+void test_block_downsample_range(const BlockCoder<vT, bsT> &coder, const unsigned char *enc,
+		uint64_t encsize, const vT *vals, uint64_t npoints, uint64_t from, uint64_t to,
+		uint32_t nbuckets) {
+	uint32_t ndecoded = 0;
+	vector<block_summary> got = coder.downsample(enc, encsize, from, to, nbuckets, &ndecoded);
+	assert( got.size() == nbuckets );
+	to = min(to, npoints);
+	uint64_t len = (from < to) ? to - from : 0;
+	for (uint32_t b = 0; b < nbuckets; ++b) {
+		block_summary exp;
+		if (len > 0) {
+			uint64_t lo = from + bucket_start(len, nbuckets, b);
+			exp = summarize(vals + lo, from + bucket_start(len, nbuckets, b + 1) - lo);
+		}
+		assert( got[b].count == exp.count );
+		if (exp.count > 0) {
+			assert( got[b].min_value == exp.min_value && got[b].max_value == exp.max_value );
+			assert( got[b].first == exp.first && got[b].last == exp.last );
+			assert( got[b].sum == exp.sum );
+		}
+	}
+	assert( ndecoded <= 2*nbuckets );
+}
+
+void test_block_downsample() {
+	test_bucket_of();
+
+	const uint64_t npoints = 100003;
+	int32_t *arr32 = block_test_walk<int32_t>(npoints);
+	BlockCoder<int32_t, uint32_t> lh32(new LogHuffman<int32_t, uint32_t>, 2, 1000);
+	uint64_t encsize = sizeof(int32_t)*(npoints*BUF_SCALE_FACTOR+12);
+	unsigned char *enc = static_cast<unsigned char*>(calloc(encsize, 1));
+	enc = lh32.enc(enc, &encsize, arr32, npoints);
+
+	uint64_t ranges[][3] = {{0, npoints, 20}, {0, npoints, 1}, {123, 99999, 7}, {5000, 6000, 1},
+			{17, 43, 100}, {0, 2000, 2000}, {npoints, npoints + 10, 4}, {0, npoints, 0}};
+	for (unsigned r = 0; r < sizeof(ranges)/sizeof(ranges[0]); ++r) {
+		test_block_downsample_range(lh32, enc, encsize, arr32, npoints,
+				ranges[r][0], ranges[r][1], static_cast<uint32_t>(ranges[r][2]));
+	}
+
+	//aligned buckets come straight from the header
+	uint32_t ndecoded = 1;
+	lh32.downsample(enc, encsize, 0, 100000, 10, &ndecoded);
+	assert( 0 == ndecoded );
+
+	free(enc);
+	free(arr32);
+}
+
+void test_block() {
+	test_block_header();
+	test_block_corrupt();
+	test_block_short_inner();
+	test_block_roundtrips();
+	test_block_aggregate();
+	test_block_find();
+	test_block_downsample();
+}
+
+#endif /* BLOCK_HPP_ */
@@ -7,6 +7,12 @@
 #ifndef CODER_HPP_
 #define CODER_HPP_
 
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "../util.hpp"
+
 const float BUF_SCALE_FACTOR = 2.0;
 
 /**
@@ -49,8 +55,10 @@ public:
  */
 template<typename T>
 uint32_t nbits(T x) {
-	if (sizeof(T) == sizeof(intptr_t)) {
-		return (8*sizeof(intptr_t)) - __builtin_clz(x);
+	if (sizeof(T) == sizeof(unsigned long long)) {
+		return (8*sizeof(unsigned long long)) - __builtin_clzll(x);
+	} else if (sizeof(T) == sizeof(unsigned int)) {
+		return (8*sizeof(unsigned int)) - __builtin_clz(x);
 	} else {
 		//do the obvious thing for now.
 		uint32_t r = 0;
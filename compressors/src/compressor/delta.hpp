@@ -25,6 +25,19 @@ bool delta_enc_inplace(T* in, uint64_t inlen) {
 	return true;
 }
 
+/**
+ * Delta encode into a separate output, leaving the input untouched
+ */
+template <typename T>
+bool delta_enc(T* out, const T* in, uint64_t inlen) {
+	T last = 0;
+	for (uint64_t i = 0; i < inlen; ++i) {
+		out[i] = in[i] - last;
+		last = in[i];
+	}
+	return true;
+}
+
 template <typename T>
 bool delta_dec_inplace(T* in, uint64_t inlen) {
 	T last = 0;
@@ -48,6 +61,10 @@ void test_delta_basic() {
 
 	assert( 0 == memcmp(din, exp, sizeof(din)) );
 
+	int32_t dout[sizeof(din)/sizeof(int32_t)];
+	assert( delta_enc<int32_t>(dout, orig, inlen) );
+	assert( 0 == memcmp(dout, exp, sizeof(dout)) );
+
 	assert( delta_dec_inplace(din, inlen) );
 
 	assert( 0 == memcmp(din, orig, sizeof(din)) );
@@ -0,0 +1,426 @@
+/*
+ * dict.hpp
+ * @brief dictionary coding for streams with few distinct values
+ * @author ishafer
+ */
+
+#ifndef DICT_HPP_
+#define DICT_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <limits>
+
+#include "coder.hpp"
+#include "bitio.hpp"
+#include "eliasgamma.hpp"
+#include "delta.hpp"
+#include "zigzag.hpp"
+#include "../util.hpp"
+
+//most distinct values a dictionary takes; more are stored raw
+static const uint32_t DICT_MAX_VALUES = 1 << 16;
+//bits to store the dictionary size (less one)
+static const int32_t DICT_SIZE_BITS = 16;
+//starting slots in the hash set; it doubles at half full
+static const uint32_t DICT_INITIAL_SLOTS = 1 << 8;
+
+//how the values follow the dictionary
+enum DictMode {
+	//too many distinct values: no dictionary, raw values
+	DICT_RAW = 0,
+	//one fixed-width index per value
+	DICT_PACKED = 1,
+	//(index, gamma-coded run length) per run
+	DICT_RUNS = 2
+};
+static const int32_t DICT_MODE_BITS = 2;
+
+/**
+ * @brief open-addressed set of values, each with an index
+ */
+template<typename uT>
+class DictSet {
+private:
+	uT *keys;
+	uint32_t *idxs;
+	unsigned char *used;
+	uint32_t nslots;
+	uint32_t count;
+
+	inline uint32_t slot_of(uT x) const {
+		uint64_t h = static_cast<uint64_t>(x) * 0x9E3779B97F4A7C15ull;
+		uint32_t s = static_cast<uint32_t>(h >> 32) & (nslots - 1);
+		while (used[s] && keys[s] != x) {
+			s = (s + 1) & (nslots - 1);
+		}
+		return s;
+	}
+
+	void alloc(uint32_t n) {
+		nslots = n;
+		keys = static_cast<uT*>(malloc(sizeof(uT)*n));
+		idxs = static_cast<uint32_t*>(malloc(sizeof(uint32_t)*n));
+		used = static_cast<unsigned char*>(calloc(n, 1));
+	}
+
+	void grow() {
+		uT *okeys = keys;
+		uint32_t *oidxs = idxs;
+		unsigned char *oused = used;
+		uint32_t onslots = nslots;
+		alloc(2*onslots);
+		for (uint32_t s = 0; s < onslots; ++s) {
+			if (oused[s]) {
+				uint32_t t = slot_of(okeys[s]);
+				used[t] = 1;
+				keys[t] = okeys[s];
+				idxs[t] = oidxs[s];
+			}
+		}
+		free(okeys);
+		free(oidxs);
+		free(oused);
+	}
+
+public:
+	DictSet() :
+		count(0)
+	{
+		alloc(DICT_INITIAL_SLOTS);
+	}
+
+	~DictSet() {
+		free(keys);
+		free(idxs);
+		free(used);
+	}
+
+	/**
+	 * Add x if it's new
+	 */
+	inline void insert(uT x) {
+		uint32_t s = slot_of(x);
+		if (!used[s]) {
+			used[s] = 1;
+			keys[s] = x;
+			idxs[s] = 0;
+			if (2*(++count) > nslots) {
+				grow();
+			}
+		}
+	}
+
+	/**
+	 * Add every value of in[0..n), stopping early past limit distinct values
+	 * @returns whether there were at most limit
+	 */
+	bool insert_all(const uT *in, uint64_t n, uint32_t limit) {
+		for (uint64_t i = 0; i < n; ++i) {
+			insert(in[i]);
+			if (count > limit) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	uint32_t size() const {
+		return count;
+	}
+
+	/**
+	 * Copy the values out, in no particular order
+	 */
+	void values(uT *out) const {
+		uint32_t j = 0;
+		for (uint32_t s = 0; s < nslots; ++s) {
+			if (used[s]) {
+				out[j++] = keys[s];
+			}
+		}
+	}
+
+	inline void set_index(uT x, uint32_t idx) {
+		idxs[slot_of(x)] = idx;
+	}
+
+	/**
+	 * @returns the index of x, which must be in the set
+	 */
+	inline uint32_t index(uT x) const {
+		return idxs[slot_of(x)];
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(DictSet);
+};
+
+/**
+ * Dictionary coder for streams with few distinct values.
+ * One hash-set pass finds the distinct values; if there are at most
+ *  DICT_MAX_VALUES, they are sorted and sent (first raw, then the gaps
+ *  Elias-gamma coded), then each value is sent as a fixed-width index,
+ *  or, if smaller, each run of one index as the index and its length.
+ * Decoding is a gather from the dictionary.
+ * Layout: mode, dictionary size - 1, dictionary, indices.
+ */
+template<typename vT, typename bsT>
+class DictCoder : public Coder<vT, bsT> {
+public:
+	DictCoder() {};
+	~DictCoder() {};
+
+	unsigned char* enc(
+			unsigned char *out,
+			uint64_t *outsize,
+			vT *in,
+			uint64_t insize) const {
+		BitWriter bw(out, *outsize);
+		const int32_t vbits = 8*sizeof(vT);
+		const bsT *vals = reinterpret_cast<const bsT*>(in);
+		if (0 == insize) {
+			*outsize = 0;
+			return out;
+		}
+
+		DictSet<bsT> set;
+		if (!set.insert_all(vals, insize, DICT_MAX_VALUES)) {
+			bw.write(DICT_RAW, DICT_MODE_BITS);
+			for (uint64_t i = 0; i < insize; ++i) {
+				bw.write_wide(vals[i], vbits);
+			}
+			*outsize = bw.finish();
+			return bw.get_backing();
+		}
+
+		uint32_t ndict = set.size();
+		vT *dict = static_cast<vT*>(malloc(sizeof(vT)*ndict));
+		set.values(reinterpret_cast<bsT*>(dict));
+		sort(dict, dict + ndict);
+		for (uint32_t d = 0; d < ndict; ++d) {
+			set.set_index(static_cast<bsT>(dict[d]), d);
+		}
+		int32_t ibits = (ndict > 1) ? nbits(ndict - 1) : 0;
+
+		//packed costs insize*ibits; compare the runs
+		uint64_t runbits = 0;
+		for (uint64_t i = 0; i < insize; ) {
+			uint64_t run = count_equal(vals + i, insize - i);
+			runbits += ibits + 2*nbits(run) - 1;
+			i += run;
+		}
+		DictMode mode = (runbits < insize*ibits) ? DICT_RUNS : DICT_PACKED;
+
+		bw.write(mode, DICT_MODE_BITS);
+		bw.write(ndict - 1, DICT_SIZE_BITS);
+		bw.write_wide(static_cast<bsT>(dict[0]), vbits);
+		for (uint32_t d = 1; d < ndict; ++d) {
+			//sorted, so every gap is at least one
+			bsT gap = static_cast<bsT>(static_cast<bsT>(dict[d]) - static_cast<bsT>(dict[d-1]));
+			int32_t nb = nbits(static_cast<uint64_t>(gap));
+			bw.write_wide(0, nb - 1);
+			bw.write_wide(gap, nb);
+		}
+		free(dict);
+
+		if (DICT_PACKED == mode) {
+			for (uint64_t i = 0; i < insize; ++i) {
+				bw.write(set.index(vals[i]), ibits);
+			}
+		} else {
+			for (uint64_t i = 0; i < insize; ) {
+				uint64_t run = count_equal(vals + i, insize - i);
+				int32_t nb = nbits(run);
+				bw.write(set.index(vals[i]), ibits);
+				bw.write_wide(0, nb - 1);
+				bw.write_wide(run, nb);
+				i += run;
+			}
+		}
+		*outsize = bw.finish();
+		return bw.get_backing();
+	}
+
+	vT* dec(vT *out,
+			uint64_t *outsize,
+			unsigned char *in,
+			uint64_t insize) const {
+		const int32_t vbits = 8*sizeof(vT);
+		uint64_t n = *outsize;
+		if (0 == n) {
+			return out;
+		}
+		BitReader br(in, insize);
+		DictMode mode = static_cast<DictMode>(br.read(DICT_MODE_BITS));
+		if (DICT_RAW == mode) {
+			for (uint64_t i = 0; i < n; ++i) {
+				out[i] = static_cast<vT>(br.read(vbits));
+			}
+			return out;
+		}
+
+		uint32_t ndict = br.read(DICT_SIZE_BITS) + 1;
+		bsT *dict = static_cast<bsT*>(malloc(sizeof(bsT)*ndict));
+		dict[0] = static_cast<bsT>(br.read(vbits));
+		for (uint32_t d = 1; d < ndict; ++d) {
+			uint32_t z = br.read_unary(63);
+			uint64_t gap = br.read(z) | (static_cast<uint64_t>(1) << z);
+			dict[d] = static_cast<bsT>(dict[d-1] + gap);
+		}
+		int32_t ibits = (ndict > 1) ? nbits(ndict - 1) : 0;
+		bsT *dst = reinterpret_cast<bsT*>(out);
+
+		if (DICT_PACKED == mode) {
+			for (uint64_t i = 0; i < n; ++i) {
+				dst[i] = dict[br.read(ibits)];
+			}
+		} else {
+			for (uint64_t i = 0; i < n; ) {
+				bsT v = dict[br.read(ibits)];
+				uint32_t z = br.read_unary(63);
+				uint64_t run = br.read(z) | (static_cast<uint64_t>(1) << z);
+				run = min(run, n - i);
+				for (uint64_t k = 0; k < run; ++k) {
+					dst[i + k] = v;
+				}
+				i += run;
+			}
+		}
+		free(dict);
+		return out;
+	}
+
+private:
+	/**
+	 * @returns number of leading values of in[0..n) equal to in[0]
+	 */
+	static uint64_t count_equal(const bsT *in, uint64_t n) {
+		uint64_t i = 1;
+		while (i < n && in[i] == in[0]) {
+			++i;
+		}
+		return i;
+	}
+
+	DISALLOW_EVIL_CONSTRUCTORS(DictCoder);
+};
+
+void test_dict_set() {
+	DictSet<uint32_t> set;
+	for (uint32_t i = 0; i < 1000; ++i) {
+		set.insert(i * 7919);
+		set.insert(i * 7919);
+	}
+	assert( 1000 == set.size() );
+	for (uint32_t i = 0; i < 1000; ++i) {
+		set.set_index(i * 7919, i);
+	}
+	for (uint32_t i = 0; i < 1000; ++i) {
+		assert( set.index(i * 7919) == i );
+	}
+
+	uint32_t many[3000];
+	for (uint32_t i = 0; i < 3000; ++i) {
+		many[i] = i;
+	}
+	DictSet<uint32_t> small;
+	assert( !small.insert_all(many, 3000, 2000) );
+	DictSet<uint32_t> big;
+	assert( big.insert_all(many, 3000, 3000) );
+}
+
+void test_dict_basic() {
+	DictCoder<int8_t, uint8_t> coder8;
+	DictCoder<int16_t, uint16_t> coder16;
+	DictCoder<int32_t, uint32_t> coder32;
+	DictCoder<int64_t, uint64_t> coder64;
+
+	int32_t din[] = {1, 2, 4, 5, 6, -3, 8};
+	test_coder_array(coder32, (int32_t*) din, sizeof(din)/sizeof(int32_t));
+
+	int32_t din2[] = {0, 181817, 363636, 545454, 363636, 363636, 545454, 1, 2, 3, 4, 5};
+	test_coder_array(coder32, (int32_t*) din2, sizeof(din2)/sizeof(int32_t));
+
+	int64_t din3[] = {31014740000, 31000620000, 30985390000, 30968450000, 30950330000,
+			numeric_limits<int64_t>::min(), numeric_limits<int64_t>::max(), 0, -1};
+	test_coder_array(coder64, (int64_t*) din3, sizeof(din3)/sizeof(int64_t));
+
+	//a sentinel 2^63 above zero, a gap with 63 leading zeros
+	int64_t sentinel[] = {0, numeric_limits<int64_t>::min(), 0, 0, numeric_limits<int64_t>::min()};
+	test_coder_array(coder64, sentinel, sizeof(sentinel)/sizeof(int64_t));
+
+	int8_t din4[] = {-128, 127, 0, 0, 0, -1, 1, 5};
+	test_coder_array(coder8, (int8_t*) din4, sizeof(din4)/sizeof(int8_t));
+
+	//a single value needs no index bits
+	int16_t din5[] = {-7, -7, -7, -7};
+	test_coder_array(coder16, (int16_t*) din5, sizeof(din5)/sizeof(int16_t));
+
+	//every int16, so the dictionary is full
+	const uint64_t n = 1 << 16;
+	int16_t *all16 = static_cast<int16_t*>(malloc(n*sizeof(int16_t)));
+	for (uint64_t i = 0; i < n; ++i) {
+		all16[i] = static_cast<int16_t>(i * 40503);
+	}
+	test_coder_array(coder16, all16, n);
+	free(all16);
+
+	//too many distinct values: raw
+	const uint64_t nraw = DICT_MAX_VALUES + 100;
+	int32_t *raw = static_cast<int32_t*>(malloc(nraw*sizeof(int32_t)));
+	for (uint64_t i = 0; i < nraw; ++i) {
+		raw[i] = static_cast<int32_t>(i * 2654435761u);
+	}
+	test_coder_array(coder32, raw, nraw);
+	free(raw);
+}
+
+/**
+ * A discrete state stream: few values, long runs
+ */
+void test_dict_states() {
+	const uint64_t n = 30000;
+	int32_t *states = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	int32_t levels[] = {0, 181817, 363636, 545454};
+	uint64_t seed = 5;
+	int32_t cur = 0;
+	for (uint64_t i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		if ((seed >> 58) == 0) {
+			cur = levels[(seed >> 40) % 4];
+		}
+		states[i] = cur;
+	}
+	DictCoder<int32_t, uint32_t> dict;
+	test_coder_array(dict, states, n);
+
+	uint64_t dsize = sizeof(int32_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *dbits = static_cast<unsigned char*>(calloc(dsize, 1));
+	dbits = dict.enc(dbits, &dsize, states, n);
+	//runs, so well under the 2 bits per value of packing
+	assert( dsize < n/4/4 );
+
+	int32_t *deltas = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	delta_enc(deltas, states, n);
+	EliasGamma<int32_t, uint32_t> gamma;
+	uint64_t gsize = sizeof(int32_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *gbits = static_cast<unsigned char*>(calloc(gsize, 1));
+	gbits = gamma.enc(gbits, &gsize, deltas, n);
+	assert( dsize * 4 < gsize );
+
+	free(gbits);
+	free(deltas);
+	free(dbits);
+	free(states);
+}
+
+void test_dict() {
+	test_dict_set();
+	test_dict_basic();
+	test_dict_states();
+}
+
+#endif /* DICT_HPP_ */
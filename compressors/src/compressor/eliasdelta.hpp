@@ -11,6 +11,8 @@
 
 #include "coder.hpp"
 #include "bitstream.hpp"
+#include "bitio.hpp"
+#include "eliaslut.hpp"
 #include "zigzag.hpp"
 #include "../util.hpp"
 
@@ -32,34 +34,66 @@ public:
 			uint64_t insize) const {
 		BitStream<unsigned char, bsT> bs(out, *outsize, WRITE);
 		for (uint64_t i = 0; i < insize; ++i) {
-			uint64_t v = ZIGZAG_ENC(static_cast<int64_t>(in[i])) + 1;
-			uint32_t nb = nbits(v);
+			uint64_t u = ZIGZAG_ENC(static_cast<int64_t>(in[i]));
+			uint32_t nb = elias_nbits(u);
 			uint32_t nb_nb = nbits(nb);
 			//cout << "in[" << i << "]=" << in[i] << "->" << v <<
 			//	" (nb=" << nb << " nb_nb=" << nb_nb << ")" << endl;
 			bs.write_bits(0, nb_nb-1);
 			bs.write_bits(nb, nb_nb);
-			bs.write_bits(v & ~(static_cast<uint64_t>(1) << nb), nb-1);
+			//only the bits below the top one are written
+			bs.write_bits(u + 1, nb-1);
 		}
 		*outsize = bs.written_size();
 		return bs.get_backing();
 	}
 
+	/**
+	 * Table-driven decode, as EliasGamma::dec
+	 */
 	vT* dec(vT *out,
 			uint64_t *outsize,
 			unsigned char *in,
 			uint64_t insize) const {
+		const elias_lut_entry *lut = delta_lut();
+		BitReader br(in, insize);
+		uint64_t n = *outsize;
+		for (uint64_t i = 0; i < n; ) {
+			const elias_lut_entry &e = lut[br.peek(ELIAS_LUT_BITS)];
+			if (e.ncodes > 0 && e.ncodes <= n - i) {
+				for (uint32_t k = 0; k < e.ncodes; ++k) {
+					out[i + k] = ZIGZAG_DEC(static_cast<uint64_t>(e.vals[k]) - 1);
+				}
+				i += e.ncodes;
+				br.skip(e.nbits);
+			} else {
+				uint32_t nb_nb = br.read_unary(63);
+				uint64_t nb = br.read(nb_nb) | (static_cast<uint64_t>(1) << nb_nb);
+				uint64_t v = elias_value(br.read(nb - 1), nb - 1);
+				out[i++] = ZIGZAG_DEC(v);
+			}
+		}
+		return out;
+	}
+
+	/**
+	 * Bit-at-a-time decode; reference for dec()
+	 */
+	vT* dec_bitwise(vT *out,
+			uint64_t *outsize,
+			unsigned char *in,
+			uint64_t insize) const {
 		BitStream<unsigned char, bsT> bs(in, insize, READ);
 		for (uint64_t i = 0; i < *outsize; ++i) {
 			uint32_t nb_nb = 0;
 			while (bs.ready() && (!bs.read_bit())) {
 				++nb_nb;
 			}
-			uint64_t nb = (bs.read_bits(nb_nb) | (static_cast<bsT>(1) << nb_nb));
-			uint64_t v = (bs.read_bits(nb - 1) | (static_cast<bsT>(1) << (nb-1)));
+			uint64_t nb = (bs.read_bits(nb_nb) | (static_cast<uint64_t>(1) << nb_nb));
+			uint64_t v = elias_value(bs.read_bits(nb - 1), nb - 1);
 			//cout << "out[" << i << "]=" << v <<
 			//		" (nb=" << nb << " nb_nb=" << nb_nb << ")" << endl;
-			out[i] = ZIGZAG_DEC(v - 1);
+			out[i] = ZIGZAG_DEC(v);
 		}
 		return out;
 	}
@@ -137,9 +171,46 @@ void test_elias_delta_basic() {
 	test_coder_array(coder32, (int32_t*) din4, sizeof(din4)/sizeof(int32_t));
 }
 
+/**
+ * The table-driven decoder must match the bitwise one exactly
+ */
+template<typename vT, typename bsT>
+void test_elias_delta_lut_width() {
+	EliasDelta<vT, bsT> coder;
+	for (uint64_t n = 1; n < 3000; n = n*3 + 1) {
+		vT *din = static_cast<vT*>(malloc(n*sizeof(vT)));
+		elias_test_values(din, n, n);
+		uint64_t outsize = sizeof(vT)*(n*BUF_SCALE_FACTOR+12);
+		unsigned char *outbits = static_cast<unsigned char*>(calloc(outsize, 1));
+		outbits = coder.enc(outbits, &outsize, din, n);
+
+		vT *fast = static_cast<vT*>(malloc(n*sizeof(vT)));
+		vT *slow = static_cast<vT*>(malloc(n*sizeof(vT)));
+		uint64_t nfast = n;
+		uint64_t nslow = n;
+		coder.dec(fast, &nfast, outbits, outsize);
+		coder.dec_bitwise(slow, &nslow, outbits, outsize);
+		assert( 0 == memcmp(fast, slow, n*sizeof(vT)) );
+		assert( 0 == memcmp(fast, din, n*sizeof(vT)) );
+
+		free(slow);
+		free(fast);
+		free(outbits);
+		free(din);
+	}
+}
+
+void test_elias_delta_lut() {
+	test_elias_delta_lut_width<int8_t, uint8_t>();
+	test_elias_delta_lut_width<int16_t, uint16_t>();
+	test_elias_delta_lut_width<int32_t, uint32_t>();
+	test_elias_delta_lut_width<int64_t, uint64_t>();
+}
+
 void test_elias_delta() {
 	test_elias_delta_single();
 	test_elias_delta_basic();
+	test_elias_delta_lut();
 }
 
 #endif /* ELIASDELTA_HPP_ */
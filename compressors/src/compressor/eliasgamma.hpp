@@ -11,6 +11,8 @@
 
 #include "coder.hpp"
 #include "bitstream.hpp"
+#include "bitio.hpp"
+#include "eliaslut.hpp"
 #include "zigzag.hpp"
 #include "../util.hpp"
 
@@ -33,28 +35,60 @@ public:
 			uint64_t insize) const {
 		BitStream<unsigned char, bsT> bs(out, *outsize, WRITE);
 		for (uint64_t i = 0; i < insize; ++i) {
-			uint64_t v = ZIGZAG_ENC(static_cast<int64_t>(in[i])) + 1;
-			int32_t nb = nbits(v);
+			uint64_t u = ZIGZAG_ENC(static_cast<int64_t>(in[i]));
+			int32_t nb = elias_nbits(u);
+			//the top bit alone, as u + 1 may not fit in bsT (or 64 bits)
 			bs.write_bits(0, nb-1);
-			bs.write_bits(v, nb);
+			bs.write_bits(1, 1);
+			bs.write_bits(u + 1, nb-1);
 		}
 		*outsize = bs.written_size();
 
 		return bs.get_backing();
 	}
 
+	/**
+	 * Table-driven decode: each lookup on the next ELIAS_LUT_BITS bits
+	 *  yields every complete code in them; longer codes are read directly.
+	 */
 	vT* dec(vT *out,
 			uint64_t *outsize,
 			unsigned char *in,
 			uint64_t insize) const {
+		const elias_lut_entry *lut = gamma_lut();
+		BitReader br(in, insize);
+		uint64_t n = *outsize;
+		for (uint64_t i = 0; i < n; ) {
+			const elias_lut_entry &e = lut[br.peek(ELIAS_LUT_BITS)];
+			if (e.ncodes > 0 && e.ncodes <= n - i) {
+				for (uint32_t k = 0; k < e.ncodes; ++k) {
+					out[i + k] = ZIGZAG_DEC(static_cast<uint64_t>(e.vals[k]) - 1);
+				}
+				i += e.ncodes;
+				br.skip(e.nbits);
+			} else {
+				uint32_t nb = br.read_unary(64);
+				uint64_t v = elias_value(br.read(nb), nb);
+				out[i++] = ZIGZAG_DEC(v);
+			}
+		}
+		return out;
+	}
+
+	/**
+	 * Bit-at-a-time decode; reference for dec()
+	 */
+	vT* dec_bitwise(vT *out,
+			uint64_t *outsize,
+			unsigned char *in,
+			uint64_t insize) const {
 		BitStream<unsigned char, bsT> bs(in, insize, READ);
 		for (uint64_t i = 0; i < *outsize; ++i) {
 			uint32_t nb = 0;
 			while (bs.ready() && (!bs.read_bit())) {
 				++nb;
 			}
-			uint64_t b = bs.read_bits(nb);
-			uint64_t v = (b | ((bsT) 1 << nb)) - 1;
+			uint64_t v = elias_value(bs.read_bits(nb), nb);
 			out[i] = ZIGZAG_DEC(v);
 		}
 		return out;
@@ -140,11 +174,48 @@ void test_elias_gamma_basic() {
 	test_coder_array(coder8, (int8_t*) din4, sizeof(din4)/sizeof(int8_t));
 }
 
+/**
+ * The table-driven decoder must match the bitwise one exactly
+ */
+template<typename vT, typename bsT>
+void test_elias_gamma_lut_width() {
+	EliasGamma<vT, bsT> coder;
+	for (uint64_t n = 1; n < 3000; n = n*3 + 1) {
+		vT *din = static_cast<vT*>(malloc(n*sizeof(vT)));
+		elias_test_values(din, n, n);
+		uint64_t outsize = sizeof(vT)*(n*BUF_SCALE_FACTOR+12);
+		unsigned char *outbits = static_cast<unsigned char*>(calloc(outsize, 1));
+		outbits = coder.enc(outbits, &outsize, din, n);
+
+		vT *fast = static_cast<vT*>(malloc(n*sizeof(vT)));
+		vT *slow = static_cast<vT*>(malloc(n*sizeof(vT)));
+		uint64_t nfast = n;
+		uint64_t nslow = n;
+		coder.dec(fast, &nfast, outbits, outsize);
+		coder.dec_bitwise(slow, &nslow, outbits, outsize);
+		assert( 0 == memcmp(fast, slow, n*sizeof(vT)) );
+		assert( 0 == memcmp(fast, din, n*sizeof(vT)) );
+
+		free(slow);
+		free(fast);
+		free(outbits);
+		free(din);
+	}
+}
+
+void test_elias_gamma_lut() {
+	test_elias_gamma_lut_width<int8_t, uint8_t>();
+	test_elias_gamma_lut_width<int16_t, uint16_t>();
+	test_elias_gamma_lut_width<int32_t, uint32_t>();
+	test_elias_gamma_lut_width<int64_t, uint64_t>();
+}
+
 void test_elias_gamma() {
 	test_log2();
 
 	test_elias_gamma_single();
 	test_elias_gamma_basic();
+	test_elias_gamma_lut();
 }
 
 #endif /* ELIASGAMMA_HPP_ */
@@ -0,0 +1,169 @@
+/**
+ * eliaslut.hpp
+ * @brief lookup tables for decoding several short Elias codes at once
+ * @author ishafer
+ */
+
+#ifndef ELIASLUT_HPP_
+#define ELIASLUT_HPP_
+
+#include <cstring>
+#include <limits>
+#include <cassert>
+
+#include "bitio.hpp"
+#include "../util.hpp"
+
+//window of bits looked up at once; 1K entries of 12 bytes stay in L1
+static const int32_t ELIAS_LUT_BITS = 10;
+static const uint32_t ELIAS_LUT_SIZE = 1u << ELIAS_LUT_BITS;
+
+/**
+ * The complete codes at the start of one window
+ */
+struct elias_lut_entry {
+	//number of codes; 0 if the first code is longer than the window
+	uint8_t ncodes;
+	//bits taken by those codes
+	uint8_t nbits;
+	//coded values (before the -1 and zigzag)
+	uint8_t vals[ELIAS_LUT_BITS];
+};
+
+/**
+ * @param u zigzagged value; Elias codes u + 1
+ * @returns bits in u + 1, which is 65 when that doesn't fit in 64
+ */
+inline uint32_t elias_nbits(uint64_t u) {
+	return (~static_cast<uint64_t>(0) == u) ? 65 : nbits(u + 1);
+}
+
+/**
+ * @param low the bits below the top one of a coded value w
+ * @param nb position of that top bit, up to 64
+ * @returns w - 1, the zigzagged value
+ */
+inline uint64_t elias_value(uint64_t low, uint32_t nb) {
+	return low + ((nb < 64) ? (static_cast<uint64_t>(1) << nb) - 1 : ~static_cast<uint64_t>(0));
+}
+
+/**
+ * Decodes one code from the top avail bits of an ELIAS_LUT_BITS window
+ * @param v (out) the value
+ * @returns bits used, or 0 if the code doesn't fit
+ */
+typedef int32_t (*elias_window_decoder)(uint32_t window, int32_t avail, uint64_t *v);
+
+/**
+ * @returns number of zero bits at the top of an ELIAS_LUT_BITS window
+ */
+inline int32_t window_zeros(uint32_t window) {
+	if (0 == window) {
+		return ELIAS_LUT_BITS;
+	}
+	return __builtin_clz(window) - (32 - ELIAS_LUT_BITS);
+}
+
+/**
+ * @returns the len bits of window starting pos bits from the top
+ */
+inline uint32_t window_bits(uint32_t window, int32_t pos, int32_t len) {
+	return (window >> (ELIAS_LUT_BITS - pos - len)) & ((1u << len) - 1);
+}
+
+int32_t gamma_window_code(uint32_t window, int32_t avail, uint64_t *v) {
+	int32_t z = window_zeros(window);
+	if (2*z + 1 > avail) {
+		return 0;
+	}
+	*v = window_bits(window, z, z + 1);
+	return 2*z + 1;
+}
+
+int32_t delta_window_code(uint32_t window, int32_t avail, uint64_t *v) {
+	int32_t z = window_zeros(window);
+	if (2*z + 1 > avail) {
+		return 0;
+	}
+	int32_t nb = window_bits(window, z, z + 1);
+	int32_t len = 2*z + nb;
+	if (len > avail) {
+		return 0;
+	}
+	*v = (1u << (nb - 1)) | window_bits(window, 2*z + 1, nb - 1);
+	return len;
+}
+
+void build_elias_lut(elias_lut_entry *lut, elias_window_decoder decode_one) {
+	for (uint32_t w = 0; w < ELIAS_LUT_SIZE; ++w) {
+		elias_lut_entry &e = lut[w];
+		memset(&e, 0, sizeof(e));
+		int32_t used = 0;
+		while (used < ELIAS_LUT_BITS) {
+			uint64_t v = 0;
+			uint32_t rest = (w << used) & (ELIAS_LUT_SIZE - 1);
+			int32_t nb = decode_one(rest, ELIAS_LUT_BITS - used, &v);
+			if (0 == nb) {
+				break;
+			}
+			e.vals[e.ncodes++] = static_cast<uint8_t>(v);
+			used += nb;
+		}
+		e.nbits = used;
+	}
+}
+
+const elias_lut_entry* gamma_lut() {
+	static elias_lut_entry lut[ELIAS_LUT_SIZE];
+	static bool built = (build_elias_lut(lut, gamma_window_code), true);
+	(void) built;
+	return lut;
+}
+
+const elias_lut_entry* delta_lut() {
+	static elias_lut_entry lut[ELIAS_LUT_SIZE];
+	static bool built = (build_elias_lut(lut, delta_window_code), true);
+	(void) built;
+	return lut;
+}
+
+/**
+ * Fill buf with mostly small values, some of any width up to all of vT,
+ *  and its extremes
+ */
+template<typename vT>
+void elias_test_values(vT *buf, uint64_t n, uint64_t seed) {
+	const uint32_t width = 8*sizeof(vT);
+	for (uint64_t i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		uint32_t nb = ((seed >> 60) < 12) ? (seed >> 60) % 4 : (seed >> 56) % (width + 1);
+		uint64_t bits = seed * 0x9E3779B97F4A7C15ull;
+		uint64_t mag = (nb < 64) ? bits & ((static_cast<uint64_t>(1) << nb) - 1) : bits;
+		buf[i] = static_cast<vT>((seed & 1) ? 0 - mag : mag);
+	}
+	if (n > 3) {
+		buf[n - 1] = numeric_limits<vT>::max();
+		buf[n - 2] = numeric_limits<vT>::min();
+		buf[n - 3] = numeric_limits<vT>::min() + 1;
+	}
+}
+
+void test_elias_lut() {
+	//"1" "010" "011", then the start of "00100"
+	const elias_lut_entry &g = gamma_lut()[0x299];
+	assert( 3 == g.ncodes && 7 == g.nbits );
+	assert( 1 == g.vals[0] && 2 == g.vals[1] && 3 == g.vals[2] );
+	assert( 0 == gamma_lut()[0].ncodes );
+	//ten ones
+	assert( 10 == gamma_lut()[ELIAS_LUT_SIZE - 1].ncodes );
+
+	//"1" "0100" "0101" then an incomplete "0"
+	const elias_lut_entry &d = delta_lut()[0x28A];
+	assert( 3 == d.ncodes && 9 == d.nbits );
+	assert( 1 == d.vals[0] && 2 == d.vals[1] && 3 == d.vals[2] );
+	//"01100" is 4, then "1"s
+	const elias_lut_entry &d4 = delta_lut()[0x19F];
+	assert( 6 == d4.ncodes && 4 == d4.vals[0] && 1 == d4.vals[5] );
+}
+
+#endif /* ELIASLUT_HPP_ */
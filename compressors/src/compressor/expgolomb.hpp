@@ -0,0 +1,223 @@
+/*
+ * expgolomb.hpp
+ * @brief exp-Golomb coding with the order chosen per block
+ * @author ishafer
+ */
+
+#ifndef EXPGOLOMB_HPP_
+#define EXPGOLOMB_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <limits>
+
+#include "coder.hpp"
+#include "bitio.hpp"
+#include "eliasgamma.hpp"
+#include "zigzag.hpp"
+#include "../util.hpp"
+
+//values per block sharing one order
+static const uint64_t EG_BLOCK = 128;
+//bits to store the order
+static const int32_t EG_K_BITS = 6;
+static const int32_t EG_MAX_K = (1 << EG_K_BITS) - 1;
+
+/**
+ * Count values of in[0..n) (zigzagged) by number of bits, 0 for zero
+ */
+template<typename vT>
+void eg_nbits_hist(uint64_t hist[65], const vT *in, uint64_t n) {
+	memset(hist, 0, 65*sizeof(uint64_t));
+	for (uint64_t i = 0; i < n; ++i) {
+		uint64_t u = ZIGZAG_ENC(static_cast<int64_t>(in[i]));
+		++hist[(0 == u) ? 0 : nbits(u)];
+	}
+}
+
+/**
+ * @returns bits to code a b-bit value at order k, give or take one
+ */
+inline uint64_t eg_code_bits(int32_t b, int32_t k) {
+	return (b <= k) ? (1 + k) : (2*(b - k) - 1 + k);
+}
+
+/**
+ * @returns the order that codes hist in the fewest bits
+ */
+inline int32_t eg_choose_k(const uint64_t hist[65]) {
+	//q+1 must not overflow at k=0
+	int32_t k = (hist[64] > 0) ? 1 : 0;
+	int32_t best = k;
+	uint64_t bestcost = numeric_limits<uint64_t>::max();
+	for (; k <= EG_MAX_K; ++k) {
+		uint64_t cost = 0;
+		for (int32_t b = 0; b <= 64; ++b) {
+			cost += hist[b] * eg_code_bits(b, k);
+		}
+		if (cost < bestcost) {
+			bestcost = cost;
+			best = k;
+		}
+	}
+	return best;
+}
+
+/**
+ * Exp-Golomb coding with zig-zag first: the value is split into
+ *  u >> k, which is Elias-gamma coded (plus one), and k raw low bits.
+ * k is chosen from an nbits histogram of each EG_BLOCK values and
+ *  stored in front of them, so no tree is sent. k = 0 is EliasGamma.
+ */
+template<typename vT, typename bsT>
+class ExpGolomb : public Coder<vT, bsT> {
+public:
+	ExpGolomb() {};
+	~ExpGolomb() {};
+
+	unsigned char* enc(
+			unsigned char *out,
+			uint64_t *outsize,
+			vT *in,
+			uint64_t insize) const {
+		BitWriter bw(out, *outsize);
+		uint64_t hist[65];
+		for (uint64_t start = 0; start < insize; start += EG_BLOCK) {
+			uint64_t n = min(EG_BLOCK, insize - start);
+			eg_nbits_hist(hist, in + start, n);
+			int32_t k = eg_choose_k(hist);
+			bw.write(k, EG_K_BITS);
+			for (uint64_t i = start; i < start + n; ++i) {
+				uint64_t u = ZIGZAG_ENC(static_cast<int64_t>(in[i]));
+				uint64_t w = (u >> k) + 1;
+				int32_t nb = nbits(w);
+				bw.write_wide(0, nb - 1);
+				bw.write_wide(w, nb);
+				bw.write_wide(u, k);
+			}
+		}
+		*outsize = bw.finish();
+		return bw.get_backing();
+	}
+
+	vT* dec(vT *out,
+			uint64_t *outsize,
+			unsigned char *in,
+			uint64_t insize) const {
+		BitReader br(in, insize);
+		for (uint64_t start = 0; start < *outsize; start += EG_BLOCK) {
+			uint64_t end = min(start + EG_BLOCK, *outsize);
+			int32_t k = br.read(EG_K_BITS);
+			for (uint64_t i = start; i < end; ++i) {
+				//x holds the gamma code's bits below its leading one, then r
+				uint32_t z = br.read_unary(63);
+				uint64_t x = br.read(z + k);
+				uint64_t u = x + (((static_cast<uint64_t>(1) << z) - 1) << k);
+				out[i] = ZIGZAG_DEC(u);
+			}
+		}
+		return out;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(ExpGolomb);
+};
+
+void test_eg_choose_k() {
+	uint64_t hist[65];
+	memset(hist, 0, sizeof(hist));
+	//small values favour gamma
+	hist[0] = 50;
+	hist[1] = 30;
+	hist[2] = 10;
+	assert( 0 == eg_choose_k(hist) );
+
+	//a cluster of 10-bit values wants about 9 raw bits
+	memset(hist, 0, sizeof(hist));
+	hist[10] = 100;
+	hist[9] = 20;
+	int32_t k = eg_choose_k(hist);
+	assert( k >= 8 && k <= 10 );
+
+	//64-bit values must not use k = 0
+	memset(hist, 0, sizeof(hist));
+	hist[0] = 1000;
+	hist[64] = 1;
+	assert( 1 == eg_choose_k(hist) );
+}
+
+void test_expgolomb_basic() {
+	ExpGolomb<int8_t, uint8_t> coder8;
+	ExpGolomb<int16_t, uint16_t> coder16;
+	ExpGolomb<int32_t, uint32_t> coder32;
+	ExpGolomb<int64_t, uint64_t> coder64;
+
+	int32_t din[] = {1, 2, 4, 5, 6, -3, 8};
+	test_coder_array(coder32, (int32_t*) din, sizeof(din)/sizeof(int32_t));
+
+	int32_t din2[] = {0, 181817, 363636, 545454, 363636, 363636, 545454, 1, 2, 3, 4, 5};
+	test_coder_array(coder32, (int32_t*) din2, sizeof(din2)/sizeof(int32_t));
+
+	int64_t din3[] = {31014740000, 31000620000, 30985390000, 30968450000, 30950330000,
+			numeric_limits<int64_t>::min(), numeric_limits<int64_t>::max(), 0, -1};
+	test_coder_array(coder64, (int64_t*) din3, sizeof(din3)/sizeof(int64_t));
+
+	int8_t din4[] = {-128, 127, 0, 0, 0, -1, 1, 5};
+	test_coder_array(coder8, (int8_t*) din4, sizeof(din4)/sizeof(int8_t));
+
+	//several blocks, each with its own order
+	const uint64_t n = 1000;
+	int16_t *din5 = static_cast<int16_t*>(malloc(n*sizeof(int16_t)));
+	elias_test_values(din5, n, 3);
+	for (uint64_t i = 300; i < 600; ++i) {
+		din5[i] = static_cast<int16_t>(i * 37);
+	}
+	test_coder_array(coder16, din5, n);
+	free(din5);
+
+	//zeros around an extreme force k = 1, where its code has 63 leading zeros
+	int64_t din6[EG_BLOCK];
+	memset(din6, 0, sizeof(din6));
+	din6[EG_BLOCK / 2] = numeric_limits<int64_t>::min();
+	test_coder_array(coder64, din6, EG_BLOCK);
+	din6[EG_BLOCK / 2] = numeric_limits<int64_t>::max();
+	din6[EG_BLOCK - 1] = numeric_limits<int64_t>::min();
+	test_coder_array(coder64, din6, EG_BLOCK);
+}
+
+/**
+ * Residuals around a typical magnitude should beat gamma by a wide margin
+ */
+void test_expgolomb_vs_gamma() {
+	const uint64_t n = 5000;
+	int32_t *din = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	uint64_t seed = 7;
+	for (uint64_t i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		din[i] = static_cast<int32_t>((seed >> 40) % 4000) - 2000;
+	}
+	ExpGolomb<int32_t, uint32_t> eg;
+	EliasGamma<int32_t, uint32_t> gamma;
+	test_coder_array(eg, din, n);
+
+	uint64_t egsize = sizeof(int32_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *egbits = static_cast<unsigned char*>(calloc(egsize, 1));
+	egbits = eg.enc(egbits, &egsize, din, n);
+	uint64_t gsize = sizeof(int32_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *gbits = static_cast<unsigned char*>(calloc(gsize, 1));
+	gbits = gamma.enc(gbits, &gsize, din, n);
+	assert( egsize * 4 < gsize * 3 );
+
+	free(gbits);
+	free(egbits);
+	free(din);
+}
+
+void test_expgolomb() {
+	test_eg_choose_k();
+	test_expgolomb_basic();
+	test_expgolomb_vs_gamma();
+}
+
+#endif /* EXPGOLOMB_HPP_ */
@@ -0,0 +1,222 @@
+/*
+ * fcm.hpp
+ * @brief finite context method value predictors (FCM and DFCM)
+ * @author ishafer
+ */
+
+#ifndef FCM_HPP_
+#define FCM_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include "coder.hpp"
+#include "predict.hpp"
+#include "loghuffman.hpp"
+#include "../util.hpp"
+
+//entries in each hash table; two tables of 64-bit values fit in 16K of L1
+static const uint32_t FCM_TABLE_BITS = 10;
+static const uint32_t FCM_TABLE_SIZE = 1u << FCM_TABLE_BITS;
+//each new value shifts the context hash by this much, so it covers
+// about FCM_TABLE_BITS / FCM_HASH_SHIFT values
+static const uint32_t FCM_HASH_SHIFT = 3;
+
+/**
+ * Hash tables and context for FCM and DFCM prediction.
+ * FCM predicts the value that last followed the hashed recent values;
+ *  DFCM predicts the step that last followed the hashed recent steps.
+ * The predictor that was closer on the previous value is used for the
+ *  next one, so the choice costs no bits.
+ */
+template<typename uT>
+struct fcm_state {
+	uT fcm[FCM_TABLE_SIZE];
+	uT dfcm[FCM_TABLE_SIZE];
+	uint32_t fhash;
+	uint32_t dhash;
+	uT last;
+	bool use_dfcm;
+
+	fcm_state() :
+		fhash(0),
+		dhash(0),
+		last(0),
+		use_dfcm(false)
+	{
+		memset(fcm, 0, sizeof(fcm));
+		memset(dfcm, 0, sizeof(dfcm));
+	}
+
+	static inline uint32_t mix(uT x) {
+		return static_cast<uint32_t>(
+				(static_cast<uint64_t>(x) * 0x9E3779B97F4A7C15ull) >> (64 - FCM_TABLE_BITS));
+	}
+
+	inline uT predict() const {
+		return use_dfcm ? static_cast<uT>(last + dfcm[dhash]) : fcm[fhash];
+	}
+
+	/**
+	 * Learn x and move the contexts past it
+	 */
+	inline void update(uT x) {
+		uT pf = fcm[fhash];
+		uT pd = static_cast<uT>(last + dfcm[dhash]);
+		use_dfcm = residual_cost(static_cast<uT>(x - pd)) < residual_cost(static_cast<uT>(x - pf));
+
+		uT delta = static_cast<uT>(x - last);
+		fcm[fhash] = x;
+		dfcm[dhash] = delta;
+		fhash = ((fhash << FCM_HASH_SHIFT) ^ mix(x)) & (FCM_TABLE_SIZE - 1);
+		dhash = ((dhash << FCM_HASH_SHIFT) ^ mix(delta)) & (FCM_TABLE_SIZE - 1);
+		last = x;
+	}
+};
+
+template<typename uT>
+void fcm_enc(uT *out, const uT *in, uint64_t n, fcm_state<uT> &st) {
+	for (uint64_t i = 0; i < n; ++i) {
+		out[i] = static_cast<uT>(in[i] - st.predict());
+		st.update(in[i]);
+	}
+}
+
+template<typename uT>
+void fcm_dec_inplace(uT *vals, uint64_t n, fcm_state<uT> &st) {
+	for (uint64_t i = 0; i < n; ++i) {
+		vals[i] = static_cast<uT>(vals[i] + st.predict());
+		st.update(vals[i]);
+	}
+}
+
+/**
+ * FCM/DFCM transform in front of any other coder: values are replaced by
+ *  their residuals from the hashed-context predictors, so values that
+ *  recur in the same context become zeros, which a log-bucket coder
+ *  spends about one bit on.
+ * Nothing but the inner coder's output is stored.
+ * Owns (and deletes) the inner coder.
+ */
+template<typename vT, typename bsT>
+class FcmCoder : public Coder<vT, bsT> {
+public:
+	FcmCoder(const Coder<vT, bsT> *_inner) :
+		inner(_inner)
+	{
+	}
+
+	~FcmCoder() {
+		delete inner;
+	}
+
+	unsigned char* enc(
+			unsigned char *out,
+			uint64_t *outsize,
+			vT *in,
+			uint64_t insize) const {
+		bsT *resid = static_cast<bsT*>(malloc(sizeof(bsT)*insize));
+		fcm_state<bsT> *st = new fcm_state<bsT>();
+		fcm_enc(resid, reinterpret_cast<const bsT*>(in), insize, *st);
+		delete st;
+		out = inner->enc(out, outsize, reinterpret_cast<vT*>(resid), insize);
+		free(resid);
+		return out;
+	}
+
+	vT* dec(vT *out,
+			uint64_t *outsize,
+			unsigned char *in,
+			uint64_t insize) const {
+		vT *res = inner->dec(out, outsize, in, insize);
+		fcm_state<bsT> *st = new fcm_state<bsT>();
+		fcm_dec_inplace(reinterpret_cast<bsT*>(res), *outsize, *st);
+		delete st;
+		return res;
+	}
+
+private:
+	const Coder<vT, bsT> *inner;
+
+	DISALLOW_EVIL_CONSTRUCTORS(FcmCoder);
+};
+
+/**
+ * A short cycle of values is learned after one pass
+ */
+void test_fcm_cycle() {
+	const uint64_t n = 1000;
+	uint32_t cyc[] = {0, 181817, 363636, 545454, 363636, 0, 7};
+	const uint64_t ncyc = sizeof(cyc)/sizeof(uint32_t);
+	uint32_t din[n];
+	for (uint64_t i = 0; i < n; ++i) {
+		din[i] = cyc[i % ncyc];
+	}
+	uint32_t resid[n];
+	fcm_state<uint32_t> *se = new fcm_state<uint32_t>();
+	fcm_enc(resid, din, n, *se);
+	delete se;
+	uint64_t nzero = 0;
+	for (uint64_t i = 0; i < n; ++i) {
+		nzero += (0 == resid[i]);
+	}
+	assert( nzero > n - 5*ncyc );
+
+	fcm_state<uint32_t> *sd = new fcm_state<uint32_t>();
+	fcm_dec_inplace(resid, n, *sd);
+	delete sd;
+	assert( 0 == memcmp(resid, din, sizeof(din)) );
+
+	//a steady ramp is caught by DFCM
+	for (uint64_t i = 0; i < n; ++i) {
+		din[i] = static_cast<uint32_t>(1000000 + 12345*i);
+	}
+	fcm_state<uint32_t> *sr = new fcm_state<uint32_t>();
+	fcm_enc(resid, din, n, *sr);
+	delete sr;
+	nzero = 0;
+	for (uint64_t i = 0; i < n; ++i) {
+		nzero += (0 == resid[i]);
+	}
+	assert( nzero > n - 10 );
+}
+
+void test_fcm_coder() {
+	FcmCoder<int8_t, uint8_t> lh8(new LogHuffman<int8_t, uint8_t>);
+	FcmCoder<int32_t, uint32_t> lh32(new LogHuffman<int32_t, uint32_t>);
+	FcmCoder<int64_t, uint64_t> lh64(new LogHuffman<int64_t, uint64_t>);
+
+	int32_t din[] = {1, 2, 4, 5, 6, -3, 8};
+	test_coder_array(lh32, (int32_t*) din, sizeof(din)/sizeof(int32_t));
+
+	int32_t din2[] = {0, 181817, 363636, 545454, 363636, 363636, 545454, 1, 2, 3, 4, 5};
+	test_coder_array(lh32, (int32_t*) din2, sizeof(din2)/sizeof(int32_t));
+
+	int64_t din3[] = {31014740000, 31000620000, 30985390000, 30968450000, 30950330000};
+	test_coder_array(lh64, (int64_t*) din3, sizeof(din3)/sizeof(int64_t));
+
+	int8_t din4[] = {-128, 127, 0, 0, 0, -1, 1, 5, -128, 127, 0, 0};
+	test_coder_array(lh8, (int8_t*) din4, sizeof(din4)/sizeof(int8_t));
+
+	//hits should cost about a bit each
+	const uint64_t n = 20000;
+	int32_t *cyc = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	for (uint64_t i = 0; i < n; ++i) {
+		cyc[i] = din2[i % 4];
+	}
+	test_coder_array(lh32, cyc, n);
+	uint64_t outsize = sizeof(int32_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *outbits = static_cast<unsigned char*>(calloc(outsize, 1));
+	outbits = lh32.enc(outbits, &outsize, cyc, n);
+	assert( outsize < n/8 + n/40 );
+	free(outbits);
+	free(cyc);
+}
+
+void test_fcm() {
+	test_fcm_cycle();
+	test_fcm_coder();
+}
+
+#endif /* FCM_HPP_ */
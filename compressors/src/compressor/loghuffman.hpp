@@ -273,10 +273,11 @@ void tree_to_lookup_inner(
 
 /**
  * @param node huffman node to write
+ * @param nsyms size of the alphabet; every leaf must be below it
  * @returns pairs of <code, nbits>
  */
-vector<lookup_entry> tree_to_lookup(huffnode *node) {
-	vector<lookup_entry> entries(64);
+vector<lookup_entry> tree_to_lookup(huffnode *node, uint32_t nsyms = 64) {
+	vector<lookup_entry> entries(nsyms);
 	for (int i = 0; i < entries.size(); ++i) {
 		entries[i] = LOOKUP_NONE;
 	}
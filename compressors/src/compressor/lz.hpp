@@ -0,0 +1,426 @@
+/*
+ * lz.hpp
+ * @brief LZ77 coding of whole words, in the style of LZ4
+ * @author ishafer
+ */
+
+#ifndef LZ_HPP_
+#define LZ_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include "coder.hpp"
+#include "../util.hpp"
+
+//hash table entries; 16K of positions stays in L1
+static const uint32_t LZ_HASH_BITS = 12;
+static const uint32_t LZ_HASH_SIZE = 1u << LZ_HASH_BITS;
+//offsets are stored in 16 bits, in words
+static const uint64_t LZ_MAX_OFFSET = 65535;
+//shortest match in bytes; its token and offset take 3
+static const uint64_t LZ_MIN_MATCH_BYTES = 4;
+//after 2^this misses in a row, skip ahead faster through incompressible data
+static const uint32_t LZ_SKIP_SHIFT = 5;
+
+/**
+ * Words are the values themselves, but at least 4 bytes
+ */
+template<int W>
+struct lz_word {
+	typedef uint32_t type;
+};
+
+template<>
+struct lz_word<8> {
+	typedef uint64_t type;
+};
+
+template<typename wT>
+inline wT lz_load(const unsigned char *p) {
+	wT w;
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+template<typename wT>
+inline uint32_t lz_hash(wT w) {
+	return static_cast<uint32_t>(
+			(static_cast<uint64_t>(w) * 0x9E3779B97F4A7C15ull) >> (64 - LZ_HASH_BITS));
+}
+
+/**
+ * @returns most bytes lz_compress can write for nbytes of input
+ */
+inline uint64_t lz_bound(uint64_t nbytes) {
+	return nbytes + nbytes/255 + 16;
+}
+
+/**
+ * LZ4-style length: 15 in the token means more follows, in bytes of up
+ *  to 255
+ */
+inline unsigned char* lz_put_length(unsigned char *op, uint64_t len) {
+	for (len -= 15; len >= 255; len -= 255) {
+		*op++ = 255;
+	}
+	*op++ = static_cast<unsigned char>(len);
+	return op;
+}
+
+/**
+ * @param len (in/out) the token's 4 bits, then the whole length
+ * @returns false if the length runs past iend
+ */
+inline bool lz_get_length(const unsigned char *&ip, const unsigned char *iend, uint64_t *len) {
+	if (15 == *len) {
+		unsigned char b;
+		do {
+			if (ip >= iend) {
+				return false;
+			}
+			b = *ip++;
+			*len += b;
+		} while (255 == b);
+	}
+	return true;
+}
+
+/**
+ * Write one sequence: a token with the literal count and match length
+ *  (both in words), the literals, then the match's 16-bit offset.
+ * The last sequence has literals only.
+ */
+inline unsigned char* lz_put_sequence(unsigned char *op, const unsigned char *lits,
+		uint64_t nlits, uint64_t mlen, uint64_t offset, uint64_t minmatch, uint32_t wsize) {
+	unsigned char *token = op++;
+	*token = static_cast<unsigned char>(min<uint64_t>(nlits, 15) << 4);
+	if (nlits >= 15) {
+		op = lz_put_length(op, nlits);
+	}
+	memcpy(op, lits, nlits*wsize);
+	op += nlits*wsize;
+	if (0 == mlen) {
+		return op;
+	}
+	*op++ = static_cast<unsigned char>(offset);
+	*op++ = static_cast<unsigned char>(offset >> 8);
+	uint64_t mcode = mlen - minmatch;
+	*token |= static_cast<unsigned char>(min<uint64_t>(mcode, 15));
+	if (mcode >= 15) {
+		op = lz_put_length(op, mcode);
+	}
+	return op;
+}
+
+/**
+ * Compress nbytes from in, matching whole words at word boundaries
+ * @param out at least lz_bound(nbytes) bytes
+ * @returns bytes written
+ */
+template<typename wT>
+uint64_t lz_compress(unsigned char *out, const unsigned char *in, uint64_t nbytes) {
+	const uint32_t wsize = sizeof(wT);
+	const uint64_t nwords = nbytes / wsize;
+	const uint64_t minmatch = (LZ_MIN_MATCH_BYTES + wsize - 1) / wsize;
+	//positions plus one, so zero is empty
+	uint32_t table[LZ_HASH_SIZE];
+	memset(table, 0, sizeof(table));
+
+	unsigned char *op = out;
+	uint64_t anchor = 0;
+	uint64_t i = 0;
+	uint32_t misses = 0;
+	//positions past 2^32 words aren't hashed, so only match nearby
+	while (i + minmatch <= nwords && i < 0xFFFFFFFFull) {
+		wT w = lz_load<wT>(in + i*wsize);
+		uint32_t h = lz_hash(w);
+		uint64_t cand = table[h];
+		table[h] = static_cast<uint32_t>(i + 1);
+		if (0 != cand && i - (cand - 1) <= LZ_MAX_OFFSET &&
+				lz_load<wT>(in + (cand - 1)*wsize) == w) {
+			uint64_t c = cand - 1;
+			uint64_t len = 1;
+			while (i + len < nwords &&
+					lz_load<wT>(in + (i + len)*wsize) == lz_load<wT>(in + (c + len)*wsize)) {
+				++len;
+			}
+			if (len >= minmatch) {
+				op = lz_put_sequence(op, in + anchor*wsize, i - anchor, len, i - c, minmatch, wsize);
+				i += len;
+				anchor = i;
+				misses = 0;
+				//so that the next run of the same words is found
+				if (i - 1 < 0xFFFFFFFFull) {
+					table[lz_hash(lz_load<wT>(in + (i - 1)*wsize))] = static_cast<uint32_t>(i);
+				}
+				continue;
+			}
+		}
+		++misses;
+		i += 1 + (misses >> LZ_SKIP_SHIFT);
+	}
+	op = lz_put_sequence(op, in + anchor*wsize, nwords - anchor, 0, 0, minmatch, wsize);
+	//bytes past the last whole word
+	memcpy(op, in + nwords*wsize, nbytes - nwords*wsize);
+	op += nbytes - nwords*wsize;
+	return op - out;
+}
+
+/**
+ * Decompress exactly nbytes into out
+ * @param iend end of the input; nothing at or past it is read
+ * @returns false if the input is cut short, or refers to data outside out
+ */
+template<typename wT>
+bool lz_decompress(unsigned char *out, uint64_t nbytes, const unsigned char *in,
+		const unsigned char *iend) {
+	const uint32_t wsize = sizeof(wT);
+	const uint64_t nwords = nbytes / wsize;
+	const uint64_t minmatch = (LZ_MIN_MATCH_BYTES + wsize - 1) / wsize;
+	const unsigned char *ip = in;
+	uint64_t done = 0;
+	while (true) {
+		if (ip >= iend) {
+			return false;
+		}
+		unsigned char token = *ip++;
+		uint64_t nlits = token >> 4;
+		if (!lz_get_length(ip, iend, &nlits) || nlits > nwords - done ||
+				nlits*wsize > static_cast<uint64_t>(iend - ip)) {
+			return false;
+		}
+		memcpy(out + done*wsize, ip, nlits*wsize);
+		ip += nlits*wsize;
+		done += nlits;
+		if (done == nwords) {
+			break;
+		}
+		if (iend - ip < 2) {
+			return false;
+		}
+		uint64_t offset = ip[0] | (static_cast<uint64_t>(ip[1]) << 8);
+		ip += 2;
+		uint64_t mlen = token & 15;
+		if (!lz_get_length(ip, iend, &mlen)) {
+			return false;
+		}
+		mlen += minmatch;
+		if (0 == offset || offset > done || mlen > nwords - done) {
+			return false;
+		}
+		unsigned char *dst = out + done*wsize;
+		const unsigned char *src = dst - offset*wsize;
+		if (offset >= mlen) {
+			memcpy(dst, src, mlen*wsize);
+		} else {
+			//overlapping: repeats the last offset words
+			for (uint64_t k = 0; k < mlen*wsize; ++k) {
+				dst[k] = src[k];
+			}
+		}
+		done += mlen;
+	}
+	if (nbytes - nwords*wsize > static_cast<uint64_t>(iend - ip)) {
+		return false;
+	}
+	memcpy(out + nwords*wsize, ip, nbytes - nwords*wsize);
+	return true;
+}
+
+/**
+ * Fast LZ77 coder without an entropy stage, for columns with repeats
+ *  (often after delta or shuffle). Matches start and end on whole
+ *  values (or 4-byte words, for narrower values), which keeps the
+ *  hash table small and the copies wide.
+ */
+template<typename vT, typename bsT>
+class WordLZ : public Coder<vT, bsT> {
+public:
+	typedef typename lz_word<sizeof(vT)>::type wT;
+
+	WordLZ() {};
+	~WordLZ() {};
+
+	unsigned char* enc(
+			unsigned char *out,
+			uint64_t *outsize,
+			vT *in,
+			uint64_t insize) const {
+		const uint64_t nbytes = insize*sizeof(vT);
+		const uint64_t bound = lz_bound(nbytes);
+		if (*outsize < bound) {
+			unsigned char *res = static_cast<unsigned char*>(realloc(out, bound));
+			if (NULL == res) {
+				cerr << "failed to expand LZ output" << endl;
+				*outsize = 0;
+				return out;
+			}
+			out = res;
+		}
+		*outsize = lz_compress<wT>(out, reinterpret_cast<const unsigned char*>(in), nbytes);
+		return out;
+	}
+
+	vT* dec(vT *out,
+			uint64_t *outsize,
+			unsigned char *in,
+			uint64_t insize) const {
+		if (!lz_decompress<wT>(reinterpret_cast<unsigned char*>(out), *outsize*sizeof(vT),
+				in, in + insize)) {
+			cerr << "Corrupt LZ input" << endl;
+			*outsize = 0;
+		}
+		return out;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(WordLZ);
+};
+
+void test_lz_lengths() {
+	unsigned char buf[16];
+	uint64_t lens[] = {15, 16, 269, 270, 271, 1000};
+	for (int t = 0; t < 6; ++t) {
+		unsigned char *end = lz_put_length(buf, lens[t]);
+		const unsigned char *ip = buf;
+		uint64_t len = 15;
+		assert( lz_get_length(ip, end, &len) );
+		assert( lens[t] == len && ip == end );
+		//cut short
+		ip = buf;
+		len = 15;
+		assert( !lz_get_length(ip, end - 1, &len) );
+	}
+	const unsigned char *ip = buf;
+	uint64_t len = 7;
+	assert( lz_get_length(ip, buf, &len) );
+	assert( 7 == len && ip == buf );
+}
+
+void test_lz_basic() {
+	WordLZ<int8_t, uint8_t> lz8;
+	WordLZ<int16_t, uint16_t> lz16;
+	WordLZ<int32_t, uint32_t> lz32;
+	WordLZ<int64_t, uint64_t> lz64;
+
+	int32_t din[] = {1, 2, 4, 5, 6, -3, 8};
+	test_coder_array(lz32, (int32_t*) din, sizeof(din)/sizeof(int32_t));
+
+	int32_t din2[] = {0, 181817, 363636, 545454, 363636, 363636, 545454, 1, 2, 3, 4, 5};
+	test_coder_array(lz32, (int32_t*) din2, sizeof(din2)/sizeof(int32_t));
+
+	int64_t din3[] = {31014740000, 31000620000, 30985390000, 30968450000, 30950330000};
+	test_coder_array(lz64, (int64_t*) din3, sizeof(din3)/sizeof(int64_t));
+
+	//a partial word at the end
+	int8_t din4[] = {-128, 127, 0, 0, 0, -1, 1, 5, -128, 127, 0, 0, 0, -1, 1, 5, 9, 9, 9};
+	test_coder_array(lz8, (int8_t*) din4, sizeof(din4)/sizeof(int8_t));
+
+	int16_t din5[] = {3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3};
+	test_coder_array(lz16, (int16_t*) din5, sizeof(din5)/sizeof(int16_t));
+}
+
+/**
+ * Long runs and long literals need the extra length bytes; runs copy
+ *  from just behind themselves
+ */
+void test_lz_runs() {
+	WordLZ<int32_t, uint32_t> lz32;
+	WordLZ<int64_t, uint64_t> lz64;
+	const uint64_t n = 40000;
+	int32_t *din = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	uint64_t seed = 3;
+	for (uint64_t i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		if ((i / 1000) % 2) {
+			din[i] = static_cast<int32_t>(seed >> 32);
+		} else {
+			din[i] = (i < 20000) ? 0 : static_cast<int32_t>(i % 7);
+		}
+	}
+	test_coder_array(lz32, din, n);
+
+	uint64_t outsize = sizeof(int32_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *outbits = static_cast<unsigned char*>(calloc(outsize, 1));
+	outbits = lz32.enc(outbits, &outsize, din, n);
+	//half of it is random, the other half nearly free
+	assert( outsize < n*sizeof(int32_t)/2 + n/10 );
+	free(outbits);
+
+	//random data comes out only slightly bigger, even in a small buffer
+	int64_t *rnd = static_cast<int64_t*>(malloc(n*sizeof(int64_t)));
+	for (uint64_t i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		rnd[i] = static_cast<int64_t>(seed);
+	}
+	test_coder_array(lz64, rnd, n);
+	uint64_t rsize = 16;
+	unsigned char *rbits = static_cast<unsigned char*>(malloc(rsize));
+	rbits = lz64.enc(rbits, &rsize, rnd, n);
+	assert( rsize <= lz_bound(n*sizeof(int64_t)) );
+	int64_t *back = static_cast<int64_t*>(malloc(n*sizeof(int64_t)));
+	uint64_t nback = n;
+	lz64.dec(back, &nback, rbits, rsize);
+	assert( 0 == memcmp(back, rnd, n*sizeof(int64_t)) );
+
+	free(back);
+	free(rbits);
+	free(rnd);
+	free(din);
+}
+
+/**
+ * Truncated or corrupt input is refused without reading past its end
+ */
+void test_lz_corrupt() {
+	WordLZ<int32_t, uint32_t> lz32;
+	const uint64_t n = 3000;
+	int32_t *din = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	for (uint64_t i = 0; i < n; ++i) {
+		din[i] = (i % 500 < 300) ? static_cast<int32_t>(i % 11) : static_cast<int32_t>(i * 2654435761u);
+	}
+	uint64_t encsize = lz_bound(n*sizeof(int32_t));
+	unsigned char *enc = static_cast<unsigned char*>(malloc(encsize));
+	enc = lz32.enc(enc, &encsize, din, n);
+	int32_t *dout = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+
+	//every prefix, in a buffer of exactly its size so overreads are caught
+	for (uint64_t cut = 0; cut < encsize; cut += (cut < 64) ? 1 : 97) {
+		unsigned char *part = static_cast<unsigned char*>(malloc(cut + (0 == cut)));
+		memcpy(part, enc, cut);
+		uint64_t ndec = n;
+		lz32.dec(dout, &ndec, part, cut);
+		assert( 0 == ndec );
+		free(part);
+	}
+	//flipped bytes decode to something, or are refused
+	uint64_t seed = 9;
+	for (int t = 0; t < 200; ++t) {
+		unsigned char *bad = static_cast<unsigned char*>(malloc(encsize));
+		memcpy(bad, enc, encsize);
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		bad[(seed >> 33) % encsize] ^= static_cast<unsigned char>(1 + (seed >> 20) % 255);
+		uint64_t ndec = n;
+		lz32.dec(dout, &ndec, bad, encsize);
+		assert( 0 == ndec || n == ndec );
+		free(bad);
+	}
+	uint64_t ndec = n;
+	lz32.dec(dout, &ndec, enc, encsize);
+	assert( n == ndec && 0 == memcmp(din, dout, n*sizeof(int32_t)) );
+
+	free(dout);
+	free(enc);
+	free(din);
+}
+
+void test_lz() {
+	test_lz_lengths();
+	test_lz_basic();
+	test_lz_runs();
+	test_lz_corrupt();
+}
+
+#endif /* LZ_HPP_ */
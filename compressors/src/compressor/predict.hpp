@@ -0,0 +1,385 @@
+/*
+ * predict.hpp
+ * @brief fixed polynomial predictors, with the order chosen per block
+ * @author ishafer
+ */
+
+#ifndef PREDICT_HPP_
+#define PREDICT_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+#include "coder.hpp"
+#include "delta.hpp"
+#include "eliasgamma.hpp"
+#include "expgolomb.hpp"
+#include "loghuffman.hpp"
+#include "lz.hpp"
+#include "zigzag.hpp"
+#include "zlib.hpp"
+#include "../util.hpp"
+
+using namespace std;
+
+//values per block sharing one order
+static const uint64_t PREDICT_BLOCK = 1024;
+//orders 0 (raw) to 3 (cubic); 1 is delta_enc
+static const uint32_t PREDICT_MAX_ORDER = 3;
+//orders are stored in 2 bits, 4 blocks to a byte
+static const uint32_t PREDICT_ORDERS_PER_BYTE = 4;
+
+/**
+ * The last three values, carried across blocks.
+ * uT is unsigned, so that every prediction wraps exactly.
+ */
+template<typename uT>
+struct predict_history {
+	uT x1;
+	uT x2;
+	uT x3;
+
+	predict_history() :
+		x1(0),
+		x2(0),
+		x3(0)
+	{
+	}
+
+	inline void push(uT x) {
+		x3 = x2;
+		x2 = x1;
+		x1 = x;
+	}
+
+	/**
+	 * @returns the next value extrapolated from the last order values
+	 */
+	inline uT predict(uint32_t order) const {
+		switch (order) {
+		case 0:
+			return 0;
+		case 1:
+			return x1;
+		case 2:
+			return static_cast<uT>(2*x1 - x2);
+		default:
+			return static_cast<uT>(3*x1 - 3*x2 + x3);
+		}
+	}
+};
+
+/**
+ * @returns roughly the bits a log-bucket coder spends on residual r
+ */
+template<typename uT>
+inline uint32_t residual_cost(uT r) {
+	uT zz = static_cast<uT>(r << 1) ^ static_cast<uT>(0 - (r >> (8*sizeof(uT) - 1)));
+	return nbits(static_cast<uint64_t>(zz) | 1);
+}
+
+/**
+ * @returns the order whose residuals over in[0..n) are smallest;
+ *  the lower order on ties
+ */
+template<typename uT>
+uint32_t predict_choose_order(const uT *in, uint64_t n, predict_history<uT> hist) {
+	uint64_t cost[PREDICT_MAX_ORDER + 1] = {0, 0, 0, 0};
+	for (uint64_t i = 0; i < n; ++i) {
+		for (uint32_t o = 0; o <= PREDICT_MAX_ORDER; ++o) {
+			cost[o] += residual_cost(static_cast<uT>(in[i] - hist.predict(o)));
+		}
+		hist.push(in[i]);
+	}
+	uint32_t best = 0;
+	for (uint32_t o = 1; o <= PREDICT_MAX_ORDER; ++o) {
+		if (cost[o] < cost[best]) {
+			best = o;
+		}
+	}
+	return best;
+}
+
+template<typename uT>
+void predict_enc(uT *out, const uT *in, uint64_t n, uint32_t order, predict_history<uT> &hist) {
+	for (uint64_t i = 0; i < n; ++i) {
+		out[i] = static_cast<uT>(in[i] - hist.predict(order));
+		hist.push(in[i]);
+	}
+}
+
+template<typename uT>
+void predict_dec_inplace(uT *vals, uint64_t n, uint32_t order, predict_history<uT> &hist) {
+	for (uint64_t i = 0; i < n; ++i) {
+		vals[i] = static_cast<uT>(vals[i] + hist.predict(order));
+		hist.push(vals[i]);
+	}
+}
+
+/**
+ * Predictive transform in front of any other coder.
+ * Each PREDICT_BLOCK values are replaced by their residuals from the
+ *  order 0-3 polynomial predictor that leaves the smallest residuals;
+ *  the inner coder then codes the residuals.
+ * Layout: 2-bit order of each block, then the inner coder's output.
+ * Owns (and deletes) the inner coder.
+ */
+template<typename vT, typename bsT>
+class PredictCoder : public Coder<vT, bsT> {
+public:
+	PredictCoder(const Coder<vT, bsT> *_inner) :
+		inner(_inner)
+	{
+	}
+
+	~PredictCoder() {
+		delete inner;
+	}
+
+	unsigned char* enc(
+			unsigned char *out,
+			uint64_t *outsize,
+			vT *in,
+			uint64_t insize) const {
+		uint64_t nblocks = (insize + PREDICT_BLOCK - 1) / PREDICT_BLOCK;
+		uint64_t hdrsize = (nblocks + PREDICT_ORDERS_PER_BYTE - 1) / PREDICT_ORDERS_PER_BYTE;
+		unsigned char *orders = static_cast<unsigned char*>(calloc(hdrsize, 1));
+		bsT *resid = static_cast<bsT*>(malloc(sizeof(bsT)*insize));
+		const bsT *vals = reinterpret_cast<const bsT*>(in);
+
+		predict_history<bsT> hist;
+		for (uint64_t bdx = 0; bdx < nblocks; ++bdx) {
+			uint64_t start = bdx * PREDICT_BLOCK;
+			uint64_t len = min(PREDICT_BLOCK, insize - start);
+			uint32_t order = predict_choose_order(vals + start, len, hist);
+			orders[bdx / PREDICT_ORDERS_PER_BYTE] |= order << (2*(bdx % PREDICT_ORDERS_PER_BYTE));
+			predict_enc(resid + start, vals + start, len, order, hist);
+		}
+
+		uint64_t cap = *outsize;
+		out = inner->enc(out, outsize, reinterpret_cast<vT*>(resid), insize);
+		free(resid);
+
+		uint64_t total = hdrsize + *outsize;
+		if (total > cap) {
+			unsigned char *res = static_cast<unsigned char*>(realloc(out, total));
+			if (NULL == res) {
+				cerr << "failed to expand predict output" << endl;
+				*outsize = 0;
+				free(orders);
+				return out;
+			}
+			out = res;
+		}
+		memmove(out + hdrsize, out, *outsize);
+		memcpy(out, orders, hdrsize);
+		free(orders);
+		*outsize = total;
+		return out;
+	}
+
+	vT* dec(vT *out,
+			uint64_t *outsize,
+			unsigned char *in,
+			uint64_t insize) const {
+		const uint64_t n = *outsize;
+		uint64_t nblocks = (n + PREDICT_BLOCK - 1) / PREDICT_BLOCK;
+		uint64_t hdrsize = (nblocks + PREDICT_ORDERS_PER_BYTE - 1) / PREDICT_ORDERS_PER_BYTE;
+		if (hdrsize > insize) {
+			cerr << "predict stream truncated" << endl;
+			*outsize = 0;
+			return out;
+		}
+		vT *res = inner->dec(out, outsize, in + hdrsize, insize - hdrsize);
+		//a short inner decode has no residuals to undo
+		if (*outsize != n) {
+			cerr << "predict inner decode failed" << endl;
+			*outsize = 0;
+			return res;
+		}
+		bsT *vals = reinterpret_cast<bsT*>(res);
+
+		predict_history<bsT> hist;
+		for (uint64_t bdx = 0; bdx < nblocks; ++bdx) {
+			uint64_t start = bdx * PREDICT_BLOCK;
+			uint64_t len = min(PREDICT_BLOCK, n - start);
+			uint32_t order = (in[bdx / PREDICT_ORDERS_PER_BYTE] >>
+					(2*(bdx % PREDICT_ORDERS_PER_BYTE))) & 3;
+			predict_dec_inplace(vals + start, len, order, hist);
+		}
+		return res;
+	}
+
+private:
+	const Coder<vT, bsT> *inner;
+
+	DISALLOW_EVIL_CONSTRUCTORS(PredictCoder);
+};
+
+void test_predict_orders() {
+	//a quadratic: order 2 leaves a constant, order 3 leaves zeros
+	const uint64_t n = 50;
+	uint32_t sq[n];
+	for (uint64_t i = 0; i < n; ++i) {
+		sq[i] = static_cast<uint32_t>(i*i);
+	}
+	uint32_t resid[n];
+	predict_history<uint32_t> h2;
+	predict_enc(resid, sq, n, 2, h2);
+	for (uint64_t i = 2; i < n; ++i) {
+		assert( 2 == resid[i] );
+	}
+	predict_history<uint32_t> h3;
+	predict_enc(resid, sq, n, 3, h3);
+	for (uint64_t i = 3; i < n; ++i) {
+		assert( 0 == resid[i] );
+	}
+	predict_history<uint32_t> hd;
+	predict_dec_inplace(resid, n, 3, hd);
+	assert( 0 == memcmp(resid, sq, sizeof(sq)) );
+
+	predict_history<uint32_t> hc;
+	assert( 3 == predict_choose_order(sq, n, hc) );
+	//a line is caught by order 2, and order 3 is no better
+	uint32_t line[n];
+	for (uint64_t i = 0; i < n; ++i) {
+		line[i] = static_cast<uint32_t>(1000 + 7*i);
+	}
+	assert( 2 == predict_choose_order(line, n, hc) );
+	//ties go to the lower order
+	uint32_t zeros[n];
+	memset(zeros, 0, sizeof(zeros));
+	assert( 0 == predict_choose_order(zeros, n, hc) );
+	assert( 1 == residual_cost<uint32_t>(0) );
+	assert( 2 == residual_cost<uint32_t>(1) );
+	assert( 1 + 31 == residual_cost<uint32_t>(1u << 31) );
+	assert( 8 == residual_cost<uint8_t>(128) );
+}
+
+/**
+ * Residuals must wrap exactly at the ends of the range
+ */
+void test_predict_wraparound() {
+	uint8_t din[] = {0, 255, 1, 254, 128, 127, 0, 255, 255, 0, 128, 128, 3};
+	const uint64_t n = sizeof(din);
+	for (uint32_t order = 0; order <= PREDICT_MAX_ORDER; ++order) {
+		uint8_t resid[n];
+		predict_history<uint8_t> he;
+		predict_enc(resid, din, n, order, he);
+		predict_history<uint8_t> hd;
+		predict_dec_inplace(resid, n, order, hd);
+		assert( 0 == memcmp(resid, din, n) );
+	}
+
+	uint64_t din64[] = {0, ~0ull, 1, ~0ull - 1, 1ull << 63, (1ull << 63) - 1, 0, 5};
+	const uint64_t n64 = sizeof(din64)/sizeof(uint64_t);
+	for (uint32_t order = 0; order <= PREDICT_MAX_ORDER; ++order) {
+		uint64_t resid[n64];
+		predict_history<uint64_t> he;
+		predict_enc(resid, din64, n64, order, he);
+		predict_history<uint64_t> hd;
+		predict_dec_inplace(resid, n64, order, hd);
+		assert( 0 == memcmp(resid, din64, sizeof(din64)) );
+	}
+}
+
+void test_predict_coder() {
+	PredictCoder<int8_t, uint8_t> lh8(new LogHuffman<int8_t, uint8_t>);
+	PredictCoder<int32_t, uint32_t> eg32(new EliasGamma<int32_t, uint32_t>);
+	PredictCoder<int32_t, uint32_t> zl32(new ZLib<int32_t, uint32_t>);
+	PredictCoder<int64_t, uint64_t> lh64(new LogHuffman<int64_t, uint64_t>);
+	//takes residuals over the whole range
+	PredictCoder<int64_t, uint64_t> eg64(new ExpGolomb<int64_t, uint64_t>);
+
+	int32_t din[] = {1, 2, 4, 5, 6, -3, 8};
+	test_coder_array(eg32, (int32_t*) din, sizeof(din)/sizeof(int32_t));
+	test_coder_array(zl32, (int32_t*) din, sizeof(din)/sizeof(int32_t));
+
+	int64_t din3[] = {31014740000, 31000620000, 30985390000, 30968450000, 30950330000};
+	test_coder_array(lh64, (int64_t*) din3, sizeof(din3)/sizeof(int64_t));
+
+	int64_t din5[] = {31014740000, 31000620000, 30985390000, 30968450000, 30950330000,
+			numeric_limits<int64_t>::min(), numeric_limits<int64_t>::max(), 0, -1};
+	test_coder_array(eg64, (int64_t*) din5, sizeof(din5)/sizeof(int64_t));
+
+	int8_t din4[] = {-128, 127, 0, 0, 0, -1, 1, 5, -128, -128, 127};
+	test_coder_array(lh8, (int8_t*) din4, sizeof(din4)/sizeof(int8_t));
+
+	//many blocks, switching between smooth and noisy
+	const uint64_t n = 10*PREDICT_BLOCK + 17;
+	int32_t *smooth = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	uint64_t seed = 3;
+	for (uint64_t i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		smooth[i] = static_cast<int32_t>(100000 * sin(i / 300.0));
+		if ((i / PREDICT_BLOCK) % 3 == 1) {
+			smooth[i] += static_cast<int32_t>(seed >> 44);
+		}
+	}
+	test_coder_array(eg32, smooth, n);
+	test_coder_array(zl32, smooth, n);
+
+	//a smooth signal should beat plain delta coding handily
+	for (uint64_t i = 0; i < n; ++i) {
+		smooth[i] = static_cast<int32_t>(100000 * sin(i / 300.0));
+	}
+	uint64_t psize = sizeof(int32_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *pbits = static_cast<unsigned char*>(calloc(psize, 1));
+	pbits = eg32.enc(pbits, &psize, smooth, n);
+
+	int32_t *deltas = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	delta_enc(deltas, smooth, n);
+	EliasGamma<int32_t, uint32_t> eg;
+	uint64_t dsize = sizeof(int32_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *dbits = static_cast<unsigned char*>(calloc(dsize, 1));
+	dbits = eg.enc(dbits, &dsize, deltas, n);
+	assert( psize * 2 < dsize );
+
+	free(dbits);
+	free(deltas);
+	free(pbits);
+	free(smooth);
+}
+
+/**
+ * A failed inner decode must not be undone over a short output
+ */
+void test_predict_short() {
+	PredictCoder<int32_t, uint32_t> lz32(new WordLZ<int32_t, uint32_t>);
+	const uint64_t n = 3*PREDICT_BLOCK + 5;
+	int32_t *din = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	for (uint64_t i = 0; i < n; ++i) {
+		din[i] = static_cast<int32_t>(1000 * sin(i / 50.0));
+	}
+	uint64_t encsize = sizeof(int32_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *enc = static_cast<unsigned char*>(calloc(encsize, 1));
+	enc = lz32.enc(enc, &encsize, din, n);
+
+	int32_t *dout = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	uint64_t cuts[] = {0, 1, encsize / 2, encsize - 1};
+	for (int c = 0; c < 4; ++c) {
+		uint64_t ndec = n;
+		lz32.dec(dout, &ndec, enc, cuts[c]);
+		assert( 0 == ndec );
+	}
+	uint64_t ndec = n;
+	lz32.dec(dout, &ndec, enc, encsize);
+	assert( n == ndec && 0 == memcmp(din, dout, n*sizeof(int32_t)) );
+
+	free(dout);
+	free(enc);
+	free(din);
+}
+
+void test_predict() {
+	test_predict_orders();
+	test_predict_wraparound();
+	test_predict_coder();
+	test_predict_short();
+}
+
+#endif /* PREDICT_HPP_ */
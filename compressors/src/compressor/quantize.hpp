@@ -0,0 +1,173 @@
+/*
+ * quantize.hpp
+ * @brief error-bounded quantization of integer values
+ * @author ishafer
+ */
+
+#ifndef QUANTIZE_HPP_
+#define QUANTIZE_HPP_
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <limits>
+
+#include "delta.hpp"
+#include "../util.hpp"
+
+using namespace std;
+
+//largest bound we take, so that the bin width fits comfortably
+static const int64_t QUANTIZE_MAX_EPS = 1ll << 61;
+
+/**
+ * @param eps absolute error bound in the stream's units
+ * @param vscale stored values are the stream's times 10^-vscale
+ * @returns the bound in stored units, rounded down so it holds
+ */
+int64_t quantize_eps(double eps, int vscale) {
+	if (!(eps > 0)) {
+		return 0;
+	}
+	//allow for 0.01 * 100 coming out just under 1
+	double scaled = floor(eps * pow(10.0, -vscale) * (1 + 1e-12));
+	if (scaled >= static_cast<double>(QUANTIZE_MAX_EPS)) {
+		return QUANTIZE_MAX_EPS;
+	}
+	return static_cast<int64_t>(scaled);
+}
+
+/**
+ * Replace each value by the index of the nearest multiple of 2*eps+1, the
+ *  widest bins whose centres are within eps of all their values.
+ * Indices are smaller than the values by the bin width, and so are their
+ *  deltas and residuals.
+ */
+template<typename vT>
+void quantize(vT *out, const vT *in, uint64_t n, int64_t eps) {
+	const int64_t step = 2*eps + 1;
+	for (uint64_t i = 0; i < n; ++i) {
+		int64_t x = in[i];
+		//floor division, then round up if the upper centre is nearer
+		int64_t q = x / step;
+		int64_t r = x - q*step;
+		if (r < 0) {
+			--q;
+			r += step;
+		}
+		if (r > eps) {
+			++q;
+		}
+		out[i] = static_cast<vT>(q);
+	}
+}
+
+/**
+ * Map indices back to bin centres, clamped to vT's range
+ */
+template<typename vT>
+void dequantize_inplace(vT *vals, uint64_t n, int64_t eps) {
+	const int64_t step = 2*eps + 1;
+	const int64_t vmax = numeric_limits<vT>::max();
+	const int64_t vmin = numeric_limits<vT>::min();
+	for (uint64_t i = 0; i < n; ++i) {
+		int64_t q = vals[i];
+		if (q > vmax / step) {
+			vals[i] = static_cast<vT>(vmax);
+		} else if (q < vmin / step) {
+			vals[i] = static_cast<vT>(vmin);
+		} else {
+			vals[i] = static_cast<vT>(q*step);
+		}
+	}
+}
+
+/**
+ * @returns largest absolute difference between a and b
+ */
+template<typename vT>
+uint64_t max_abs_error(const vT *a, const vT *b, uint64_t n) {
+	uint64_t worst = 0;
+	for (uint64_t i = 0; i < n; ++i) {
+		uint64_t d = (a[i] > b[i]) ?
+				static_cast<uint64_t>(a[i]) - static_cast<uint64_t>(b[i]) :
+				static_cast<uint64_t>(b[i]) - static_cast<uint64_t>(a[i]);
+		worst = max(worst, d);
+	}
+	return worst;
+}
+
+/**
+ * @param coded what the coder was given: bin indices, delta encoded if deltaenc
+ * @returns whether the values coded decode to within eps of raw
+ */
+template<typename vT>
+bool quantize_bound_holds(const vT *raw, const vT *coded, uint64_t n, bool deltaenc, int64_t eps) {
+	vT *recon = static_cast<vT*>(malloc(n*sizeof(vT)));
+	memcpy(recon, coded, n*sizeof(vT));
+	if (deltaenc) {
+		delta_dec_inplace(recon, n);
+	}
+	dequantize_inplace(recon, n, eps);
+	bool ok = max_abs_error(raw, recon, n) <= static_cast<uint64_t>(eps);
+	free(recon);
+	return ok;
+}
+
+void test_quantize_eps() {
+	assert( 0 == quantize_eps(0, -5) );
+	assert( 1 == quantize_eps(0.01, -2) );
+	assert( 0 == quantize_eps(0.001, -2) );
+	assert( 10000 == quantize_eps(1e-4, -8) );
+	assert( 5 == quantize_eps(50, 1) );
+	assert( QUANTIZE_MAX_EPS == quantize_eps(1e30, 0) );
+}
+
+template<typename vT>
+void test_quantize_bound(int64_t eps) {
+	const uint64_t n = 3000;
+	vT *din = static_cast<vT*>(malloc(n*sizeof(vT)));
+	vT *q = static_cast<vT*>(malloc(n*sizeof(vT)));
+	uint64_t seed = 11;
+	for (uint64_t i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		din[i] = static_cast<vT>(seed >> 17);
+	}
+	din[0] = numeric_limits<vT>::max();
+	din[1] = numeric_limits<vT>::min();
+	din[2] = 0;
+	din[3] = -1;
+	din[4] = static_cast<vT>(eps);
+	din[5] = static_cast<vT>(eps + 1);
+	quantize(q, din, n, eps);
+	if (0 == eps) {
+		assert( 0 == memcmp(q, din, n*sizeof(vT)) );
+	} else {
+		assert( 0 == q[2] && 0 == q[3] && 0 == q[4] && 1 == q[5] );
+	}
+	vT *coded = static_cast<vT*>(malloc(n*sizeof(vT)));
+	delta_enc(coded, q, n);
+	assert( quantize_bound_holds(din, coded, n, true, eps) );
+	//a bin off is caught
+	coded[7] = static_cast<vT>(coded[7] + 1);
+	assert( !quantize_bound_holds(din, coded, n, true, eps) );
+	dequantize_inplace(q, n, eps);
+	assert( max_abs_error(din, q, n) <= static_cast<uint64_t>(eps) );
+	free(coded);
+	free(q);
+	free(din);
+}
+
+void test_quantize() {
+	test_quantize_eps();
+	test_quantize_bound<int8_t>(0);
+	test_quantize_bound<int8_t>(3);
+	test_quantize_bound<int16_t>(100);
+	test_quantize_bound<int32_t>(1);
+	test_quantize_bound<int32_t>(12345);
+	test_quantize_bound<int64_t>(7);
+	test_quantize_bound<int64_t>(1ll << 40);
+}
+
+#endif /* QUANTIZE_HPP_ */
@@ -0,0 +1,356 @@
+/*
+ * rans.hpp
+ * @brief log-rANS encoder/decoder
+ * @author ishafer
+ */
+
+#ifndef RANS_HPP_
+#define RANS_HPP_
+
+#include "coder.hpp"
+#include "bitstream.hpp"
+#include "loghuffman.hpp"
+#include "eliaslut.hpp"
+#include "zigzag.hpp"
+#include "../util.hpp"
+
+//probabilities are quantised to multiples of 2^-RANS_SCALE_BITS
+static const uint32_t RANS_SCALE_BITS = 12;
+static const uint32_t RANS_M = 1u << RANS_SCALE_BITS;
+//lower bound of the normalised state interval
+static const uint32_t RANS_L = 1u << 23;
+//interleaved states; decode steps on different states are independent
+static const int RANS_NSTATES = 4;
+//log bucket symbols: elias_nbits() of a 64-bit value, up to 65
+static const int RANS_NSYMS = 66;
+
+/**
+ * Scale counts to frequencies summing to RANS_M, keeping every
+ *  symbol that occurs at a frequency of at least 1
+ */
+void rans_normalize(const uint64_t *counts, uint64_t total, uint32_t *freqs) {
+	int64_t sum = 0;
+	int largest = 0;
+	for (int s = 0; s < RANS_NSYMS; ++s) {
+		freqs[s] = 0;
+		if (counts[s] > 0) {
+			freqs[s] = max(static_cast<uint64_t>(1), counts[s] * RANS_M / total);
+			sum += freqs[s];
+			if (counts[s] > counts[largest]) {
+				largest = s;
+			}
+		}
+	}
+	if (0 == sum) {
+		return;
+	}
+	//rounding error goes to (or comes from) the most common symbols
+	while (sum < RANS_M) {
+		++freqs[largest];
+		++sum;
+	}
+	while (sum > RANS_M) {
+		int s = 0;
+		for (int t = 0; t < RANS_NSYMS; ++t) {
+			if (freqs[t] > freqs[s]) {
+				s = t;
+			}
+		}
+		--freqs[s];
+		--sum;
+	}
+}
+
+void rans_put_varint(unsigned char *out, uint64_t *pos, uint64_t v) {
+	while (v >= 0x80) {
+		out[(*pos)++] = static_cast<unsigned char>(v | 0x80);
+		v >>= 7;
+	}
+	out[(*pos)++] = static_cast<unsigned char>(v);
+}
+
+uint64_t rans_get_varint(const unsigned char *in, uint64_t *pos) {
+	uint64_t v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		unsigned char b = in[(*pos)++];
+		v |= static_cast<uint64_t>(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			break;
+		}
+	}
+	return v;
+}
+
+/**
+ * rANS coding of the log bucket (as LogHuffman) of each value, followed
+ *  by the raw mantissa bits.
+ * Layout: frequency table, rANS byte stream, mantissa bitstream.
+ * Buckets use RANS_NSTATES interleaved states sharing one byte stream,
+ *  so decode has independent dependency chains to overlap.
+ * May leave some garbage bits at the end of the output.
+ */
+template<typename vT, typename bsT>
+class LogRANS : public Coder<vT, bsT> {
+private:
+	static uint32_t bucket(vT v) {
+		return elias_nbits(ZIGZAG_ENC(static_cast<int64_t>(v)));
+	}
+
+public:
+	LogRANS() {};
+	~LogRANS() {};
+
+	unsigned char* enc(
+			unsigned char *out,
+			uint64_t *outsize,
+			vT *in,
+			uint64_t insize) const {
+		uint64_t counts[RANS_NSYMS];
+		memset(counts, 0, sizeof(counts));
+		for (uint64_t i = 0; i < insize; ++i) {
+			++counts[bucket(in[i])];
+		}
+		uint32_t freqs[RANS_NSYMS];
+		uint32_t cums[RANS_NSYMS];
+		rans_normalize(counts, insize, freqs);
+		uint32_t cum = 0;
+		for (int s = 0; s < RANS_NSYMS; ++s) {
+			cums[s] = cum;
+			cum += freqs[s];
+		}
+
+		//rANS is last-in first-out, so encode backwards into scratch;
+		// each symbol emits at most two bytes
+		uint64_t scratchsize = 2*insize + 4*RANS_NSTATES;
+		unsigned char *scratch = static_cast<unsigned char*>(malloc(scratchsize));
+		unsigned char *end = scratch + scratchsize;
+		unsigned char *ptr = end;
+		uint32_t x[RANS_NSTATES];
+		for (int j = 0; j < RANS_NSTATES; ++j) {
+			x[j] = RANS_L;
+		}
+		for (uint64_t i = insize; i-- > 0; ) {
+			uint32_t s = bucket(in[i]);
+			uint32_t &xs = x[i % RANS_NSTATES];
+			uint32_t xmax = ((RANS_L >> RANS_SCALE_BITS) << 8) * freqs[s];
+			while (xs >= xmax) {
+				*--ptr = static_cast<unsigned char>(xs);
+				xs >>= 8;
+			}
+			xs = ((xs / freqs[s]) << RANS_SCALE_BITS) + (xs % freqs[s]) + cums[s];
+		}
+		//flush states big-endian, state 0 first
+		for (int j = RANS_NSTATES - 1; j >= 0; --j) {
+			for (int b = 0; b < 4; ++b) {
+				*--ptr = static_cast<unsigned char>(x[j] >> (8*b));
+			}
+		}
+		uint64_t ranslen = end - ptr;
+
+		//make sure everything fits without the bitstream reallocating
+		// from the middle of our buffer
+		uint64_t need = 2 + 3*RANS_NSYMS + 10 + ranslen + insize*sizeof(vT) + 2*sizeof(bsT) + 8;
+		if (*outsize < need) {
+			out = static_cast<unsigned char*>(realloc(out, need));
+			memset(out + *outsize, 0, need - *outsize);
+			*outsize = need;
+		}
+
+		uint64_t pos = 0;
+		int minsym = RANS_NSYMS;
+		int maxsym = -1;
+		for (int s = 0; s < RANS_NSYMS; ++s) {
+			if (freqs[s] > 0) {
+				minsym = min(minsym, s);
+				maxsym = max(maxsym, s);
+			}
+		}
+		out[pos++] = static_cast<unsigned char>(minsym);
+		out[pos++] = static_cast<unsigned char>(maxsym + 1);
+		for (int s = minsym; s <= maxsym; ++s) {
+			rans_put_varint(out, &pos, freqs[s]);
+		}
+		rans_put_varint(out, &pos, ranslen);
+		memcpy(out + pos, ptr, ranslen);
+		pos += ranslen;
+		free(scratch);
+
+		BitStream<unsigned char, bsT> bs(out + pos, *outsize - pos, WRITE);
+		for (uint64_t i = 0; i < insize; ++i) {
+			uint64_t u = ZIGZAG_ENC(static_cast<int64_t>(in[i]));
+			uint32_t nb = elias_nbits(u);
+			//only the bits below the top one, as in EliasGamma
+			bs.write_bits(u + 1, nb-1);
+		}
+		*outsize = pos + bs.written_size();
+		return out;
+	}
+
+	vT* dec(vT *out,
+			uint64_t *outsize,
+			unsigned char *in,
+			uint64_t insize) const {
+		uint64_t pos = 0;
+		int minsym = in[pos++];
+		int maxsym = static_cast<int>(in[pos++]) - 1;
+		uint32_t freqs[RANS_NSYMS];
+		uint32_t cums[RANS_NSYMS];
+		memset(freqs, 0, sizeof(freqs));
+		for (int s = minsym; s <= maxsym && s < RANS_NSYMS; ++s) {
+			freqs[s] = rans_get_varint(in, &pos);
+		}
+		unsigned char slot2sym[RANS_M];
+		uint32_t cum = 0;
+		for (int s = 0; s < RANS_NSYMS; ++s) {
+			cums[s] = cum;
+			for (uint32_t k = 0; k < freqs[s] && cum + k < RANS_M; ++k) {
+				slot2sym[cum + k] = static_cast<unsigned char>(s);
+			}
+			cum += freqs[s];
+		}
+		uint64_t ranslen = rans_get_varint(in, &pos);
+
+		const unsigned char *ptr = in + pos;
+		uint32_t x[RANS_NSTATES];
+		for (int j = 0; j < RANS_NSTATES; ++j) {
+			x[j] = (static_cast<uint32_t>(ptr[0]) << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+			ptr += 4;
+		}
+
+		BitStream<unsigned char, bsT> bs(in + pos + ranslen, insize - pos - ranslen, READ);
+		uint64_t n = *outsize;
+		uint64_t i = 0;
+		for (; i + RANS_NSTATES <= n; i += RANS_NSTATES) {
+			uint32_t syms[RANS_NSTATES];
+			for (int j = 0; j < RANS_NSTATES; ++j) {
+				uint32_t slot = x[j] & (RANS_M - 1);
+				syms[j] = slot2sym[slot];
+				x[j] = freqs[syms[j]] * (x[j] >> RANS_SCALE_BITS) + slot - cums[syms[j]];
+			}
+			//refill in the order the encoder flushed
+			for (int j = 0; j < RANS_NSTATES; ++j) {
+				while (x[j] < RANS_L) {
+					x[j] = (x[j] << 8) | *ptr++;
+				}
+			}
+			for (int j = 0; j < RANS_NSTATES; ++j) {
+				uint32_t nb = syms[j];
+				uint64_t v = elias_value(bs.read_bits(nb-1), nb-1);
+				out[i + j] = ZIGZAG_DEC(v);
+			}
+		}
+		for (int j = 0; i < n; ++i, ++j) {
+			uint32_t slot = x[j] & (RANS_M - 1);
+			uint32_t nb = slot2sym[slot];
+			x[j] = freqs[nb] * (x[j] >> RANS_SCALE_BITS) + slot - cums[nb];
+			while (x[j] < RANS_L) {
+				x[j] = (x[j] << 8) | *ptr++;
+			}
+			uint64_t v = elias_value(bs.read_bits(nb-1), nb-1);
+			out[i] = ZIGZAG_DEC(v);
+		}
+		return out;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(LogRANS);
+};
+
+void test_rans_normalize() {
+	uint64_t counts[RANS_NSYMS];
+	uint32_t freqs[RANS_NSYMS];
+	memset(counts, 0, sizeof(counts));
+	counts[1] = 1000000;
+	counts[2] = 1;
+	counts[7] = 3;
+	counts[64] = 500;
+	counts[65] = 2;
+	rans_normalize(counts, 1000506, freqs);
+	uint32_t sum = 0;
+	for (int s = 0; s < RANS_NSYMS; ++s) {
+		sum += freqs[s];
+		assert( (counts[s] > 0) == (freqs[s] > 0) );
+	}
+	assert( sum == RANS_M );
+	assert( freqs[1] > freqs[64] && freqs[64] > freqs[2] );
+
+	uint64_t pos = 0;
+	unsigned char buf[20];
+	rans_put_varint(buf, &pos, 300);
+	rans_put_varint(buf, &pos, 0);
+	rans_put_varint(buf, &pos, 1ull << 40);
+	pos = 0;
+	assert( rans_get_varint(buf, &pos) == 300 );
+	assert( rans_get_varint(buf, &pos) == 0 );
+	assert( rans_get_varint(buf, &pos) == (1ull << 40) );
+}
+
+void test_rans_basic() {
+	LogRANS<int8_t, uint8_t> coder8;
+	LogRANS<int32_t, uint32_t> coder32;
+	LogRANS<int64_t, uint64_t> coder64;
+
+	int32_t din[] = {1, 2, 4, 5, 6, -3, 8};
+	test_coder_array(coder32, (int32_t*) din, sizeof(din)/sizeof(int32_t));
+
+	int32_t din2[] = {0, 181817, 363636, 545454, 363636, 363636, 545454, 1, 2, 3, 4, 5};
+	test_coder_array(coder32, (int32_t*) din2, sizeof(din2)/sizeof(int32_t));
+
+	int64_t din3[] = {31014740000, 31000620000, 30985390000, 30968450000, 30950330000};
+	test_coder_array(coder64, (int64_t*) din3, sizeof(din3)/sizeof(int64_t));
+
+	int8_t din4[] = {-128, 127, 0, 0, 0, -1, 1, 5};
+	test_coder_array(coder8, (int8_t*) din4, sizeof(din4)/sizeof(int8_t));
+
+	//a single symbol never moves the states
+	int32_t din5[] = {7, 7, 7, 7, 7, 7, 7, 7, 7};
+	test_coder_array(coder32, (int32_t*) din5, sizeof(din5)/sizeof(int32_t));
+
+	//extremes, whose zigzagged value + 1 overflows
+	const int64_t lo = numeric_limits<int64_t>::min();
+	const int64_t hi = numeric_limits<int64_t>::max();
+	int64_t din6[] = {lo};
+	test_coder_array(coder64, din6, 1);
+	int64_t din7[] = {lo, hi};
+	test_coder_array(coder64, din7, 2);
+	int64_t din8[] = {0, lo, 3, hi, hi, -1, lo, lo, 1};
+	test_coder_array(coder64, din8, sizeof(din8)/sizeof(int64_t));
+}
+
+/**
+ * Skewed buckets cost LogHuffman at least a bit each; rANS does better
+ */
+void test_rans_skewed() {
+	const uint64_t n = 10000;
+	int32_t *din = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	uint64_t seed = 12345;
+	for (uint64_t i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		din[i] = ((seed >> 33) % 20 == 0) ? 1 : 0;
+	}
+
+	LogRANS<int32_t, uint32_t> rans;
+	LogHuffman<int32_t, uint32_t> huff;
+	test_coder_array(rans, din, n);
+
+	uint64_t bufsize = sizeof(int32_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *outbits = static_cast<unsigned char*>(calloc(bufsize, 1));
+	uint64_t ranssize = bufsize;
+	outbits = rans.enc(outbits, &ranssize, din, n);
+	memset(outbits, 0, bufsize);
+	uint64_t huffsize = bufsize;
+	outbits = huff.enc(outbits, &huffsize, din, n);
+	assert( huffsize >= n/8 );
+	assert( ranssize < huffsize/2 );
+
+	free(outbits);
+	free(din);
+}
+
+void test_rans() {
+	test_rans_normalize();
+	test_rans_basic();
+	test_rans_skewed();
+}
+
+#endif /* RANS_HPP_ */
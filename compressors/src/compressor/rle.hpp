@@ -0,0 +1,312 @@
+/*
+ * rle.hpp
+ * @brief log-huffman with explicit run symbols
+ * @author ishafer
+ */
+
+#ifndef RLE_HPP_
+#define RLE_HPP_
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "coder.hpp"
+#include "bitstream.hpp"
+#include "loghuffman.hpp"
+#include "eliaslut.hpp"
+#include "zigzag.hpp"
+#include "../util.hpp"
+
+//value alphabet symbol for "repeat the previous value"; buckets start at 1
+static const int8_t RLE_RUN = 0;
+//shorter repeats are coded as plain values
+static const uint64_t RLE_MIN_RUN = 2;
+//value buckets run to 65, for a zigzagged value of all ones
+static const uint32_t RLE_NSYMS = 66;
+
+/**
+ * @returns number of leading values of in[0..n) equal to v
+ */
+template<typename vT>
+uint64_t count_run_scalar(const vT *in, uint64_t n, vT v) {
+	uint64_t i = 0;
+	while (i < n && in[i] == v) {
+		++i;
+	}
+	return i;
+}
+
+/**
+ * @returns number of leading values of in[0..n) equal to v.
+ * With SSE2, compares 16 bytes at a time against v broadcast to every
+ *  lane and finds the first mismatching byte from the movemask.
+ */
+template<typename vT>
+uint64_t count_run(const vT *in, uint64_t n, vT v) {
+#ifdef __SSE2__
+	const uint64_t lanes = 16 / sizeof(vT);
+	vT pattern[16 / sizeof(vT)];
+	for (uint64_t k = 0; k < lanes; ++k) {
+		pattern[k] = v;
+	}
+	__m128i vv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern));
+	uint64_t i = 0;
+	for (; i + lanes <= n; i += lanes) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+		uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(x, vv));
+		if (eq != 0xFFFF) {
+			return i + __builtin_ctz(~eq) / sizeof(vT);
+		}
+	}
+	return i + count_run_scalar(in + i, n - i, v);
+#else
+	return count_run_scalar(in, n, v);
+#endif
+}
+
+/**
+ * Free a tree from build_tree or bitstream_to_tree
+ */
+void delete_tree(huffnode *node) {
+	if (NULL == node) {
+		return;
+	}
+	delete_tree(node->left);
+	delete_tree(node->right);
+	delete node;
+}
+
+/**
+ * Write nb bits of v, in pieces the bitstream's word type can hold
+ */
+template<typename bsT>
+void write_wide(BitStream<unsigned char, bsT> &bs, uint64_t v, int32_t nb) {
+	const int32_t chunk = 8*sizeof(bsT) - 1;
+	while (nb > chunk) {
+		nb -= chunk;
+		bs.write_bits(static_cast<bsT>(v >> nb), chunk);
+	}
+	bs.write_bits(static_cast<bsT>(v), nb);
+}
+
+template<typename bsT>
+uint64_t read_wide(BitStream<unsigned char, bsT> &bs, int32_t nb) {
+	const int32_t chunk = 8*sizeof(bsT) - 1;
+	uint64_t v = 0;
+	while (nb > chunk) {
+		nb -= chunk;
+		v = (v << chunk) | bs.read_bits(chunk);
+	}
+	return (v << nb) | bs.read_bits(nb);
+}
+
+/**
+ * Log-huffman where repeats of the previous value are coded as a RUN
+ *  symbol in the value alphabet, followed by the run length coded as
+ *  (huffman nbits, mantissa) in a second alphabet of its own.
+ * Layout: has-runs bit, value tree, run tree (if any), then codes.
+ * May leave some garbage bits at the end of the output.
+ */
+template<typename vT, typename bsT>
+class LogHuffmanRuns : public Coder<vT, bsT> {
+public:
+	LogHuffmanRuns() {};
+	~LogHuffmanRuns() {};
+
+	unsigned char* enc(
+			unsigned char *out,
+			uint64_t *outsize,
+			vT *in,
+			uint64_t insize) const {
+		BitStream<unsigned char, bsT> bs(out, *outsize, WRITE);
+		if (0 == insize) {
+			*outsize = 0;
+			return bs.get_backing();
+		}
+
+		huff_hist vhist;
+		huff_hist rhist;
+		vT prev = 0;
+		for (uint64_t i = 0; i < insize; ) {
+			uint64_t run = count_run(in + i, insize - i, prev);
+			if (run >= RLE_MIN_RUN) {
+				++vhist[RLE_RUN];
+				++rhist[nbits(run)];
+				i += run;
+			} else {
+				++vhist[elias_nbits(ZIGZAG_ENC(static_cast<int64_t>(in[i])))];
+				prev = in[i];
+				++i;
+			}
+		}
+
+		huffnode *vtree = build_tree(vhist);
+		huffnode *rtree = rhist.empty() ? NULL : build_tree(rhist);
+		bs.write_bit(NULL != rtree);
+		tree_to_bitstream(bs, vtree, bounds(vhist));
+		vector<lookup_entry> vlut = tree_to_lookup(vtree, RLE_NSYMS);
+		vector<lookup_entry> rlut;
+		if (NULL != rtree) {
+			tree_to_bitstream(bs, rtree, bounds(rhist));
+			rlut = tree_to_lookup(rtree);
+		}
+
+		prev = 0;
+		for (uint64_t i = 0; i < insize; ) {
+			uint64_t run = count_run(in + i, insize - i, prev);
+			if (run >= RLE_MIN_RUN) {
+				uint32_t nb = nbits(run);
+				write_wide(bs, vlut[RLE_RUN].first, vlut[RLE_RUN].second);
+				write_wide(bs, rlut[nb].first, rlut[nb].second);
+				write_wide(bs, run, nb-1);
+				i += run;
+			} else {
+				uint64_t u = ZIGZAG_ENC(static_cast<int64_t>(in[i]));
+				uint32_t nb = elias_nbits(u);
+				write_wide(bs, vlut[nb].first, vlut[nb].second);
+				//only the bits below the top one, as in EliasGamma
+				write_wide(bs, u + 1, nb-1);
+				prev = in[i];
+				++i;
+			}
+		}
+
+		delete_tree(vtree);
+		delete_tree(rtree);
+		*outsize = bs.written_size();
+		return bs.get_backing();
+	}
+
+	vT* dec(vT *out,
+			uint64_t *outsize,
+			unsigned char *in,
+			uint64_t insize) const {
+		if (0 == *outsize) {
+			return out;
+		}
+		BitStream<unsigned char, bsT> bs(in, insize, READ);
+		bool hasruns = bs.read_bit();
+		huffnode *vtree = bitstream_to_tree(bs);
+		huffnode *rtree = hasruns ? bitstream_to_tree(bs) : NULL;
+
+		vT prev = 0;
+		for (uint64_t i = 0; i < *outsize; ) {
+			int32_t nb = next_huffcode(bs, vtree);
+			if (RLE_RUN == nb) {
+				int32_t rnb = next_huffcode(bs, rtree);
+				uint64_t run = read_wide(bs, rnb-1) | (static_cast<uint64_t>(1) << (rnb-1));
+				run = min(run, *outsize - i);
+				for (uint64_t k = 0; k < run; ++k) {
+					out[i + k] = prev;
+				}
+				i += run;
+			} else {
+				uint64_t v = elias_value(read_wide(bs, nb-1), nb-1);
+				prev = ZIGZAG_DEC(v);
+				out[i++] = prev;
+			}
+		}
+
+		delete_tree(vtree);
+		delete_tree(rtree);
+		return out;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(LogHuffmanRuns);
+};
+
+template<typename vT>
+void test_count_run_width() {
+	const uint64_t n = 100;
+	vT buf[n];
+	for (uint64_t start = 0; start < 40; start += 3) {
+		for (uint64_t len = 0; len + start < n; len += 7) {
+			for (uint64_t i = 0; i < n; ++i) {
+				buf[i] = (i >= start && i < start + len) ? 5 : -1;
+			}
+			//a near miss in one byte must still break the run
+			if (start + len < n) {
+				buf[start + len] = static_cast<vT>(5 | (static_cast<vT>(1) << (8*sizeof(vT) - 2)));
+			}
+			assert( count_run(buf + start, n - start, static_cast<vT>(5)) == len );
+			assert( count_run_scalar(buf + start, n - start, static_cast<vT>(5)) == len );
+		}
+	}
+	assert( count_run(buf, 0, static_cast<vT>(-1)) == 0 );
+}
+
+void test_count_run() {
+	test_count_run_width<int8_t>();
+	test_count_run_width<int16_t>();
+	test_count_run_width<int32_t>();
+	test_count_run_width<int64_t>();
+}
+
+void test_rle_basic() {
+	LogHuffmanRuns<int8_t, uint8_t> coder8;
+	LogHuffmanRuns<int32_t, uint32_t> coder32;
+	LogHuffmanRuns<int64_t, uint64_t> coder64;
+
+	int32_t din[] = {1, 2, 4, 5, 6, -3, 8};
+	test_coder_array(coder32, (int32_t*) din, sizeof(din)/sizeof(int32_t));
+
+	int32_t din2[] = {0, 181817, 363636, 545454, 363636, 363636, 545454, 1, 2, 3, 4, 5};
+	test_coder_array(coder32, (int32_t*) din2, sizeof(din2)/sizeof(int32_t));
+
+	int64_t din3[] = {31014740000, 31000620000, 30985390000, 30968450000, 30950330000};
+	test_coder_array(coder64, (int64_t*) din3, sizeof(din3)/sizeof(int64_t));
+
+	//leading run of zeros, runs of every length, and a run to the end
+	int32_t din4[] = {0, 0, 0, 1, 1, 1, 1, 1, 1, 6, 6, 4, 4, 4, 4, 4, 4, 9, 3, 3, 3};
+	test_coder_array(coder32, (int32_t*) din4, sizeof(din4)/sizeof(int32_t));
+
+	int32_t din5[] = {7, 7, 7, 7, 7, 7, 7, 7};
+	test_coder_array(coder32, (int32_t*) din5, sizeof(din5)/sizeof(int32_t));
+
+	//runs longer than the value width
+	const uint64_t n = 5000;
+	int8_t *din6 = static_cast<int8_t*>(malloc(n));
+	for (uint64_t i = 0; i < n; ++i) {
+		din6[i] = (i < 1000) ? -128 : ((i < 4000) ? 127 : static_cast<int8_t>(i));
+	}
+	test_coder_array(coder8, din6, n);
+	free(din6);
+
+	//extremes, whose zigzagged value + 1 overflows
+	const int64_t lo = numeric_limits<int64_t>::min();
+	const int64_t hi = numeric_limits<int64_t>::max();
+	int64_t din7[] = {lo};
+	test_coder_array(coder64, din7, 1);
+	int64_t din8[] = {lo, lo, lo, 0, hi, lo, hi, hi, 1};
+	test_coder_array(coder64, din8, sizeof(din8)/sizeof(int64_t));
+}
+
+/**
+ * Flat segments should cost next to nothing
+ */
+void test_rle_flat() {
+	const uint64_t n = 20000;
+	int32_t *din = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	for (uint64_t i = 0; i < n; ++i) {
+		din[i] = (i % 1000 < 990) ? 0 : static_cast<int32_t>(i % 7) - 3;
+	}
+	LogHuffmanRuns<int32_t, uint32_t> coder;
+	test_coder_array(coder, din, n);
+
+	uint64_t outsize = sizeof(int32_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *outbits = static_cast<unsigned char*>(calloc(outsize, 1));
+	outbits = coder.enc(outbits, &outsize, din, n);
+	assert( outsize < n/50 );
+	free(outbits);
+	free(din);
+}
+
+void test_rle() {
+	test_count_run();
+	test_rle_basic();
+	test_rle_flat();
+}
+
+#endif /* RLE_HPP_ */
@@ -0,0 +1,369 @@
+/*
+ * shuffle.hpp
+ * @brief byte and bit transposes ahead of byte-oriented compressors
+ * @author ishafer
+ */
+
+#ifndef SHUFFLE_HPP_
+#define SHUFFLE_HPP_
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include "coder.hpp"
+#include "zlib.hpp"
+#include "../util.hpp"
+
+/**
+ * Scalar byte transpose: byte k of value i goes to out[k*n + i]
+ */
+inline void byte_shuffle_scalar(unsigned char *out, const unsigned char *in,
+		uint64_t n, uint32_t width, uint64_t from = 0) {
+	for (uint64_t i = from; i < n; ++i) {
+		for (uint32_t k = 0; k < width; ++k) {
+			out[k*n + i] = in[i*width + k];
+		}
+	}
+}
+
+inline void byte_unshuffle_scalar(unsigned char *out, const unsigned char *in,
+		uint64_t n, uint32_t width, uint64_t from = 0) {
+	for (uint64_t i = from; i < n; ++i) {
+		for (uint32_t k = 0; k < width; ++k) {
+			out[i*width + k] = in[k*n + i];
+		}
+	}
+}
+
+#ifdef __SSE2__
+/**
+ * Interleave the bytes of register k with those of register k + W/2.
+ * Over the 16*W bytes in r, this rotates each byte's address left a bit,
+ *  so 4 rounds move byte k of value i (address i*W + k) to k*16 + i,
+ *  and log2(W) more bring it back.
+ */
+template<int W>
+inline void shuffle_round(__m128i *r) {
+	__m128i t[W];
+	for (int k = 0; k < W/2; ++k) {
+		t[2*k] = _mm_unpacklo_epi8(r[k], r[k + W/2]);
+		t[2*k + 1] = _mm_unpackhi_epi8(r[k], r[k + W/2]);
+	}
+	for (int k = 0; k < W; ++k) {
+		r[k] = t[k];
+	}
+}
+
+template<int W>
+void byte_shuffle_sse2(unsigned char *out, const unsigned char *in, uint64_t n) {
+	uint64_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i r[W];
+		for (int k = 0; k < W; ++k) {
+			r[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i*W + 16*k));
+		}
+		for (int round = 0; round < 4; ++round) {
+			shuffle_round<W>(r);
+		}
+		for (int k = 0; k < W; ++k) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + k*n + i), r[k]);
+		}
+	}
+	byte_shuffle_scalar(out, in, n, W, i);
+}
+
+template<int W>
+void byte_unshuffle_sse2(unsigned char *out, const unsigned char *in, uint64_t n) {
+	const int rounds = (2 == W) ? 1 : ((4 == W) ? 2 : 3);
+	uint64_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i r[W];
+		for (int k = 0; k < W; ++k) {
+			r[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + k*n + i));
+		}
+		for (int round = 0; round < rounds; ++round) {
+			shuffle_round<W>(r);
+		}
+		for (int k = 0; k < W; ++k) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i*W + 16*k), r[k]);
+		}
+	}
+	byte_unshuffle_scalar(out, in, n, W, i);
+}
+#endif
+
+/**
+ * Group the bytes of n width-byte values by significance:
+ *  all the first bytes, then all the second bytes, ...
+ */
+void byte_shuffle(unsigned char *out, const unsigned char *in, uint64_t n, uint32_t width) {
+#ifdef __SSE2__
+	switch (width) {
+	case 2: byte_shuffle_sse2<2>(out, in, n); return;
+	case 4: byte_shuffle_sse2<4>(out, in, n); return;
+	case 8: byte_shuffle_sse2<8>(out, in, n); return;
+	}
+#endif
+	byte_shuffle_scalar(out, in, n, width);
+}
+
+void byte_unshuffle(unsigned char *out, const unsigned char *in, uint64_t n, uint32_t width) {
+#ifdef __SSE2__
+	switch (width) {
+	case 2: byte_unshuffle_sse2<2>(out, in, n); return;
+	case 4: byte_unshuffle_sse2<4>(out, in, n); return;
+	case 8: byte_unshuffle_sse2<8>(out, in, n); return;
+	}
+#endif
+	byte_unshuffle_scalar(out, in, n, width);
+}
+
+/**
+ * Transpose an 8x8 bit matrix: bit 8r+c moves to 8c+r
+ */
+inline uint64_t transpose8x8(uint64_t x) {
+	uint64_t t;
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+/**
+ * Split n bytes into 8 planes of n/8 bytes: bit t of byte q of plane p
+ *  is bit p of in[8q + t]. Bytes past the last multiple of 8 are copied.
+ */
+void bit_shuffle_plane(unsigned char *out, const unsigned char *in, uint64_t n) {
+	const uint64_t m = n / 8;
+	uint64_t q = 0;
+#ifdef __SSE2__
+	//the top bit of each of 16 bytes at once, then the next bit down, ...
+	for (; q + 2 <= m; q += 2) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 8*q));
+		for (int p = 7; p >= 0; --p) {
+			uint32_t bits = _mm_movemask_epi8(x);
+			out[p*m + q] = static_cast<unsigned char>(bits);
+			out[p*m + q + 1] = static_cast<unsigned char>(bits >> 8);
+			x = _mm_add_epi8(x, x);
+		}
+	}
+#endif
+	for (; q < m; ++q) {
+		uint64_t x;
+		memcpy(&x, in + 8*q, sizeof(x));
+		x = transpose8x8(x);
+		for (int p = 0; p < 8; ++p) {
+			out[p*m + q] = static_cast<unsigned char>(x >> (8*p));
+		}
+	}
+	memcpy(out + 8*m, in + 8*m, n - 8*m);
+}
+
+void bit_unshuffle_plane(unsigned char *out, const unsigned char *in, uint64_t n) {
+	const uint64_t m = n / 8;
+	for (uint64_t q = 0; q < m; ++q) {
+		uint64_t x = 0;
+		for (int p = 0; p < 8; ++p) {
+			x |= static_cast<uint64_t>(in[p*m + q]) << (8*p);
+		}
+		x = transpose8x8(x);
+		memcpy(out + 8*q, &x, sizeof(x));
+	}
+	memcpy(out + 8*m, in + 8*m, n - 8*m);
+}
+
+/**
+ * Shuffle transform in front of any other coder, meant for byte-oriented
+ *  ones such as ZLib: the value bytes are grouped by significance, so that
+ *  the mostly-constant high bytes form long runs. With bits, each byte
+ *  plane is further split into bit planes.
+ * Nothing but the inner coder's output is stored.
+ * Owns (and deletes) the inner coder.
+ */
+template<typename vT, typename bsT>
+class ShuffleCoder : public Coder<vT, bsT> {
+public:
+	/**
+	 * @param _bits transpose bits, not just bytes
+	 */
+	ShuffleCoder(const Coder<vT, bsT> *_inner, bool _bits = false) :
+		inner(_inner),
+		bits(_bits)
+	{
+	}
+
+	~ShuffleCoder() {
+		delete inner;
+	}
+
+	unsigned char* enc(
+			unsigned char *out,
+			uint64_t *outsize,
+			vT *in,
+			uint64_t insize) const {
+		const uint64_t nbytes = insize*sizeof(vT);
+		unsigned char *shuf = static_cast<unsigned char*>(malloc(nbytes));
+		byte_shuffle(shuf, reinterpret_cast<const unsigned char*>(in), insize, sizeof(vT));
+		if (bits) {
+			unsigned char *planes = static_cast<unsigned char*>(malloc(nbytes));
+			for (uint32_t k = 0; k < sizeof(vT); ++k) {
+				bit_shuffle_plane(planes + k*insize, shuf + k*insize, insize);
+			}
+			free(shuf);
+			shuf = planes;
+		}
+		out = inner->enc(out, outsize, reinterpret_cast<vT*>(shuf), insize);
+		free(shuf);
+		return out;
+	}
+
+	vT* dec(vT *out,
+			uint64_t *outsize,
+			unsigned char *in,
+			uint64_t insize) const {
+		vT *res = inner->dec(out, outsize, in, insize);
+		const uint64_t n = *outsize;
+		unsigned char *vals = reinterpret_cast<unsigned char*>(res);
+		unsigned char *tmp = static_cast<unsigned char*>(malloc(n*sizeof(vT)));
+		if (bits) {
+			for (uint32_t k = 0; k < sizeof(vT); ++k) {
+				bit_unshuffle_plane(tmp + k*n, vals + k*n, n);
+			}
+			memcpy(vals, tmp, n*sizeof(vT));
+		}
+		byte_unshuffle(tmp, vals, n, sizeof(vT));
+		memcpy(vals, tmp, n*sizeof(vT));
+		free(tmp);
+		return res;
+	}
+
+private:
+	const Coder<vT, bsT> *inner;
+	bool bits;
+
+	DISALLOW_EVIL_CONSTRUCTORS(ShuffleCoder);
+};
+
+/**
+ * The SIMD paths must match the scalar ones, at every width and length
+ */
+void test_byte_shuffle() {
+	const uint64_t maxn = 100;
+	unsigned char in[8*maxn];
+	for (uint64_t i = 0; i < sizeof(in); ++i) {
+		in[i] = static_cast<unsigned char>(i * 131 + (i >> 3));
+	}
+	unsigned char fast[8*maxn];
+	unsigned char slow[8*maxn];
+	unsigned char back[8*maxn];
+	uint32_t widths[] = {1, 2, 4, 8};
+	for (int w = 0; w < 4; ++w) {
+		for (uint64_t n = 0; n <= maxn; n += 7) {
+			uint32_t width = widths[w];
+			byte_shuffle(fast, in, n, width);
+			byte_shuffle_scalar(slow, in, n, width);
+			assert( 0 == memcmp(fast, slow, n*width) );
+			byte_unshuffle(back, fast, n, width);
+			assert( 0 == memcmp(back, in, n*width) );
+		}
+	}
+	//byte 1 of value 2 of 16-bit values
+	uint16_t v16[20];
+	for (uint16_t i = 0; i < 20; ++i) {
+		v16[i] = static_cast<uint16_t>(0x100*i + 7);
+	}
+	byte_shuffle(fast, reinterpret_cast<unsigned char*>(v16), 20, 2);
+	assert( 7 == fast[0] && 7 == fast[19] );
+	assert( 2 == fast[20 + 2] );
+}
+
+void test_bit_shuffle() {
+	uint64_t x = 0x0123456789ABCDEFull;
+	assert( transpose8x8(transpose8x8(x)) == x );
+	uint64_t y = transpose8x8(x);
+	for (int r = 0; r < 8; ++r) {
+		for (int c = 0; c < 8; ++c) {
+			assert( ((x >> (8*r + c)) & 1) == ((y >> (8*c + r)) & 1) );
+		}
+	}
+
+	const uint64_t maxn = 77;
+	unsigned char in[maxn];
+	for (uint64_t i = 0; i < maxn; ++i) {
+		in[i] = static_cast<unsigned char>(i * 37 + 11);
+	}
+	unsigned char planes[maxn];
+	unsigned char back[maxn];
+	for (uint64_t n = 0; n <= maxn; ++n) {
+		bit_shuffle_plane(planes, in, n);
+		uint64_t m = n / 8;
+		for (uint64_t i = 0; i < 8*m; ++i) {
+			for (int p = 0; p < 8; ++p) {
+				assert( ((in[i] >> p) & 1) == ((planes[p*m + i/8] >> (i%8)) & 1) );
+			}
+		}
+		bit_unshuffle_plane(back, planes, n);
+		assert( 0 == memcmp(back, in, n) );
+	}
+}
+
+void test_shuffle_coder() {
+	ShuffleCoder<int8_t, uint8_t> zl8(new ZLib<int8_t, uint8_t>, true);
+	ShuffleCoder<int32_t, uint32_t> zl32(new ZLib<int32_t, uint32_t>);
+	ShuffleCoder<int32_t, uint32_t> bzl32(new ZLib<int32_t, uint32_t>, true);
+	ShuffleCoder<int64_t, uint64_t> zl64(new ZLib<int64_t, uint64_t>);
+	ShuffleCoder<int64_t, uint64_t> bzl64(new ZLib<int64_t, uint64_t>, true);
+
+	int32_t din[] = {1, 2, 4, 5, 6, -3, 8};
+	test_coder_array(zl32, (int32_t*) din, sizeof(din)/sizeof(int32_t));
+	test_coder_array(bzl32, (int32_t*) din, sizeof(din)/sizeof(int32_t));
+
+	int64_t din3[] = {31014740000, 31000620000, 30985390000, 30968450000, 30950330000};
+	test_coder_array(zl64, (int64_t*) din3, sizeof(din3)/sizeof(int64_t));
+	test_coder_array(bzl64, (int64_t*) din3, sizeof(din3)/sizeof(int64_t));
+
+	int8_t din4[] = {-128, 127, 0, 0, 0, -1, 1, 5, 9, 10, 11, 12, 13, 14, 15, 16, 17};
+	test_coder_array(zl8, (int8_t*) din4, sizeof(din4)/sizeof(int8_t));
+
+	//a slow walk in 64-bit values: most bytes are constant
+	const uint64_t n = 50000;
+	int64_t *walk = static_cast<int64_t*>(malloc(n*sizeof(int64_t)));
+	uint64_t seed = 1;
+	int64_t cur = 30000000000ll;
+	for (uint64_t i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		cur += static_cast<int64_t>(seed >> 54) - 512;
+		walk[i] = cur;
+	}
+	test_coder_array(zl64, walk, n);
+	test_coder_array(bzl64, walk, n);
+
+	ZLib<int64_t, uint64_t> plain;
+	uint64_t psize = sizeof(int64_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *pbits = static_cast<unsigned char*>(calloc(psize, 1));
+	pbits = plain.enc(pbits, &psize, walk, n);
+	uint64_t ssize = sizeof(int64_t)*(n*BUF_SCALE_FACTOR+12);
+	unsigned char *sbits = static_cast<unsigned char*>(calloc(ssize, 1));
+	sbits = zl64.enc(sbits, &ssize, walk, n);
+	assert( ssize < psize );
+
+	free(sbits);
+	free(pbits);
+	free(walk);
+}
+
+void test_shuffle() {
+	test_byte_shuffle();
+	test_bit_shuffle();
+	test_shuffle_coder();
+}
+
+#endif /* SHUFFLE_HPP_ */
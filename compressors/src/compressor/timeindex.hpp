@@ -0,0 +1,209 @@
+/*
+ * timeindex.hpp
+ * @brief timestamps and values coded in matching blocks, with a sparse
+ *  time index for range queries
+ * @author ishafer
+ */
+
+#ifndef TIMEINDEX_HPP_
+#define TIMEINDEX_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "coder.hpp"
+#include "block.hpp"
+#include "expgolomb.hpp"
+#include "predict.hpp"
+#include "../util.hpp"
+
+using namespace std;
+
+//values per block of a timed series; short ranges decode about this many
+static const uint32_t TIME_BLOCK_VALUES = 4096;
+
+/**
+ * A series of nondecreasing timestamps and their values, each coded as a blocked
+ *  stream with the same block boundaries. The first timestamp of each
+ *  block is kept as a sparse index, so a time range maps to the few
+ *  blocks that can hold it, and only those are decoded.
+ * Timestamps are predicted (usually a steady step) and exp-Golomb coded.
+ */
+template<typename vT, typename bsT>
+class TimedSeries {
+public:
+	/**
+	 * @param vinner coder for each block of values; owned
+	 */
+	TimedSeries(const Coder<vT, bsT> *vinner, uint32_t _block_values = TIME_BLOCK_VALUES,
+			uint32_t nthreads = 1) :
+		tcoder(new PredictCoder<int64_t, uint64_t>(new ExpGolomb<int64_t, uint64_t>),
+				nthreads, _block_values),
+		vcoder(vinner, nthreads, _block_values),
+		block_values(_block_values),
+		tbits(NULL),
+		tsize(0),
+		vbits(NULL),
+		vsize(0)
+	{
+	}
+
+	~TimedSeries() {
+		free(tbits);
+		free(vbits);
+	}
+
+	/**
+	 * Encode n nondecreasing timestamps and their values, replacing any earlier series
+	 */
+	void enc(const int64_t *ts, const vT *vals, uint64_t n) {
+		free(tbits);
+		free(vbits);
+		tsize = sizeof(int64_t)*(n*BUF_SCALE_FACTOR+12);
+		tbits = static_cast<unsigned char*>(calloc(tsize, 1));
+		tbits = tcoder.enc(tbits, &tsize, const_cast<int64_t*>(ts), n);
+		vsize = sizeof(vT)*(n*BUF_SCALE_FACTOR+12);
+		vbits = static_cast<unsigned char*>(calloc(vsize, 1));
+		vbits = vcoder.enc(vbits, &vsize, const_cast<vT*>(vals), n);
+
+		first_ts.clear();
+		for (uint64_t i = 0; i < n; i += block_values) {
+			first_ts.push_back(ts[i]);
+		}
+	}
+
+	/**
+	 * @returns bytes of both coded streams
+	 */
+	uint64_t encoded_bytes() const {
+		return tsize + vsize;
+	}
+
+	/**
+	 * @returns (timestamp, value) pairs with t0 <= timestamp <= t1
+	 * @param ndecoded if not NULL, set to the number of blocks decoded
+	 */
+	vector<pair<int64_t, vT> > range(int64_t t0, int64_t t1, uint32_t *ndecoded = NULL) const {
+		vector<pair<int64_t, vT> > res;
+		uint32_t decoded = 0;
+		if (!first_ts.empty() && t0 <= t1) {
+			//t0 can fall inside the last block starting before it, or, with
+			// repeated timestamps, at the end of the one before a block starting at t0
+			vector<int64_t>::const_iterator first =
+					lower_bound(first_ts.begin(), first_ts.end(), t0);
+			uint32_t b0 = (first == first_ts.begin()) ? 0 : (first - first_ts.begin() - 1);
+			uint32_t b1 = upper_bound(first_ts.begin(), first_ts.end(), t1) - first_ts.begin();
+			int64_t *tblock = static_cast<int64_t*>(malloc(sizeof(int64_t)*block_values));
+			vT *vblock = static_cast<vT*>(malloc(sizeof(vT)*block_values));
+			for (uint32_t bdx = b0; bdx < b1; ++bdx) {
+				uint64_t len = tcoder.decode_one(tbits, tsize, bdx, tblock);
+				vcoder.decode_one(vbits, vsize, bdx, vblock);
+				++decoded;
+				for (uint64_t i = 0; i < len && tblock[i] <= t1; ++i) {
+					if (tblock[i] >= t0) {
+						res.push_back(make_pair(tblock[i], vblock[i]));
+					}
+				}
+			}
+			free(vblock);
+			free(tblock);
+		}
+		if (NULL != ndecoded) {
+			*ndecoded = decoded;
+		}
+		return res;
+	}
+
+private:
+	BlockCoder<int64_t, uint64_t> tcoder;
+	BlockCoder<vT, bsT> vcoder;
+	uint32_t block_values;
+	//first timestamp of each block
+	vector<int64_t> first_ts;
+	unsigned char *tbits;
+	uint64_t tsize;
+	unsigned char *vbits;
+	uint64_t vsize;
+
+	DISALLOW_EVIL_CONSTRUCTORS(TimedSeries);
+};
+
+/**
+ * Ranges must match a scan, and decode only the blocks they touch
+ */
+template<typename vT, typename bsT>
+void test_timed_range(const TimedSeries<vT, bsT> &series, const int64_t *ts, const vT *vals,
+		uint64_t n, int64_t t0, int64_t t1, uint32_t block_values) {
+	uint32_t ndecoded = 0;
+	vector<pair<int64_t, vT> > got = series.range(t0, t1, &ndecoded);
+	vector<pair<int64_t, vT> > exp;
+	for (uint64_t i = 0; i < n; ++i) {
+		if (t0 <= ts[i] && ts[i] <= t1) {
+			exp.push_back(make_pair(ts[i], vals[i]));
+		}
+	}
+	assert( got == exp );
+	assert( ndecoded <= exp.size() / block_values + 2 );
+}
+
+template<typename vT, typename bsT>
+void test_timed_series_stream(const int64_t *ts, const vT *vals, uint64_t n) {
+	const uint32_t bv = 1000;
+	TimedSeries<vT, bsT> series(new ExpGolomb<vT, bsT>, bv);
+	series.enc(ts, vals, n);
+	assert( series.encoded_bytes() > 0 );
+
+	test_timed_range(series, ts, vals, n, ts[0], ts[n - 1], bv);
+	test_timed_range(series, ts, vals, n, ts[0] - 100, ts[0] - 1, bv);
+	test_timed_range(series, ts, vals, n, ts[n - 1] + 1, ts[n - 1] + 100, bv);
+	test_timed_range(series, ts, vals, n, ts[n / 2], ts[n / 2], bv);
+	test_timed_range(series, ts, vals, n, ts[n / 2] + 1, ts[n / 2], bv);
+	uint64_t seed = 5;
+	for (int q = 0; q < 20; ++q) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		uint64_t a = (seed >> 20) % n;
+		uint64_t b = min(n - 1, a + (seed >> 44) % 3000);
+		//between samples as well as on them
+		test_timed_range(series, ts, vals, n, ts[a] - (q % 2), ts[b] + (q % 3), bv);
+	}
+}
+
+void test_timed_series() {
+	const uint64_t n = 10007;
+	int64_t *ts = static_cast<int64_t*>(malloc(n*sizeof(int64_t)));
+	int32_t *vals = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	int64_t t = 1000000;
+	for (uint64_t i = 0; i < n; ++i) {
+		//a steady clock with the odd gap
+		t += (i % 997 == 0) ? 5000 : 20;
+		ts[i] = t;
+		vals[i] = static_cast<int32_t>(i * 7 % 1000) - 500;
+	}
+	test_timed_series_stream<int32_t, uint32_t>(ts, vals, n);
+
+	//repeated timestamps straddling each block boundary
+	t = 1000000;
+	for (uint64_t i = 0; i < n; ++i) {
+		t += (i % 1000 < 3 || i % 1000 > 996) ? 0 : 20;
+		ts[i] = t;
+	}
+	TimedSeries<int32_t, uint32_t> dups(new ExpGolomb<int32_t, uint32_t>, 1000);
+	dups.enc(ts, vals, n);
+	for (uint64_t b = 1000; b < n; b += 1000) {
+		test_timed_range(dups, ts, vals, n, ts[b], ts[b], 1000);
+		test_timed_range(dups, ts, vals, n, ts[b], ts[b] + 100, 1000);
+	}
+	test_timed_series_stream<int32_t, uint32_t>(ts, vals, n);
+
+	TimedSeries<int32_t, uint32_t> empty(new ExpGolomb<int32_t, uint32_t>);
+	assert( empty.range(0, 100).empty() );
+
+	free(vals);
+	free(ts);
+}
+
+#endif /* TIMEINDEX_HPP_ */
@@ -12,23 +12,155 @@
 #include "zigzag.hpp"
 #include "../util.hpp"
 
+#include <pthread.h>
 #include <iostream>
 #include <cstring>
 #include <cassert>
+#include <limits>
 
 using namespace std;
 
 #include "../../inc/zlib.h"
 #define byte Bytef
 
+//bytes fed to and taken from zlib per call in streaming mode
+static const uInt ZLIB_CHUNK = 1 << 16;
+//zlib's defaults, as compress() uses
+static const int ZLIB_WINDOW_BITS = 15;
+static const int ZLIB_MEM_LEVEL = 8;
+
 /**
- * Elias-gamma encoding with zig-zag first.
- * May leave some garbage bits at the end of the output.
+ * Deflate and inflate state kept for each thread and reset between calls;
+ *  setting it up allocates a few hundred K, which costs more than coding
+ *  a small block
+ */
+struct zlib_contexts {
+	z_stream def;
+	bool def_ok;
+	int level;
+	int strategy;
+
+	z_stream inf;
+	bool inf_ok;
+
+	zlib_contexts() :
+		def_ok(false),
+		level(Z_DEFAULT_COMPRESSION),
+		strategy(Z_DEFAULT_STRATEGY),
+		inf_ok(false)
+	{
+		memset(&def, 0, sizeof(def));
+		memset(&inf, 0, sizeof(inf));
+	}
+
+	~zlib_contexts() {
+		if (def_ok) {
+			deflateEnd(&def);
+		}
+		if (inf_ok) {
+			inflateEnd(&inf);
+		}
+	}
+};
+
+static pthread_key_t zlib_key;
+static pthread_once_t zlib_key_once = PTHREAD_ONCE_INIT;
+
+void zlib_free_contexts(void *ctx) {
+	delete static_cast<zlib_contexts*>(ctx);
+}
+
+void zlib_make_key() {
+	pthread_key_create(&zlib_key, zlib_free_contexts);
+}
+
+/**
+ * @returns this thread's contexts; freed when the thread exits
+ */
+zlib_contexts* zlib_thread_contexts() {
+	pthread_once(&zlib_key_once, zlib_make_key);
+	zlib_contexts *ctx = static_cast<zlib_contexts*>(pthread_getspecific(zlib_key));
+	if (NULL == ctx) {
+		ctx = new zlib_contexts();
+		pthread_setspecific(zlib_key, ctx);
+	}
+	return ctx;
+}
+
+/**
+ * @returns this thread's deflate stream, reset and set to level and strategy;
+ *  NULL if it couldn't be set up
+ */
+z_stream* zlib_deflater(int level, int strategy) {
+	zlib_contexts *ctx = zlib_thread_contexts();
+	int rc;
+	if (!ctx->def_ok) {
+		rc = deflateInit2(&ctx->def, level, Z_DEFLATED,
+				ZLIB_WINDOW_BITS, ZLIB_MEM_LEVEL, strategy);
+		ctx->def_ok = (Z_OK == rc);
+	} else {
+		rc = deflateReset(&ctx->def);
+		if (Z_OK == rc && (level != ctx->level || strategy != ctx->strategy)) {
+			rc = deflateParams(&ctx->def, level, strategy);
+		}
+	}
+	if (Z_OK != rc) {
+		cout << "ERROR: ZLib deflate setup fail; retcode=" << rc << endl;
+		return NULL;
+	}
+	ctx->level = level;
+	ctx->strategy = strategy;
+	//resetting leaves the last call's buffers
+	ctx->def.next_in = NULL;
+	ctx->def.avail_in = 0;
+	return &ctx->def;
+}
+
+/**
+ * @returns this thread's inflate stream, reset; NULL if it couldn't be set up
+ */
+z_stream* zlib_inflater() {
+	zlib_contexts *ctx = zlib_thread_contexts();
+	int rc;
+	if (!ctx->inf_ok) {
+		rc = inflateInit(&ctx->inf);
+		ctx->inf_ok = (Z_OK == rc);
+	} else {
+		rc = inflateReset(&ctx->inf);
+	}
+	if (Z_OK != rc) {
+		cout << "ERROR: ZLib inflate setup fail; retcode=" << rc << endl;
+		return NULL;
+	}
+	ctx->inf.next_in = NULL;
+	ctx->inf.avail_in = 0;
+	return &ctx->inf;
+}
+
+/**
+ * Deflate of the raw value bytes, using this thread's reusable streams.
+ * In one-shot mode the whole input goes to a single deflate call, and the
+ *  output is grown up front to deflateBound if it's smaller.
+ * In streaming mode the input is fed ZLIB_CHUNK bytes at a time, and the
+ *  output grows only when it fills.
+ * Either mode's output decodes with either mode.
  */
 template<typename vT, typename bsT>
 class ZLib : public Coder<vT, bsT> {
 public:
-	ZLib() {};
+	/**
+	 * @param _level 0 (store) to 9 (smallest), or Z_DEFAULT_COMPRESSION
+	 * @param _strategy Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE, ...
+	 * @param _streaming feed zlib in chunks, rather than all at once
+	 */
+	ZLib(int _level = Z_DEFAULT_COMPRESSION,
+			int _strategy = Z_DEFAULT_STRATEGY,
+			bool _streaming = false) :
+		level(_level),
+		strategy(_strategy),
+		streaming(_streaming)
+	{
+	}
 	~ZLib() {};
 
 	unsigned char* enc(
@@ -36,17 +168,45 @@ public:
 			uint64_t *outsize,
 			vT *in,
 			uint64_t insize) const {
-		uLongf l_outsize = *outsize;
-		//cout << "enc outsize before=" << *outsize << endl;
-		int rc = compress(out,
-				&l_outsize,
-				reinterpret_cast<byte*>(in),
-				insize*sizeof(vT));
-		*outsize = l_outsize;
-		//cout << "enc outsize after=" << *outsize << endl;
-		if (rc != Z_OK) {
-			cout << "ERROR: ZLib fail; retcode=" << rc << endl;
+		z_stream *zs = zlib_deflater(level, strategy);
+		if (NULL == zs) {
+			*outsize = 0;
+			return out;
+		}
+		uint64_t cap = *outsize;
+		uint64_t inbytes = insize*sizeof(vT);
+		if (!streaming) {
+			uint64_t bound = deflateBound(zs, inbytes);
+			if (bound > cap) {
+				out = grow(out, &cap, bound);
+			}
 		}
+
+		byte *src = reinterpret_cast<byte*>(in);
+		uint64_t inpos = 0;
+		uint64_t outpos = 0;
+		const uint64_t step = streaming ? ZLIB_CHUNK : numeric_limits<uInt>::max();
+		int rc = Z_OK;
+		while (Z_STREAM_END != rc) {
+			if (0 == zs->avail_in && inpos < inbytes) {
+				zs->next_in = src + inpos;
+				zs->avail_in = min(step, inbytes - inpos);
+				inpos += zs->avail_in;
+			}
+			if (outpos == cap) {
+				out = grow(out, &cap, cap + cap/2 + ZLIB_CHUNK);
+			}
+			zs->next_out = out + outpos;
+			zs->avail_out = min(step, cap - outpos);
+			uInt before = zs->avail_out;
+			rc = deflate(zs, (inpos == inbytes) ? Z_FINISH : Z_NO_FLUSH);
+			outpos += before - zs->avail_out;
+			if (Z_OK != rc && Z_STREAM_END != rc && Z_BUF_ERROR != rc) {
+				cout << "ERROR: ZLib fail; retcode=" << rc << endl;
+				break;
+			}
+		}
+		*outsize = outpos;
 		return out;
 	}
 
@@ -54,21 +214,56 @@ public:
 			uint64_t *outsize,
 			unsigned char *in,
 			uint64_t insize) const {
-		uLongf l_outsize = insize*sizeof(vT)*BUF_SCALE_FACTOR+12; //XXX: need to pass this in-band
-		//cout << "dec outsize before=" << *outsize << "," << insize << endl;
-		int rc = uncompress(reinterpret_cast<byte*>(out),
-				&l_outsize,
-				in,
-				insize*sizeof(vT));
-		*outsize = l_outsize;
-		//cout << "dec outsize after=" << *outsize << endl;
-		if (rc != Z_OK) {
-			cout << "ERROR: ZLib fail; retcode=" << rc << endl;
+		z_stream *zs = zlib_inflater();
+		if (NULL == zs) {
+			*outsize = 0;
+			return out;
+		}
+		uint64_t cap = *outsize*sizeof(vT);
+		byte *dst = reinterpret_cast<byte*>(out);
+		uint64_t inpos = 0;
+		uint64_t outpos = 0;
+		const uint64_t step = streaming ? ZLIB_CHUNK : numeric_limits<uInt>::max();
+		int rc = Z_OK;
+		while (Z_STREAM_END != rc) {
+			if (0 == zs->avail_in && inpos < insize) {
+				zs->next_in = in + inpos;
+				zs->avail_in = min(step, insize - inpos);
+				inpos += zs->avail_in;
+			}
+			zs->next_out = dst + outpos;
+			zs->avail_out = min(step, cap - outpos);
+			uInt before = zs->avail_out;
+			rc = inflate(zs, Z_NO_FLUSH);
+			outpos += before - zs->avail_out;
+			if (Z_OK != rc && Z_STREAM_END != rc) {
+				cout << "ERROR: ZLib fail; retcode=" << rc << endl;
+				break;
+			}
+			if (Z_OK == rc && outpos == cap) {
+				//anything left is past what was asked for
+				break;
+			}
 		}
+		*outsize = outpos/sizeof(vT);
 		return out;
 	}
 
 private:
+	int level;
+	int strategy;
+	bool streaming;
+
+	static unsigned char* grow(unsigned char *out, uint64_t *cap, uint64_t newcap) {
+		unsigned char *res = static_cast<unsigned char*>(realloc(out, newcap));
+		if (NULL == res) {
+			cerr << "failed to expand zlib output" << endl;
+			return out;
+		}
+		*cap = newcap;
+		return res;
+	}
+
 	DISALLOW_EVIL_CONSTRUCTORS(ZLib);
 };
 
@@ -114,9 +309,60 @@ void test_zlib_basic() {
 	test_coder_array(coder64, (int64_t*) din3, sizeof(din3)/sizeof(int64_t));
 }
 
+/**
+ * Every level, strategy and mode must roundtrip, and decode each other
+ */
+void test_zlib_options() {
+	const uint64_t n = 100000;
+	int32_t *din = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	uint64_t seed = 9;
+	for (uint64_t i = 0; i < n; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		din[i] = static_cast<int32_t>((seed >> 60) < 3 ? (seed >> 50) : 0);
+	}
+	int levels[] = {Z_DEFAULT_COMPRESSION, 0, 1, 9};
+	int strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE, Z_HUFFMAN_ONLY};
+	for (int l = 0; l < 4; ++l) {
+		for (int s = 0; s < 4; ++s) {
+			for (int streaming = 0; streaming < 2; ++streaming) {
+				ZLib<int32_t, uint32_t> coder(levels[l], strategies[s], streaming);
+				test_coder_array(coder, din, n);
+				ZLib<int32_t, uint32_t> other(levels[l], strategies[s], !streaming);
+				uint64_t outsize = sizeof(int32_t)*(n*BUF_SCALE_FACTOR+12);
+				unsigned char *outbits = static_cast<unsigned char*>(calloc(outsize, 1));
+				outbits = coder.enc(outbits, &outsize, din, n);
+				int32_t *dout = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+				uint64_t nout = n;
+				other.dec(dout, &nout, outbits, outsize);
+				assert( n == nout );
+				assert( 0 == memcmp(din, dout, n*sizeof(int32_t)) );
+				free(dout);
+				free(outbits);
+			}
+		}
+	}
+
+	//output buffers that are too small get grown
+	for (int streaming = 0; streaming < 2; ++streaming) {
+		ZLib<int32_t, uint32_t> coder(0, Z_DEFAULT_STRATEGY, streaming);
+		uint64_t outsize = 16;
+		unsigned char *outbits = static_cast<unsigned char*>(malloc(outsize));
+		outbits = coder.enc(outbits, &outsize, din, n);
+		assert( outsize > n*sizeof(int32_t) );
+		int32_t *dout = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+		uint64_t nout = n;
+		coder.dec(dout, &nout, outbits, outsize);
+		assert( 0 == memcmp(din, dout, n*sizeof(int32_t)) );
+		free(dout);
+		free(outbits);
+	}
+	free(din);
+}
+
 void test_zlib() {
 	test_zlib_unwrapped();
 	test_zlib_basic();
+	test_zlib_options();
 }
 
 #endif /* ZLIB_HPP_ */
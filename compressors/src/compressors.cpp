@@ -6,36 +6,72 @@
 #include <cstring>
 #include <string>
 
+#include "alloctrack.hpp"
+#include "strpool.hpp"
 #include "metastore.hpp"
+#include "resultstore.hpp"
 #include "compressor.hpp"
+#include "bench.hpp"
+#include "segstore.hpp"
+#include "synthetic.hpp"
 
 using namespace std;
 
 void test_all() {
+	test_alloctrack();
+	test_strpool();
 	test_metastore();
+	test_resultstore();
+	test_perfcounters();
 	test_compressor();
+	test_bench();
+	test_segstore();
+	test_synthetic();
 }
 
-void print_result(bool deltaenc, CoderName name, vstream_res &res) {
+void print_result(bool deltaenc, CoderName name, vstream_res &res, uint32_t nthreads,
+		ResultStore *store) {
+	string codec = coder_name(name);
+	int version = coder_version(name);
+	if (NULL != store && store->has(res.p, codec.c_str(), version, deltaenc, nthreads)) {
+		return;
+	}
+
 	cout << res.p.vname << "," <<
 			res.p.tpath << "," <<
 			res.p.vpath << "," <<
 			res.p.vsize << ",";
-	test_roundtrip(deltaenc, name, res.p);
+	roundtrip_result rt = test_roundtrip(deltaenc, name, res.p, nthreads);
+
+	if (NULL != store) {
+		store->add(res.p, codec.c_str(), version, deltaenc, nthreads, rt);
+	}
 }
 
-void run(bool deltaenc, int32_t limit) {
+/**
+ * @param nthreads threads to code each stream with (1 for no blocking)
+ * @param resultsdb if not NULL, store results here and skip
+ *  stream/codec pairs it already has
+ */
+void run(bool deltaenc, int32_t limit, uint32_t nthreads, const char *resultsdb) {
 	MetaStore ms("G:/tmp/combined.db", Config::get("dataloc"));
 	ms.open();
 	ms.start_iter();
 
+	ResultStore *store = NULL;
+	if (NULL != resultsdb) {
+		store = new ResultStore(resultsdb);
+		if (!store->open()) {
+			delete store;
+			store = NULL;
+		}
+	}
+
 	int sdx = 0;
 	for (vstream_res res; (res = ms.next_row()).success; ) {
-		print_result(deltaenc, ELIAS_GAMMA, res);
-		print_result(deltaenc, ELIAS_DELTA, res);
-		print_result(deltaenc, LOG_HUFFMAN, res);
-		print_result(deltaenc, LOG_HUFFMAN_RLE, res);
-		print_result(deltaenc, ZLIB, res);
+		for (unsigned cdx = 0; cdx < N_CODERS; ++cdx) {
+			print_result(deltaenc, ALL_CODERS[cdx], res, nthreads, store);
+		}
 
 		if (++sdx > limit) {
 			cout << "STOPPED" << endl;
@@ -43,11 +79,79 @@ void run(bool deltaenc, int32_t limit) {
 		}
 	}
 
+	delete store;
 	ms.close();
 }
 
+/**
+ * Benchmark every coder on the streams of a meta db
+ * @param metadb streams to run; NULL for the bundled test streams
+ */
+void bench(const char *metadb, const bench_opts &opts, const char *resultsdb) {
+	vector<vstream> streams;
+	if (NULL == metadb) {
+		streams = get_test_streams();
+	} else {
+		MetaStore ms(metadb, NULL);
+		ms.open();
+		streams = ms.load_streams();
+		ms.close();
+	}
+
+	ResultStore *store = NULL;
+	if (NULL != resultsdb) {
+		store = new ResultStore(resultsdb);
+		if (!store->open()) {
+			delete store;
+			store = NULL;
+		}
+	}
+
+	//predictors replace delta encoding, shuffles go on top of it
+	bench_streams(streams, transform_keeps_delta(opts.transform), opts, store);
+
+	delete store;
+}
+
+/**
+ * Code every stream of a meta db into segment files in dir, then check
+ *  that they load back to the raw values
+ * @param metadb streams to store; NULL for the bundled test streams
+ */
+void store(const char *metadb, const char *dir, CoderName coder) {
+	vector<vstream> streams;
+	if (NULL == metadb) {
+		streams = get_test_streams();
+	} else {
+		MetaStore ms(metadb, NULL);
+		ms.open();
+		streams = ms.load_streams();
+		ms.close();
+	}
+
+	SegmentStore segs(dir);
+	for (unsigned sdx = 0; sdx < streams.size(); ++sdx) {
+		const vstream &vs = streams[sdx];
+		bool ok = segs.store(vs, coder);
+		void *raw = ok ? read_fully(vs) : NULL;
+		void *got = ok ? segs.load(vs) : NULL;
+		ok = NULL != raw && NULL != got &&
+				0 == memcmp(raw, got, static_cast<size_t>(vs.npoints) * vs.vsize);
+		cout << vs.vname << "," << vs.vpath << "," << segs.path(vs) << "," <<
+				static_cast<uint64_t>(vs.npoints) * vs.vsize << "," <<
+				segs.stored_bytes(vs) << (ok ? "" : ",FAIL") << endl;
+		free(got);
+		free(raw);
+	}
+}
+
 void usage(char* argv[]) {
 	cout << "Usage: " << argv[0] << " [fn] [args]" << endl;
+	cout << "  test" << endl;
+	cout << "  runall|runsome|runpar [results.db]" << endl;
+	cout << "  bench [meta.db|-] [trials] [cpu|-] [results.db|-] [transform|-] [eps]" << endl;
+	cout << "  synth [shape|all] [width|0] [npoints]" << endl;
+	cout << "  store [meta.db|-] [dir] [coder]" << endl;
 }
 
 int main(int argc, char* argv[]) {
@@ -57,13 +161,68 @@ int main(int argc, char* argv[]) {
 	}
 
 	string fn(argv[1]);
+	const char *resultsdb = (argc > 2) ? argv[2] : NULL;
 
 	if (fn == "test") {
 		test_all();
 	} else if (fn == "runall") {
-		run(true, numeric_limits<int32_t>::max());
+		run(true, numeric_limits<int32_t>::max(), 1, resultsdb);
 	} else if (fn == "runsome") {
-		run(true, 100);
+		run(true, 100, 1, resultsdb);
+	} else if (fn == "runpar") {
+		run(true, numeric_limits<int32_t>::max(), num_cores(), resultsdb);
+	} else if (fn == "bench") {
+		bench_opts opts;
+		const char *metadb = (argc > 2 && string(argv[2]) != "-") ? argv[2] : NULL;
+		if (argc > 3) {
+			opts.trials = atoi(argv[3]);
+		}
+		if (argc > 4 && string(argv[4]) != "-") {
+			opts.cpu = atoi(argv[4]);
+		}
+		if (argc > 6 && string(argv[6]) != "-") {
+			opts.transform = parse_transform(argv[6]);
+			if (N_TRANSFORMS == opts.transform) {
+				cerr << "Unknown transform:" << argv[6] << endl;
+				usage(argv);
+				return 1;
+			}
+		}
+		if (argc > 7) {
+			opts.eps = atof(argv[7]);
+		}
+		bench(metadb, opts, (argc > 5 && string(argv[5]) != "-") ? argv[5] : NULL);
+	} else if (fn == "synth") {
+		SynthShape shape = N_SYNTH_SHAPES;
+		if (argc > 2 && string(argv[2]) != "all") {
+			shape = parse_shape(argv[2]);
+			if (N_SYNTH_SHAPES == shape) {
+				cerr << "Unknown shape:" << argv[2] << endl;
+				usage(argv);
+				return 1;
+			}
+		}
+		int width = (argc > 3) ? atoi(argv[3]) : 0;
+		uint64_t npoints = (argc > 4) ? strtoull(argv[4], NULL, 10) : 65536;
+		synth_curves(shape, width, npoints, true);
+	} else if (fn == "store") {
+		if (argc < 4) {
+			usage(argv);
+			return 1;
+		}
+		CoderName coder = ZLIB;
+		if (argc > 4) {
+			coder = parse_coder(argv[4]);
+			if (N_CODERS == coder) {
+				cerr << "Unknown coder:" << argv[4] << endl;
+				usage(argv);
+				return 1;
+			}
+		}
+		store((string(argv[2]) != "-") ? argv[2] : NULL, argv[3], coder);
+	} else {
+		usage(argv);
+		return 1;
 	}
 
 	cout << "DONE!" << endl;
@@ -18,12 +18,12 @@ private:
 
 	static void init_host_specific_opts(char* hostname) {
 		if (0 == strcmp(hostname, "mrbox")) {
-			opts["dataloc"] = "D:/";
+			opts["dataloc"] = "D:/tmp";
 		} else if (0 == strcmp(hostname, "GS10227")) {
-			opts["dataloc"] = "G:/";
+			opts["dataloc"] = "G:/tmp";
 		} else {
 			cerr << "Unknown host: " << hostname << endl;
-			opts["dataloc"] = "/d/";
+			opts["dataloc"] = "/d/tmp";
 		}
 	}
 	static void init() {
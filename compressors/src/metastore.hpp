@@ -14,9 +14,19 @@
 #include <cstdio>
 #include <cstdlib>
 
+#if !(defined WIN32 || defined __CYGWIN__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include <vector>
+#include <string>
+#include <limits>
 
 #include "config.hpp"
+#include "strpool.hpp"
+#include "util.hpp"
 
 using namespace std;
 
@@ -31,13 +41,18 @@ static int check_exec(sqlite3* db, const char *sql) {
 
 /**
  * A value stream metadata entry
+ * Strings are interned in StringPool::global().
  */
 struct vstream {
-	char *vname;
-	char *tpath;
-	char *vpath;
-	int vmin;
-	int vmax;
+	const char *vname;
+	const char *tpath;
+	const char *vpath;
+	int64_t tmin;
+	int64_t tmax;
+	int tscale;
+	int tsize;
+	int64_t vmin;
+	int64_t vmax;
 	int vscale;
 	int vsize;
 	int npoints;
@@ -47,28 +62,126 @@ struct vstream_res {
 	bool success;
 };
 
+/**
+ * Predicates on streams to load; pushed down into the meta query.
+ * Defaults match every stream.
+ */
+struct stream_filter {
+	//value size in bytes; 0 for any
+	int vsize;
+	//inclusive range on the number of points
+	int64_t min_npoints;
+	int64_t max_npoints;
+	//SQL LIKE pattern on vname; NULL for any
+	const char *vname_like;
+
+	stream_filter() :
+		vsize(0),
+		min_npoints(0),
+		max_npoints(numeric_limits<int64_t>::max()),
+		vname_like(NULL)
+	{
+	}
+};
+
 class MetaStore {
 private:
+	static const char* const SELECT_META;
+
 	const char* fname;
-	const char* prefix_replace;
-	int len_prefix_replace;
+	const char* dataroot;
+	//directory containing the db, with trailing separator
+	string dbdir;
 	sqlite3 *db;
+	//statement for start_iter/next_row
 	sqlite3_stmt *stmt;
+	//cached statement for load_streams, and the query it was prepared for
+	sqlite3_stmt *load_stmt;
+	string load_sql;
+
+	static bool is_sep(char c) {
+		return c == '/' || c == '\\';
+	}
+
+	/**
+	 * Convert a path as stored by convert.py to one on this host.
+	 * Stored paths look like <output root>\<dataset>/{ts,vs}/<name>, where
+	 *  the root and dataset were joined with the converting host's separator.
+	 */
+	const char* resolve_path(const char* stored) {
+		string path(stored);
+		if (NULL == dataroot) {
+			//keep {ts,vs}/<name>, relative to the directory of the db
+			size_t name = path.find_last_of("/\\");
+			size_t dir = (name == string::npos || name == 0) ?
+					string::npos : path.find_last_of("/\\", name - 1);
+			if (dir != string::npos) {
+				path = dbdir + path.substr(dir + 1);
+			} else {
+				path = dbdir + path;
+			}
+		} else {
+			//swap the output root for the local one
+			size_t sep = path.find('\\');
+			if (sep != string::npos) {
+				string root(dataroot);
+				if (!root.empty() && !is_sep(root[root.size() - 1])) {
+					root += '/';
+				}
+				path = root + path.substr(sep + 1);
+			}
+		}
+		for (size_t i = 0; i < path.size(); ++i) {
+			if (path[i] == '\\') {
+				path[i] = '/';
+			}
+		}
+		return StringPool::global().intern(path.c_str());
+	}
+
+	/**
+	 * Read the current row of a statement selecting SELECT_META
+	 */
+	vstream read_row(sqlite3_stmt *st) {
+		StringPool &pool = StringPool::global();
+		vstream p;
+		p.vname = pool.intern(reinterpret_cast<const char*>(sqlite3_column_text(st, 0)));
+		p.tpath = resolve_path(reinterpret_cast<const char*>(sqlite3_column_text(st, 1)));
+		p.vpath = resolve_path(reinterpret_cast<const char*>(sqlite3_column_text(st, 2)));
+		p.tmin = sqlite3_column_int64(st, 3);
+		p.tmax = sqlite3_column_int64(st, 4);
+		p.tscale = sqlite3_column_int(st, 5);
+		p.tsize = sqlite3_column_int(st, 6);
+		p.vmin = sqlite3_column_int64(st, 7);
+		p.vmax = sqlite3_column_int64(st, 8);
+		p.vscale = sqlite3_column_int(st, 9);
+		p.vsize = sqlite3_column_int(st, 10);
+		p.npoints = sqlite3_column_int(st, 11);
+		return p;
+	}
 
 public:
 	/**
 	 * @brief new metadata store
 	 * @param _fname input DB file name
-	 * @param _prefix_replace (a bit of a hack) replace the prefix of all
-	 *  paths with this one
+	 * @param _dataroot local directory holding the converter's output,
+	 *  which replaces the root of every stored path. If NULL, paths are
+	 *  resolved relative to the directory containing the DB.
 	 */
-	MetaStore(const char* _fname, const char* _prefix_replace) :
+	MetaStore(const char* _fname, const char* _dataroot) :
 		fname(_fname),
-		prefix_replace(_prefix_replace),
+		dataroot(_dataroot),
 		db(NULL),
-		stmt(NULL)
+		stmt(NULL),
+		load_stmt(NULL)
 	{
-		len_prefix_replace = strlen(prefix_replace);
+		string f(fname);
+		size_t sep = f.find_last_of("/\\");
+		dbdir = (sep == string::npos) ? string() : f.substr(0, sep + 1);
+	}
+
+	~MetaStore() {
+		close();
 	}
 
 	void open() {
@@ -86,12 +199,19 @@ public:
 	}
 
 	void close() {
+		sqlite3_finalize(stmt);
+		stmt = NULL;
+		sqlite3_finalize(load_stmt);
+		load_stmt = NULL;
+		load_sql.clear();
 		sqlite3_close(db);
+		db = NULL;
 	}
 
 	void start_iter() {
-		const char *sql = "select vname, tpath, vpath, vmin, vmax, vscale, vsize, npoints from meta;";
-		check(sqlite3_prepare_v2(db, sql, strlen(sql)+1, &stmt, NULL));
+		sqlite3_finalize(stmt);
+		string sql = string(SELECT_META) + " order by rowid;";
+		check(sqlite3_prepare_v2(db, sql.c_str(), sql.size()+1, &stmt, NULL));
 	}
 
 	vstream_res next_row() {
@@ -99,45 +219,250 @@ public:
 		res.success = false;
 		int rc = sqlite3_step(stmt);
 		if (rc == SQLITE_ROW) {
-			res.p.vname = strdup(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
-			res.p.tpath = strdup(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)));
-			memcpy(res.p.tpath, prefix_replace, len_prefix_replace - 1);
-			res.p.vpath = strdup(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)));
-			memcpy(res.p.vpath, prefix_replace, len_prefix_replace - 1);
-
-			res.p.vmin = sqlite3_column_int(stmt, 3);
-			res.p.vmax = sqlite3_column_int(stmt, 4);
-			res.p.vscale = sqlite3_column_int(stmt, 5);
-			res.p.vsize = sqlite3_column_int(stmt, 6);
-			res.p.npoints = sqlite3_column_int(stmt, 7);
+			res.p = read_row(stmt);
 			res.success = true;
 		} else if (rc == SQLITE_DONE) {
 			sqlite3_finalize(stmt);
+			stmt = NULL;
 		} else {
 			cerr << "Couldn't get next row" << endl;
 		}
 		return res;
 	}
+
+	/**
+	 * @brief load every stream matching filter with a single query.
+	 * The prepared statement is kept and reused by later calls with
+	 *  the same kinds of predicates.
+	 */
+	vector<vstream> load_streams(const stream_filter &filter = stream_filter()) {
+		string sql = string(SELECT_META) + " where npoints between ?1 and ?2";
+		if (filter.vsize != 0) {
+			sql += " and vsize = ?3";
+		}
+		if (NULL != filter.vname_like) {
+			sql += " and vname like ?4";
+		}
+		sql += " order by rowid;";
+
+		vector<vstream> streams;
+		if (sql == load_sql) {
+			sqlite3_reset(load_stmt);
+			sqlite3_clear_bindings(load_stmt);
+		} else {
+			sqlite3_finalize(load_stmt);
+			load_stmt = NULL;
+			load_sql.clear();
+			int rc = sqlite3_prepare_v2(db, sql.c_str(), sql.size()+1, &load_stmt, NULL);
+			check(rc);
+			if (rc != SQLITE_OK) {
+				return streams;
+			}
+			load_sql = sql;
+		}
+
+		sqlite3_bind_int64(load_stmt, 1, filter.min_npoints);
+		sqlite3_bind_int64(load_stmt, 2, filter.max_npoints);
+		if (filter.vsize != 0) {
+			sqlite3_bind_int(load_stmt, 3, filter.vsize);
+		}
+		if (NULL != filter.vname_like) {
+			sqlite3_bind_text(load_stmt, 4, filter.vname_like, -1, SQLITE_TRANSIENT);
+		}
+
+		int rc;
+		while ((rc = sqlite3_step(load_stmt)) == SQLITE_ROW) {
+			streams.push_back(read_row(load_stmt));
+		}
+		if (rc != SQLITE_DONE) {
+			cerr << "Couldn't load streams:" << sqlite3_errmsg(db) << endl;
+		}
+		return streams;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(MetaStore);
 };
+const char* const MetaStore::SELECT_META =
+		"select vname, tpath, vpath, tmin, tmax, tscale, tsize, "
+		"vmin, vmax, vscale, vsize, npoints from meta";
 
 /**
- * @param vs value stream
- * @returns ptr to allocated contents
+ * @param path column file
+ * @param npoints number of values to read
+ * @param size bytes in each value
+ * @returns ptr to allocated contents, or NULL if the column couldn't be read
  */
-void* read_fully(vstream vs) {
-	FILE *fp = fopen(vs.vpath, "rb");
-	void *space = NULL;
+void* read_fully(const char *path, int npoints, int size) {
+	FILE *fp = fopen(path, "rb");
 	if (NULL == fp) {
-		cerr << "Couldn't open path " << vs.vpath << endl;
-	} else {
-		space = malloc(vs.npoints * vs.vsize);
-		fread(space, vs.vsize, vs.npoints, fp);
+		cerr << "Couldn't open path " << path << endl;
+		return NULL;
+	}
+
+	void *space = malloc(static_cast<size_t>(npoints) * size);
+	size_t nread = fread(space, size, npoints, fp);
+	if (nread != static_cast<size_t>(npoints)) {
+		cerr << "Short read from " << path << ": got " << nread <<
+				" of " << npoints << " values" << endl;
+		free(space);
+		space = NULL;
 	}
 
 	fclose(fp);
 	return space;
 }
 
+/**
+ * @param vs value stream
+ * @returns ptr to allocated contents, or NULL if the stream couldn't be read
+ */
+void* read_fully(vstream vs) {
+	return read_fully(vs.vpath, vs.npoints, vs.vsize);
+}
+
+/**
+ * @brief read-only view of a value stream's contents.
+ * The file is mapped rather than copied, so the page cache is shared
+ *  between every run reading the same stream. Falls back to read_fully
+ *  where mmap isn't available.
+ */
+class MappedStream {
+private:
+	void *base;
+	uint64_t len;
+	bool mapped;
+
+public:
+	MappedStream() :
+		base(NULL),
+		len(0),
+		mapped(false)
+	{
+	}
+
+	~MappedStream() {
+		close();
+	}
+
+	/**
+	 * @param vs value stream to map
+	 * @param hugepages ask for transparent huge pages on the mapping
+	 * @returns true if the full stream is available through data()
+	 */
+	bool open(vstream vs, bool hugepages = false) {
+		return open_column(vs.vpath, vs.npoints, vs.vsize, hugepages);
+	}
+
+	/**
+	 * Map the stream's timestamps (of tsize bytes each) instead of its values
+	 */
+	bool open_times(vstream vs, bool hugepages = false) {
+		return open_column(vs.tpath, vs.npoints, vs.tsize, hugepages);
+	}
+
+	/**
+	 * @param path column file holding npoints values of size bytes
+	 */
+	bool open_column(const char *path, int npoints, int size, bool hugepages = false) {
+		return open_bytes(path, static_cast<uint64_t>(npoints) * size, hugepages);
+	}
+
+	/**
+	 * Map the whole of the file at path, whatever it holds
+	 */
+	bool open_file(const char *path, bool hugepages = false) {
+		FILE *fp = fopen(path, "rb");
+		if (NULL == fp) {
+			close();
+			cerr << "Couldn't open path " << path << endl;
+			return false;
+		}
+		fseek(fp, 0, SEEK_END);
+		long size = ftell(fp);
+		fclose(fp);
+		return size >= 0 && open_bytes(path, size, hugepages);
+	}
+
+	/**
+	 * @param bytes map the first this many bytes of path
+	 */
+	bool open_bytes(const char *path, uint64_t bytes, bool hugepages = false) {
+		close();
+		len = bytes;
+		if (0 == len) {
+			return true;
+		}
+
+#if defined WIN32 || defined __CYGWIN__
+		base = read_fully(path, 1, static_cast<int>(len));
+		return NULL != base;
+#else
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) {
+			cerr << "Couldn't open path " << path << endl;
+			return false;
+		}
+
+		struct stat st;
+		if (0 != fstat(fd, &st) || static_cast<uint64_t>(st.st_size) < len) {
+			cerr << "Stream " << path << " is shorter than " <<
+					len << " bytes" << endl;
+			::close(fd);
+			return false;
+		}
+
+		void *res = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		//the mapping holds its own reference to the file
+		::close(fd);
+		if (MAP_FAILED == res) {
+			cerr << "Couldn't map " << path << endl;
+			return false;
+		}
+
+		base = res;
+		mapped = true;
+		//coders consume streams front to back
+		madvise(base, len, MADV_SEQUENTIAL);
+		madvise(base, len, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+		if (hugepages) {
+			madvise(base, len, MADV_HUGEPAGE);
+		}
+#endif
+		return true;
+#endif
+	}
+
+	void close() {
+#if !(defined WIN32 || defined __CYGWIN__)
+		if (mapped) {
+			munmap(base, len);
+		} else
+#endif
+		{
+			free(base);
+		}
+		base = NULL;
+		len = 0;
+		mapped = false;
+	}
+
+	const void* data() const {
+		return base;
+	}
+
+	/**
+	 * @returns size of the stream in bytes
+	 */
+	uint64_t size() const {
+		return len;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(MappedStream);
+};
+
 /**
  * Check some values from stream 1
  */
@@ -180,14 +505,51 @@ static void test_stream3(vstream vs) {
 	assert(arr[vs.npoints-1] == -982143);
 }
 
+/**
+ * Mapped contents must match what we read
+ */
+static void test_mapped_stream(vstream vs) {
+	void *arr = read_fully(vs);
+	assert(NULL != arr);
+
+	MappedStream mapped;
+	assert(mapped.open(vs));
+	assert(mapped.size() == static_cast<uint64_t>(vs.npoints) * vs.vsize);
+	assert(0 == memcmp(arr, mapped.data(), mapped.size()));
+
+	//reopening releases the previous mapping
+	assert(mapped.open(vs, true));
+	assert(0 == memcmp(arr, mapped.data(), mapped.size()));
+
+	mapped.close();
+	assert(NULL == mapped.data());
+	free(arr);
+
+	vstream missing = vs;
+	missing.vpath = "../testdata/no-such-stream";
+	assert(NULL == read_fully(missing));
+	assert(!mapped.open(missing));
+
+	//timestamps rise from tmin to tmax
+	assert(mapped.open_times(vs));
+	assert(mapped.size() == static_cast<uint64_t>(vs.npoints) * vs.tsize);
+	assert(4 == vs.tsize);
+	const int32_t *ts = static_cast<const int32_t*>(mapped.data());
+	assert(ts[0] == vs.tmin);
+	assert(ts[vs.npoints - 1] == vs.tmax);
+	for (int i = 1; i < vs.npoints; ++i) {
+		assert(ts[i] > ts[i - 1]);
+	}
+}
+
 static const char* testdbs[] = {
 		"../testdata/cmu-robot-field/meta.db",
 		"../testdata/inline-skating/meta.db"
 };
 static const unsigned N_TEST_DBS = 2;
 
-void test_metastore() {
-	MetaStore ms = MetaStore(testdbs[0], Config::get("dataloc"));
+void test_metastore_iter() {
+	MetaStore ms(testdbs[0], NULL);
 
 	ms.open();
 	ms.start_iter();
@@ -198,6 +560,7 @@ void test_metastore() {
 		assert(res.p.npoints == 30282);
 		if (0 == points) {
 			test_stream1(res.p);
+			test_mapped_stream(res.p);
 		} else if (1 == points) {
 			test_stream2(res.p);
 		} else if (2 == points) {
@@ -210,34 +573,88 @@ void test_metastore() {
 	assert(points == 3);
 }
 
-vstream get_test_stream() {
-	MetaStore ms(testdbs[0], Config::get("dataloc"));
+void test_metastore_paths() {
+	MetaStore local(testdbs[0], NULL);
+	local.open();
+	vector<vstream> streams = local.load_streams();
+	assert(streams.size() == 3);
+	assert(0 == strcmp(streams[0].vpath, "../testdata/cmu-robot-field/vs/1"));
+	assert(0 == strcmp(streams[0].tpath, "../testdata/cmu-robot-field/ts/0"));
+	//all streams share one timestamp column
+	assert(streams[0].tpath == streams[2].tpath);
+	local.close();
+
+	MetaStore rooted(testdbs[0], "/data/");
+	rooted.open();
+	streams = rooted.load_streams();
+	assert(0 == strcmp(streams[1].vpath, "/data/CMU_robot/field.txt/vs/2"));
+	rooted.close();
+}
 
+void test_metastore_load() {
+	MetaStore ms(testdbs[1], NULL);
 	ms.open();
-	ms.start_iter();
 
-	vstream_res res = ms.next_row();
-	assert(res.success);
+	vector<vstream> all = ms.load_streams();
+	assert(all.size() == 15);
+	assert(0 == strcmp(all[0].vname, "1_trigger"));
+	assert(all[1].vmax == 100000000000LL);
+	assert(all[1].tsize == 2);
+	assert(all[1].tmax == 29999);
+
+	stream_filter filter;
+	filter.vsize = 8;
+	assert(ms.load_streams(filter).size() == 6);
+	//same shape of query: reuses the statement
+	filter.vsize = 1;
+	vector<vstream> discrete = ms.load_streams(filter);
+	assert(discrete.size() == 5);
+	assert(0 == strcmp(discrete[0].vname, "11_discretizedtrigger"));
+
+	filter.vsize = 0;
+	filter.vname_like = "%maximus";
+	assert(ms.load_streams(filter).size() == 2);
+	filter.vsize = 4;
+	vector<vstream> glut = ms.load_streams(filter);
+	assert(glut.size() == 1);
+	assert(0 == strcmp(glut[0].vname, "10_gluteusmaximus"));
+
+	stream_filter npoints;
+	npoints.min_npoints = 30000;
+	assert(ms.load_streams(npoints).size() == 0);
+	npoints.min_npoints = 29900;
+	npoints.max_npoints = 29900;
+	assert(ms.load_streams(npoints).size() == 15);
+
+	ms.close();
+}
+
+void test_metastore() {
+	test_metastore_iter();
+	test_metastore_paths();
+	test_metastore_load();
+}
+
+vstream get_test_stream() {
+	MetaStore ms(testdbs[0], NULL);
+
+	ms.open();
+	vector<vstream> streams = ms.load_streams();
+	assert(!streams.empty());
 
 	ms.close();
 
-	return res.p;
+	return streams[0];
 }
 
 vector<vstream> get_test_streams() {
 	vector<vstream> vstreams;
 
 	for (unsigned dx = 0; dx < N_TEST_DBS; ++dx) {
-		MetaStore ms(testdbs[dx], Config::get("dataloc"));
+		MetaStore ms(testdbs[dx], NULL);
 		ms.open();
-		ms.start_iter();
-
-		vstream_res res = ms.next_row();
-
-		for (vstream_res res; (res = ms.next_row()).success; ) {
-			vstreams.push_back(res.p);
-		}
-
+		vector<vstream> streams = ms.load_streams();
+		vstreams.insert(vstreams.end(), streams.begin(), streams.end());
 		ms.close();
 	}
 
@@ -0,0 +1,277 @@
+/*
+ * perfcounters.hpp
+ * @brief hardware performance counters around codec runs
+ * @author ishafer
+ */
+
+#ifndef PERFCOUNTERS_HPP_
+#define PERFCOUNTERS_HPP_
+
+#include <cstring>
+#include <cassert>
+#include <iostream>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "util.hpp"
+
+using namespace std;
+
+enum PerfEvent {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	N_PERF_EVENTS
+};
+
+ostream& operator<<(ostream& os, const PerfEvent& ev)
+{
+	switch(ev) {
+		case PERF_CYCLES: os << "cycles"; break;
+		case PERF_INSTRUCTIONS: os << "instructions"; break;
+		case PERF_BRANCH_MISSES: os << "branch-misses"; break;
+		case PERF_L1D_MISSES: os << "l1d-misses"; break;
+		case PERF_LLC_MISSES: os << "llc-misses"; break;
+		default: os << "unknown"; break;
+	}
+	return os;
+}
+
+/**
+ * Counter totals; events we couldn't count are negative
+ */
+struct perf_counts {
+	double counts[N_PERF_EVENTS];
+
+	perf_counts() {
+		clear();
+	}
+
+	void clear() {
+		for (int i = 0; i < N_PERF_EVENTS; ++i) {
+			counts[i] = -1;
+		}
+	}
+
+	bool has(PerfEvent ev) const {
+		return counts[ev] >= 0;
+	}
+
+	void add(const perf_counts &other) {
+		for (int i = 0; i < N_PERF_EVENTS; ++i) {
+			if (other.counts[i] >= 0) {
+				counts[i] = max(counts[i], 0.0) + other.counts[i];
+			}
+		}
+	}
+
+	/**
+	 * @returns this count per value, or -1 if not counted
+	 */
+	double per_value(PerfEvent ev, uint64_t nvalues) const {
+		return (has(ev) && nvalues > 0) ? counts[ev] / nvalues : -1;
+	}
+
+	/**
+	 * @returns instructions per cycle, or -1 if not counted
+	 */
+	double ipc() const {
+		return (has(PERF_CYCLES) && has(PERF_INSTRUCTIONS) && counts[PERF_CYCLES] > 0) ?
+				counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES] : -1;
+	}
+};
+
+/**
+ * @brief a group of perf_event_open counters on the calling thread.
+ * Any event the kernel or hardware won't give us is skipped; if none
+ *  can be opened, available() is false and reads return nothing, so
+ *  callers fall back to wall time.
+ */
+class PerfCounters {
+private:
+	int fds[N_PERF_EVENTS];
+	//position of each event in a group read; -1 if not open
+	int slot[N_PERF_EVENTS];
+	int nopen;
+
+#ifdef __linux__
+	static int open_event(uint32_t type, uint64_t config, int group_fd) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = (group_fd == -1);
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP |
+				PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+	}
+#endif
+
+public:
+	PerfCounters() :
+		nopen(0)
+	{
+		for (int i = 0; i < N_PERF_EVENTS; ++i) {
+			fds[i] = -1;
+			slot[i] = -1;
+		}
+	}
+
+	~PerfCounters() {
+		close();
+	}
+
+	/**
+	 * @returns true if at least the cycle counter is available
+	 */
+	bool open() {
+		close();
+#ifdef __linux__
+		uint64_t l1d = PERF_COUNT_HW_CACHE_L1D |
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		uint32_t types[N_PERF_EVENTS] = {
+			PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+			PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+		};
+		uint64_t configs[N_PERF_EVENTS] = {
+			PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_BRANCH_MISSES, l1d, PERF_COUNT_HW_CACHE_MISSES
+		};
+
+		fds[PERF_CYCLES] = open_event(types[PERF_CYCLES], configs[PERF_CYCLES], -1);
+		if (fds[PERF_CYCLES] < 0) {
+			fds[PERF_CYCLES] = -1;
+			return false;
+		}
+		slot[PERF_CYCLES] = nopen++;
+		for (int ev = PERF_CYCLES + 1; ev < N_PERF_EVENTS; ++ev) {
+			fds[ev] = open_event(types[ev], configs[ev], fds[PERF_CYCLES]);
+			if (fds[ev] < 0) {
+				fds[ev] = -1;
+			} else {
+				slot[ev] = nopen++;
+			}
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	void close() {
+#ifdef __linux__
+		for (int i = N_PERF_EVENTS - 1; i >= 0; --i) {
+			if (fds[i] >= 0) {
+				::close(fds[i]);
+			}
+			fds[i] = -1;
+			slot[i] = -1;
+		}
+#endif
+		nopen = 0;
+	}
+
+	bool available() const {
+		return nopen > 0;
+	}
+
+	void start() {
+#ifdef __linux__
+		if (available()) {
+			ioctl(fds[PERF_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+			ioctl(fds[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		}
+#endif
+	}
+
+	/**
+	 * @returns counts since start(), scaled up if the kernel multiplexed
+	 */
+	perf_counts stop() {
+		perf_counts res;
+#ifdef __linux__
+		if (!available()) {
+			return res;
+		}
+		ioctl(fds[PERF_CYCLES], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+		//nr, time_enabled, time_running, then one value per event
+		uint64_t buf[3 + N_PERF_EVENTS];
+		ssize_t nread = read(fds[PERF_CYCLES], buf, sizeof(buf));
+		if (nread < static_cast<ssize_t>(sizeof(uint64_t)*(3 + nopen))) {
+			return res;
+		}
+		double scale = (buf[2] > 0) ? static_cast<double>(buf[1]) / buf[2] : 1.0;
+		for (int ev = 0; ev < N_PERF_EVENTS; ++ev) {
+			if (slot[ev] >= 0) {
+				res.counts[ev] = buf[3 + slot[ev]] * scale;
+			}
+		}
+#endif
+		return res;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(PerfCounters);
+};
+
+void test_perf_counts() {
+	perf_counts a;
+	assert( !a.has(PERF_CYCLES) );
+	assert( a.ipc() < 0 );
+	assert( a.per_value(PERF_CYCLES, 10) < 0 );
+
+	perf_counts b;
+	b.counts[PERF_CYCLES] = 100;
+	b.counts[PERF_INSTRUCTIONS] = 250;
+	a.add(b);
+	a.add(b);
+	assert( a.counts[PERF_CYCLES] == 200 );
+	assert( a.ipc() == 2.5 );
+	assert( a.per_value(PERF_CYCLES, 20) == 10 );
+	assert( !a.has(PERF_LLC_MISSES) );
+}
+
+void test_perf_counters() {
+	PerfCounters pc;
+	bool ok = pc.open();
+	assert( ok == pc.available() );
+
+	pc.start();
+	volatile uint64_t sum = 0;
+	for (uint64_t i = 0; i < 1000000; ++i) {
+		sum += i;
+	}
+	perf_counts counts = pc.stop();
+
+	if (ok) {
+		assert( counts.has(PERF_CYCLES) );
+		assert( counts.counts[PERF_CYCLES] > 0 );
+		if (counts.has(PERF_INSTRUCTIONS)) {
+			assert( counts.counts[PERF_INSTRUCTIONS] > 1000000 );
+		}
+	} else {
+		//wall time only
+		for (int ev = 0; ev < N_PERF_EVENTS; ++ev) {
+			assert( !counts.has(static_cast<PerfEvent>(ev)) );
+		}
+	}
+}
+
+void test_perfcounters() {
+	test_perf_counts();
+	test_perf_counters();
+}
+
+#endif /* PERFCOUNTERS_HPP_ */
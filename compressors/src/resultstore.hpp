@@ -0,0 +1,290 @@
+/*
+ * resultstore.hpp
+ * @brief persist roundtrip measurements to sqlite
+ * @author ishafer
+ */
+
+#ifndef RESULTSTORE_HPP_
+#define RESULTSTORE_HPP_
+
+#include "../inc/sqlite3.h"
+#include <cstring>
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+
+#include "alloctrack.hpp"
+#include "metastore.hpp"
+#include "perfcounters.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+/**
+ * Timing summary over repeated trials, in nanoseconds
+ */
+struct trial_stats {
+	uint32_t ntrials;
+	double min_ns;
+	double median_ns;
+	double p95_ns;
+};
+
+/**
+ * Outcome of coding one stream with one codec
+ */
+struct roundtrip_result {
+	bool ok;
+	uint64_t rawbytes;
+	uint64_t encbytes;
+	trial_stats enc;
+	trial_stats dec;
+	//hardware counters per trial, where available
+	perf_counts enc_counts;
+	perf_counts dec_counts;
+	//heap use per trial, if built with TRACK_ALLOCS
+	alloc_stats enc_allocs;
+	alloc_stats dec_allocs;
+
+	roundtrip_result() :
+		ok(false),
+		rawbytes(0),
+		encbytes(0)
+	{
+		memset(&enc, 0, sizeof(enc));
+		memset(&dec, 0, sizeof(dec));
+	}
+};
+
+/**
+ * @returns stats for a single timed trial
+ */
+trial_stats single_trial(double seconds) {
+	trial_stats st;
+	st.ntrials = 1;
+	st.min_ns = st.median_ns = st.p95_ns = seconds * 1e9;
+	return st;
+}
+
+/**
+ * @brief results table of (stream, codec) measurements.
+ * Rows are written in batched transactions on a WAL-mode db, and
+ *  keyed so that a rerun can skip everything already measured with
+ *  the current version of each codec.
+ */
+class ResultStore {
+private:
+	const char* fname;
+	sqlite3 *db;
+	sqlite3_stmt *insert_stmt;
+	sqlite3_stmt *has_stmt;
+	//rows per transaction
+	uint32_t batch_size;
+	//rows in the open transaction
+	uint32_t pending;
+
+	bool exec(const char *sql) {
+		char *err = NULL;
+		if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+			cerr << "results db: " << err << endl;
+			sqlite3_free(err);
+			return false;
+		}
+		return true;
+	}
+
+	bool prepare(const char *sql, sqlite3_stmt **st) {
+		if (sqlite3_prepare_v2(db, sql, -1, st, NULL) != SQLITE_OK) {
+			cerr << "results db: " << sqlite3_errmsg(db) << endl;
+			return false;
+		}
+		return true;
+	}
+
+public:
+	/**
+	 * @param _fname results DB file name; created if missing
+	 * @param _batch_size number of rows to write per transaction
+	 */
+	ResultStore(const char* _fname, uint32_t _batch_size = 256) :
+		fname(_fname),
+		db(NULL),
+		insert_stmt(NULL),
+		has_stmt(NULL),
+		batch_size(_batch_size),
+		pending(0)
+	{
+	}
+
+	~ResultStore() {
+		close();
+	}
+
+	bool open() {
+		if (sqlite3_open(fname, &db) != SQLITE_OK) {
+			cerr << "couldn't open results db " << fname << ":" << sqlite3_errmsg(db) << endl;
+			close();
+			return false;
+		}
+		bool ok = exec("pragma journal_mode=WAL;") &&
+			exec("pragma synchronous=NORMAL;") &&
+			exec("create table if not exists results ("
+					"vpath text, vname text, codec text, codec_version integer, "
+					"delta integer, nthreads integer, "
+					"rawbytes integer, encbytes integer, "
+					"enc_ns real, dec_ns real, ntrials integer, "
+					"enc_ns_min real, enc_ns_p95 real, "
+					"dec_ns_min real, dec_ns_p95 real, "
+					"ok integer, "
+					"primary key (vpath, codec, delta, nthreads));") &&
+			prepare("insert or replace into results values "
+					"(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, ?15, ?16);",
+					&insert_stmt) &&
+			prepare("select 1 from results where vpath = ?1 and codec = ?2 and "
+					"delta = ?3 and nthreads = ?4 and codec_version = ?5 and ok = 1;",
+					&has_stmt);
+		if (!ok) {
+			close();
+		}
+		return ok;
+	}
+
+	/**
+	 * Commit the open batch, if any
+	 */
+	void flush() {
+		if (pending > 0) {
+			exec("commit;");
+			pending = 0;
+		}
+	}
+
+	void close() {
+		if (NULL == db) {
+			return;
+		}
+		flush();
+		sqlite3_finalize(insert_stmt);
+		insert_stmt = NULL;
+		sqlite3_finalize(has_stmt);
+		has_stmt = NULL;
+		sqlite3_close(db);
+		db = NULL;
+	}
+
+	/**
+	 * @returns true if this stream has a good measurement for this version of the codec
+	 */
+	bool has(const vstream &vs, const char *codec, int codec_version,
+			bool delta, uint32_t nthreads) {
+		sqlite3_reset(has_stmt);
+		sqlite3_bind_text(has_stmt, 1, vs.vpath, -1, SQLITE_STATIC);
+		sqlite3_bind_text(has_stmt, 2, codec, -1, SQLITE_STATIC);
+		sqlite3_bind_int(has_stmt, 3, delta);
+		sqlite3_bind_int(has_stmt, 4, nthreads);
+		sqlite3_bind_int(has_stmt, 5, codec_version);
+		bool found = (sqlite3_step(has_stmt) == SQLITE_ROW);
+		sqlite3_reset(has_stmt);
+		return found;
+	}
+
+	/**
+	 * Record a measurement, replacing any earlier one
+	 */
+	void add(const vstream &vs, const char *codec, int codec_version,
+			bool delta, uint32_t nthreads, const roundtrip_result &res) {
+		if (0 == pending) {
+			exec("begin;");
+		}
+		sqlite3_reset(insert_stmt);
+		sqlite3_bind_text(insert_stmt, 1, vs.vpath, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert_stmt, 2, vs.vname, -1, SQLITE_STATIC);
+		sqlite3_bind_text(insert_stmt, 3, codec, -1, SQLITE_STATIC);
+		sqlite3_bind_int(insert_stmt, 4, codec_version);
+		sqlite3_bind_int(insert_stmt, 5, delta);
+		sqlite3_bind_int(insert_stmt, 6, nthreads);
+		sqlite3_bind_int64(insert_stmt, 7, res.rawbytes);
+		sqlite3_bind_int64(insert_stmt, 8, res.encbytes);
+		sqlite3_bind_double(insert_stmt, 9, res.enc.median_ns);
+		sqlite3_bind_double(insert_stmt, 10, res.dec.median_ns);
+		sqlite3_bind_int(insert_stmt, 11, res.enc.ntrials);
+		sqlite3_bind_double(insert_stmt, 12, res.enc.min_ns);
+		sqlite3_bind_double(insert_stmt, 13, res.enc.p95_ns);
+		sqlite3_bind_double(insert_stmt, 14, res.dec.min_ns);
+		sqlite3_bind_double(insert_stmt, 15, res.dec.p95_ns);
+		sqlite3_bind_int(insert_stmt, 16, res.ok);
+		if (sqlite3_step(insert_stmt) != SQLITE_DONE) {
+			cerr << "couldn't store result:" << sqlite3_errmsg(db) << endl;
+		}
+		sqlite3_reset(insert_stmt);
+
+		if (++pending >= batch_size) {
+			flush();
+		}
+	}
+
+	/**
+	 * @returns number of stored results
+	 */
+	int64_t count() {
+		sqlite3_stmt *st = NULL;
+		int64_t n = -1;
+		if (prepare("select count(*) from results;", &st) && sqlite3_step(st) == SQLITE_ROW) {
+			n = sqlite3_column_int64(st, 0);
+		}
+		sqlite3_finalize(st);
+		return n;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(ResultStore);
+};
+
+void test_resultstore() {
+	const char *fname = "test-results.db";
+	remove(fname);
+
+	vstream vs = get_test_stream();
+	roundtrip_result res;
+	res.ok = true;
+	res.rawbytes = 100;
+	res.encbytes = 40;
+	res.enc = single_trial(0.5);
+	res.dec = single_trial(0.25);
+
+	{
+		ResultStore store(fname, 2);
+		assert( store.open() );
+		assert( !store.has(vs, "zlib", 1, true, 1) );
+		store.add(vs, "zlib", 1, true, 1, res);
+		//visible inside the open batch
+		assert( store.has(vs, "zlib", 1, true, 1) );
+		assert( !store.has(vs, "zlib", 1, false, 1) );
+		assert( !store.has(vs, "zlib", 2, true, 1) );
+		assert( !store.has(vs, "elias-gamma", 1, true, 1) );
+
+		res.ok = false;
+		store.add(vs, "elias-gamma", 1, true, 1, res);
+		assert( !store.has(vs, "elias-gamma", 1, true, 1) );
+		res.ok = true;
+		store.add(vs, "zlib", 1, true, 4, res);
+		assert( store.count() == 3 );
+	}
+
+	ResultStore store(fname);
+	assert( store.open() );
+	assert( store.count() == 3 );
+	assert( store.has(vs, "zlib", 1, true, 4) );
+	//a new codec version is measured again
+	store.add(vs, "zlib", 2, true, 1, res);
+	assert( store.count() == 3 );
+	assert( store.has(vs, "zlib", 2, true, 1) );
+	assert( !store.has(vs, "zlib", 1, true, 1) );
+	store.close();
+
+	remove(fname);
+	remove("test-results.db-wal");
+	remove("test-results.db-shm");
+}
+
+#endif /* RESULTSTORE_HPP_ */
@@ -0,0 +1,801 @@
+/*
+ * segstore.hpp
+ * @brief append-only segment files of encoded streams
+ * @author ishafer
+ */
+
+#ifndef SEGSTORE_HPP_
+#define SEGSTORE_HPP_
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#if !(defined WIN32 || defined __CYGWIN__)
+#include <unistd.h>
+#endif
+
+#include "../inc/zlib.h"
+#include "metastore.hpp"
+#include "compressor.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+static const uint32_t SEG_FILE_MAGIC = 0x47455343; //"CSEG"
+static const uint32_t SEG_FRAME_MAGIC = 0x4d415246; //"FRAM"
+static const uint32_t SEG_FOOTER_MAGIC = 0x544f4f46; //"FOOT"
+static const uint32_t SEG_VERSION = 1;
+//values per frame; loading a short range decodes about this many
+static const uint32_t SEG_FRAME_VALUES = 65536;
+
+//frame flags
+static const uint8_t SEG_DELTA = 1;
+
+/**
+ * Layout of a segment file:
+ *  seg_file_header, then frames of (seg_frame_header, payload), then a
+ *  footer of one seg_index_entry per frame and a seg_trailer.
+ * The footer is only written on a clean close, and is cut off again before
+ *  the next append; without one, the frames are found by a scan.
+ */
+struct seg_file_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct seg_frame_header {
+	uint32_t magic;
+	//crc32 of the rest of this header and the payload
+	uint32_t crc;
+	//index in the series of the frame's first value
+	uint64_t first;
+	//bytes of payload
+	uint64_t len;
+	uint32_t nvalues;
+	uint16_t coder;
+	uint8_t version;
+	uint8_t vsize;
+	uint8_t flags;
+	uint8_t reserved[7];
+};
+
+struct seg_index_entry {
+	//file offset of the frame header
+	uint64_t offset;
+	uint64_t first;
+	uint32_t nvalues;
+	uint32_t reserved;
+};
+
+struct seg_trailer {
+	uint32_t magic;
+	//crc32 of the index entries
+	uint32_t crc;
+	uint64_t nframes;
+};
+
+uint32_t seg_frame_crc(const seg_frame_header &fh, const unsigned char *payload) {
+	const unsigned char *rest = reinterpret_cast<const unsigned char*>(&fh) + 2*sizeof(uint32_t);
+	uLong crc = crc32(0L, rest, sizeof(fh) - 2*sizeof(uint32_t));
+	//zlib takes uInt lengths
+	for (uint64_t done = 0; done < fh.len; ) {
+		uInt chunk = static_cast<uInt>(min<uint64_t>(fh.len - done, 1u << 30));
+		crc = crc32(crc, payload + done, chunk);
+		done += chunk;
+	}
+	return static_cast<uint32_t>(crc);
+}
+
+uint32_t seg_index_crc(const seg_index_entry *entries, uint64_t nframes) {
+	uLong crc = crc32(0L, NULL, 0);
+	for (uint64_t i = 0; i < nframes; ++i) {
+		crc = crc32(crc, reinterpret_cast<const unsigned char*>(entries + i), sizeof(seg_index_entry));
+	}
+	return static_cast<uint32_t>(crc);
+}
+
+/**
+ * Find the frames of a segment file's bytes.
+ * The footer is trusted if its checksum holds; otherwise frames are read
+ *  front to back until one is torn or fails its checksum.
+ * @param data_end set to the end of the last good frame
+ * @param from_footer set to whether the footer was used
+ * @returns false if base doesn't start a segment file
+ */
+bool seg_parse(const unsigned char *base, uint64_t size, vector<seg_index_entry> &entries,
+		uint64_t *data_end, bool *from_footer) {
+	entries.clear();
+	*data_end = 0;
+	*from_footer = false;
+	seg_file_header fhdr;
+	if (size < sizeof(fhdr)) {
+		return false;
+	}
+	memcpy(&fhdr, base, sizeof(fhdr));
+	if (SEG_FILE_MAGIC != fhdr.magic || SEG_VERSION != fhdr.version) {
+		return false;
+	}
+
+	seg_trailer tr;
+	if (size >= sizeof(fhdr) + sizeof(tr)) {
+		memcpy(&tr, base + size - sizeof(tr), sizeof(tr));
+		uint64_t room = (size - sizeof(fhdr) - sizeof(tr)) / sizeof(seg_index_entry);
+		if (SEG_FOOTER_MAGIC == tr.magic && tr.nframes <= room) {
+			uint64_t index_start = size - sizeof(tr) - tr.nframes*sizeof(seg_index_entry);
+			entries.resize(tr.nframes);
+			if (tr.nframes > 0) {
+				memcpy(&entries[0], base + index_start, tr.nframes*sizeof(seg_index_entry));
+			}
+			bool ok = (seg_index_crc(entries.data(), tr.nframes) == tr.crc);
+			uint64_t next = 0;
+			for (uint64_t i = 0; ok && i < tr.nframes; ++i) {
+				ok = entries[i].offset >= sizeof(fhdr) &&
+						entries[i].offset + sizeof(seg_frame_header) <= index_start &&
+						entries[i].first == next;
+				next += entries[i].nvalues;
+			}
+			if (ok) {
+				*data_end = index_start;
+				*from_footer = true;
+				return true;
+			}
+			entries.clear();
+		}
+	}
+
+	uint64_t pos = sizeof(fhdr);
+	uint64_t next = 0;
+	seg_frame_header fh;
+	while (size - pos >= sizeof(fh)) {
+		memcpy(&fh, base + pos, sizeof(fh));
+		if (SEG_FRAME_MAGIC != fh.magic || fh.first != next ||
+				fh.len > size - pos - sizeof(fh) ||
+				seg_frame_crc(fh, base + pos + sizeof(fh)) != fh.crc) {
+			break;
+		}
+		seg_index_entry e;
+		memset(&e, 0, sizeof(e));
+		e.offset = pos;
+		e.first = fh.first;
+		e.nvalues = fh.nvalues;
+		entries.push_back(e);
+		next += fh.nvalues;
+		pos += sizeof(fh) + fh.len;
+	}
+	*data_end = pos;
+	return true;
+}
+
+/**
+ * @brief read-only, mapped view of a segment file
+ */
+class SegmentReader {
+public:
+	SegmentReader() :
+		data_end(0),
+		total(0)
+	{
+	}
+
+	/**
+	 * @returns false if path can't be read or isn't a segment file
+	 */
+	bool open(const char *path) {
+		close();
+		bool from_footer;
+		if (!mapped.open_file(path) ||
+				!seg_parse(base(), mapped.size(), entries, &data_end, &from_footer)) {
+			cerr << "Not a segment file: " << path << endl;
+			close();
+			return false;
+		}
+		if (!from_footer && data_end != mapped.size()) {
+			cerr << "Ignoring " << (mapped.size() - data_end) <<
+					" bytes of torn tail in " << path << endl;
+		}
+		total = entries.empty() ? 0 : entries.back().first + entries.back().nvalues;
+		return true;
+	}
+
+	void close() {
+		mapped.close();
+		entries.clear();
+		data_end = 0;
+		total = 0;
+	}
+
+	uint32_t nframes() const {
+		return entries.size();
+	}
+
+	/**
+	 * @returns values in the series
+	 */
+	uint64_t nvalues() const {
+		return total;
+	}
+
+	/**
+	 * @returns end of the last good frame, where the next one is appended
+	 */
+	uint64_t end() const {
+		return data_end;
+	}
+
+	const seg_index_entry &entry(uint32_t fdx) const {
+		return entries[fdx];
+	}
+
+	/**
+	 * @returns a copy, as frames in the mapping needn't be aligned
+	 */
+	seg_frame_header frame(uint32_t fdx) const {
+		seg_frame_header fh;
+		memcpy(&fh, base() + entries[fdx].offset, sizeof(fh));
+		return fh;
+	}
+
+	const unsigned char *payload(uint32_t fdx) const {
+		return base() + entries[fdx].offset + sizeof(seg_frame_header);
+	}
+
+	/**
+	 * @returns whether frame fdx is whole and matches its checksum
+	 */
+	bool check(uint32_t fdx) const {
+		seg_frame_header fh = frame(fdx);
+		return SEG_FRAME_MAGIC == fh.magic &&
+				fh.len <= data_end - entries[fdx].offset - sizeof(fh) &&
+				seg_frame_crc(fh, payload(fdx)) == fh.crc;
+	}
+
+	/**
+	 * @returns the frame holding value i, or nframes() if there isn't one
+	 */
+	uint32_t frame_of(uint64_t i) const {
+		uint32_t lo = 0;
+		uint32_t hi = entries.size();
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (entries[mid].first + entries[mid].nvalues <= i) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		return lo;
+	}
+
+private:
+	const unsigned char *base() const {
+		return static_cast<const unsigned char*>(mapped.data());
+	}
+
+	MappedStream mapped;
+	vector<seg_index_entry> entries;
+	uint64_t data_end;
+	uint64_t total;
+
+	DISALLOW_EVIL_CONSTRUCTORS(SegmentReader);
+};
+
+/**
+ * @brief appends frames to a segment file.
+ * Opening an existing file recovers it: a footer is cut off so frames can
+ *  follow, and a torn or corrupt tail left by a crash is truncated away.
+ * Each append is flushed before it returns, and synced too if asked; the
+ *  footer is written by close().
+ */
+class SegmentWriter {
+public:
+	SegmentWriter() :
+		fp(NULL),
+		sync(false),
+		pos(0),
+		total(0)
+	{
+	}
+
+	~SegmentWriter() {
+		close();
+	}
+
+	/**
+	 * @param fsync sync each append to disk as well as flushing it
+	 * @returns false if path can't be written or isn't a segment file
+	 */
+	bool open(const char *path, bool fsync = false) {
+		close();
+		sync = fsync;
+		FILE *probe = fopen(path, "rb");
+		bool exists = (NULL != probe);
+		bool empty = true;
+		if (exists) {
+			seg_file_header fhdr;
+			empty = (fread(&fhdr, 1, sizeof(fhdr), probe) < sizeof(fhdr));
+			fclose(probe);
+		}
+
+		if (!exists || empty) {
+			//a file cut short before its header is started again
+			fp = fopen(path, "w+b");
+			if (NULL == fp) {
+				cerr << "Couldn't create segment file " << path << endl;
+				return false;
+			}
+			seg_file_header fhdr;
+			fhdr.magic = SEG_FILE_MAGIC;
+			fhdr.version = SEG_VERSION;
+			pos = sizeof(fhdr);
+			return 1 == fwrite(&fhdr, sizeof(fhdr), 1, fp) && flush();
+		}
+
+		SegmentReader reader;
+		if (!reader.open(path)) {
+			return false;
+		}
+		entries.clear();
+		for (uint32_t fdx = 0; fdx < reader.nframes(); ++fdx) {
+			entries.push_back(reader.entry(fdx));
+		}
+		pos = reader.end();
+		total = reader.nvalues();
+		reader.close();
+
+#if !(defined WIN32 || defined __CYGWIN__)
+		if (0 != truncate(path, pos)) {
+			cerr << "Couldn't truncate segment file " << path << endl;
+			return false;
+		}
+#endif
+		fp = fopen(path, "r+b");
+		if (NULL == fp || 0 != fseek(fp, pos, SEEK_SET)) {
+			cerr << "Couldn't open segment file " << path << endl;
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Append a frame of nvalues values coded by coder
+	 * @param deltaenc whether the values were delta encoded (from this frame's start)
+	 */
+	bool append(const unsigned char *payload, uint64_t len, uint32_t nvalues, int vsize,
+			CoderName coder, bool deltaenc) {
+		if (NULL == fp) {
+			return false;
+		}
+		seg_frame_header fh;
+		memset(&fh, 0, sizeof(fh));
+		fh.magic = SEG_FRAME_MAGIC;
+		fh.first = total;
+		fh.len = len;
+		fh.nvalues = nvalues;
+		fh.coder = coder;
+		fh.version = coder_version(coder);
+		fh.vsize = vsize;
+		fh.flags = deltaenc ? SEG_DELTA : 0;
+		fh.crc = seg_frame_crc(fh, payload);
+		if (1 != fwrite(&fh, sizeof(fh), 1, fp) ||
+				(len > 0 && 1 != fwrite(payload, len, 1, fp)) || !flush()) {
+			cerr << "Couldn't append a frame" << endl;
+			return false;
+		}
+
+		seg_index_entry e;
+		memset(&e, 0, sizeof(e));
+		e.offset = pos;
+		e.first = total;
+		e.nvalues = nvalues;
+		entries.push_back(e);
+		pos += sizeof(fh) + len;
+		total += nvalues;
+		return true;
+	}
+
+	/**
+	 * Write the footer and close the file
+	 */
+	bool close() {
+		if (NULL == fp) {
+			return true;
+		}
+		seg_trailer tr;
+		tr.magic = SEG_FOOTER_MAGIC;
+		tr.crc = seg_index_crc(entries.data(), entries.size());
+		tr.nframes = entries.size();
+		bool ok = (entries.empty() ||
+				entries.size() == fwrite(entries.data(), sizeof(seg_index_entry), entries.size(), fp)) &&
+				1 == fwrite(&tr, sizeof(tr), 1, fp) && flush();
+		fclose(fp);
+		fp = NULL;
+		entries.clear();
+		pos = 0;
+		total = 0;
+		return ok;
+	}
+
+	/**
+	 * @returns values in the series so far
+	 */
+	uint64_t nvalues() const {
+		return total;
+	}
+
+	uint32_t nframes() const {
+		return entries.size();
+	}
+
+private:
+	bool flush() {
+		if (0 != fflush(fp)) {
+			return false;
+		}
+#if !(defined WIN32 || defined __CYGWIN__)
+		if (sync && 0 != fsync(fileno(fp))) {
+			return false;
+		}
+#endif
+		return true;
+	}
+
+	FILE *fp;
+	bool sync;
+	//end of the last frame
+	uint64_t pos;
+	uint64_t total;
+	vector<seg_index_entry> entries;
+
+	DISALLOW_EVIL_CONSTRUCTORS(SegmentWriter);
+};
+
+/**
+ * Code n values in frames of frame_values and append them.
+ * Frames are delta encoded from their own start, so each decodes alone.
+ */
+template<typename vT, typename bsT>
+bool seg_append(SegmentWriter &w, CoderName name, bool deltaenc, const vT *vals, uint64_t n,
+		uint32_t frame_values = SEG_FRAME_VALUES) {
+	const Coder<vT, bsT> *coder = get_coder<vT, bsT>(name);
+	vT *deltas = deltaenc ? static_cast<vT*>(malloc(sizeof(vT)*frame_values)) : NULL;
+	uint64_t cap = sizeof(vT)*(frame_values*BUF_SCALE_FACTOR+12);
+	unsigned char *bits = static_cast<unsigned char*>(malloc(cap));
+	bool ok = true;
+	for (uint64_t start = 0; ok && start < n; start += frame_values) {
+		uint32_t len = static_cast<uint32_t>(min<uint64_t>(frame_values, n - start));
+		vT *in = const_cast<vT*>(vals + start);
+		if (deltaenc) {
+			delta_enc(deltas, in, len);
+			in = deltas;
+		}
+		uint64_t outsize = cap;
+		memset(bits, 0, cap);
+		bits = coder->enc(bits, &outsize, in, len);
+		ok = w.append(bits, outsize, len, sizeof(vT), name, deltaenc);
+		//coders may have grown the buffer
+		cap = max(cap, outsize);
+	}
+	free(bits);
+	free(deltas);
+	delete coder;
+	return ok;
+}
+
+/**
+ * Decode values [from, to) of a segment file into out.
+ * Only the frames overlapping the range are checked and decoded.
+ * @param ndecoded if not NULL, set to the number of frames decoded
+ * @returns false if a frame is corrupt or wasn't written for vT
+ */
+template<typename vT, typename bsT>
+bool seg_load(const SegmentReader &seg, uint64_t from, uint64_t to, vT *out,
+		uint32_t *ndecoded = NULL) {
+	to = min(to, seg.nvalues());
+	uint32_t decoded = 0;
+	bool ok = true;
+	vT *tmp = NULL;
+	for (uint32_t fdx = (from < to) ? seg.frame_of(from) : seg.nframes();
+			ok && fdx < seg.nframes() && seg.entry(fdx).first < to; ++fdx) {
+		seg_frame_header fh = seg.frame(fdx);
+		CoderName name = static_cast<CoderName>(fh.coder);
+		if (!seg.check(fdx) || sizeof(vT) != fh.vsize || fh.coder >= N_CODERS ||
+				coder_version(name) != fh.version) {
+			cerr << "Can't decode frame " << fdx << " of a segment file" << endl;
+			ok = false;
+			break;
+		}
+		if (0 == fh.nvalues) {
+			continue;
+		}
+		vT *grown = static_cast<vT*>(realloc(tmp, sizeof(vT)*fh.nvalues));
+		if (NULL == grown) {
+			cerr << "Couldn't allocate frame " << fdx << " of a segment file" << endl;
+			ok = false;
+			break;
+		}
+		tmp = grown;
+		const Coder<vT, bsT> *coder = get_coder<vT, bsT>(name);
+		uint64_t len = fh.nvalues;
+		vT *vals = coder->dec(tmp, &len, const_cast<unsigned char*>(seg.payload(fdx)), fh.len);
+		if (vals != tmp) {
+			memcpy(tmp, vals, fh.nvalues*sizeof(vT));
+			free(vals);
+		}
+		delete coder;
+		if (0 != (fh.flags & SEG_DELTA)) {
+			delta_dec_inplace(tmp, fh.nvalues);
+		}
+		++decoded;
+
+		uint64_t lo = max(from, fh.first);
+		uint64_t hi = min(to, fh.first + fh.nvalues);
+		memcpy(out + (lo - from), tmp + (lo - fh.first), (hi - lo)*sizeof(vT));
+	}
+	free(tmp);
+	if (NULL != ndecoded) {
+		*ndecoded = decoded;
+	}
+	return ok;
+}
+
+/**
+ * @brief a directory of segment files, one per stream of a MetaStore.
+ * Streams are coded once from their raw vs/ files, then loaded from here.
+ */
+class SegmentStore {
+public:
+	SegmentStore(const char *_dir) :
+		dir(_dir)
+	{
+	}
+
+	/**
+	 * @returns segment file of vs: its vpath, flattened into dir
+	 */
+	string path(const vstream &vs) const {
+		const char *p = vs.vpath;
+		while ('.' == p[0] || '/' == p[0]) {
+			++p;
+		}
+		string name(p);
+		replace(name.begin(), name.end(), '/', '_');
+		return dir + "/" + name + ".seg";
+	}
+
+	/**
+	 * Code vs into a new segment file, replacing any earlier one
+	 */
+	bool store(const vstream &vs, CoderName coder, bool deltaenc = true,
+			uint32_t frame_values = SEG_FRAME_VALUES) {
+		MappedStream raw;
+		if (!raw.open(vs)) {
+			return false;
+		}
+		string p = path(vs);
+		remove(p.c_str());
+		SegmentWriter w;
+		if (!w.open(p.c_str())) {
+			return false;
+		}
+		bool ok = false;
+		switch (vs.vsize) {
+		case 1:
+			ok = seg_append<int8_t, uint8_t>(w, coder, deltaenc,
+					static_cast<const int8_t*>(raw.data()), vs.npoints, frame_values);
+			break;
+		case 2:
+			ok = seg_append<int16_t, uint16_t>(w, coder, deltaenc,
+					static_cast<const int16_t*>(raw.data()), vs.npoints, frame_values);
+			break;
+		case 4:
+			ok = seg_append<int32_t, uint32_t>(w, coder, deltaenc,
+					static_cast<const int32_t*>(raw.data()), vs.npoints, frame_values);
+			break;
+		case 8:
+			ok = seg_append<int64_t, uint64_t>(w, coder, deltaenc,
+					static_cast<const int64_t*>(raw.data()), vs.npoints, frame_values);
+			break;
+		default:
+			cerr << "Unknown value size:" << vs.vsize << endl;
+		}
+		return w.close() && ok;
+	}
+
+	/**
+	 * @returns ptr to allocated values [from, to) of vs, as read_fully would
+	 *  give them, or NULL if the stream isn't stored whole
+	 */
+	void* load(const vstream &vs, uint64_t from = 0, uint64_t to = numeric_limits<uint64_t>::max()) const {
+		SegmentReader seg;
+		if (!seg.open(path(vs).c_str())) {
+			return NULL;
+		}
+		if (seg.nvalues() != static_cast<uint64_t>(vs.npoints)) {
+			cerr << "Segment file of " << vs.vname << " holds " << seg.nvalues() <<
+					" of " << vs.npoints << " values" << endl;
+			return NULL;
+		}
+		to = min(to, seg.nvalues());
+		from = min(from, to);
+		size_t bytes = static_cast<size_t>(to - from) * vs.vsize;
+		void *out = malloc(bytes);
+		if (NULL == out && bytes > 0) {
+			cerr << "Couldn't allocate " << bytes << " bytes for " << vs.vname << endl;
+			return NULL;
+		}
+		bool ok = false;
+		switch (vs.vsize) {
+		case 1:
+			ok = seg_load<int8_t, uint8_t>(seg, from, to, static_cast<int8_t*>(out));
+			break;
+		case 2:
+			ok = seg_load<int16_t, uint16_t>(seg, from, to, static_cast<int16_t*>(out));
+			break;
+		case 4:
+			ok = seg_load<int32_t, uint32_t>(seg, from, to, static_cast<int32_t*>(out));
+			break;
+		case 8:
+			ok = seg_load<int64_t, uint64_t>(seg, from, to, static_cast<int64_t*>(out));
+			break;
+		default:
+			cerr << "Unknown value size:" << vs.vsize << endl;
+		}
+		if (!ok) {
+			free(out);
+			out = NULL;
+		}
+		return out;
+	}
+
+	/**
+	 * @returns bytes of vs's segment file, or 0 if it has none
+	 */
+	uint64_t stored_bytes(const vstream &vs) const {
+		FILE *fp = fopen(path(vs).c_str(), "rb");
+		if (NULL == fp) {
+			return 0;
+		}
+		fseek(fp, 0, SEEK_END);
+		long size = ftell(fp);
+		fclose(fp);
+		return max(size, 0L);
+	}
+
+private:
+	string dir;
+
+	DISALLOW_EVIL_CONSTRUCTORS(SegmentStore);
+};
+
+uint64_t test_file_size(const char *path) {
+	FILE *fp = fopen(path, "rb");
+	assert( NULL != fp );
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fclose(fp);
+	return size;
+}
+
+/**
+ * Appends across reopens, and the recovery of a torn or corrupt tail
+ */
+void test_segment_recovery() {
+	const char *fname = "test-segment.seg";
+	remove(fname);
+	const uint64_t n = 5000;
+	int32_t *vals = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	int32_t *got = static_cast<int32_t*>(malloc(n*sizeof(int32_t)));
+	for (uint64_t i = 0; i < n; ++i) {
+		vals[i] = static_cast<int32_t>(i * 37 % 1001) - 500;
+	}
+
+	SegmentWriter w;
+	assert( w.open(fname) );
+	assert( (seg_append<int32_t, uint32_t>(w, ZLIB, true, vals, 2500, 1000)) );
+	assert( 3 == w.nframes() );
+	assert( w.close() );
+
+	//reopening cuts off the footer and carries on
+	assert( w.open(fname) );
+	assert( 2500 == w.nvalues() );
+	assert( (seg_append<int32_t, uint32_t>(w, EXP_GOLOMB, false, vals + 2500, 2500, 1000)) );
+	assert( w.close() );
+
+	SegmentReader seg;
+	assert( seg.open(fname) );
+	assert( 6 == seg.nframes() && n == seg.nvalues() );
+	assert( 2500 == seg.entry(3).first && 500 == seg.entry(5).nvalues );
+	uint32_t ndecoded = 0;
+	assert( (seg_load<int32_t, uint32_t>(seg, 0, n, got, &ndecoded)) );
+	assert( 0 == memcmp(got, vals, n*sizeof(int32_t)) );
+	assert( 6 == ndecoded );
+	//a range decodes only its frames
+	assert( (seg_load<int32_t, uint32_t>(seg, 1999, 3001, got, &ndecoded)) );
+	assert( 0 == memcmp(got, vals + 1999, 1002*sizeof(int32_t)) );
+	assert( 3 == ndecoded );
+	assert( (seg_load<int32_t, uint32_t>(seg, 3000, 3000, got, &ndecoded)) );
+	assert( 0 == ndecoded );
+	uint64_t last = seg.entry(5).offset;
+	seg.close();
+
+	//a crash part way through a frame, with no footer
+	uint64_t size = test_file_size(fname);
+	assert( 0 == truncate(fname, last + sizeof(seg_frame_header) + 3) );
+	assert( seg.open(fname) );
+	assert( 5 == seg.nframes() && 4500 == seg.nvalues() );
+	seg.close();
+	assert( w.open(fname) );
+	assert( 4500 == w.nvalues() );
+	assert( last == test_file_size(fname) );
+	assert( (seg_append<int32_t, uint32_t>(w, EXP_GOLOMB, false, vals + 4500, 500, 1000)) );
+	assert( w.close() );
+	assert( size == test_file_size(fname) );
+
+	//a flipped byte in the last frame, found by its checksum
+	FILE *fp = fopen(fname, "r+b");
+	fseek(fp, last + sizeof(seg_frame_header) + 1, SEEK_SET);
+	int c = fgetc(fp);
+	fseek(fp, last + sizeof(seg_frame_header) + 1, SEEK_SET);
+	fputc(c ^ 0x40, fp);
+	fclose(fp);
+	assert( seg.open(fname) );
+	assert( 6 == seg.nframes() );
+	assert( seg.check(4) && !seg.check(5) );
+	assert( (seg_load<int32_t, uint32_t>(seg, 0, 4500, got)) );
+	assert( !(seg_load<int32_t, uint32_t>(seg, 4000, 5000, got)) );
+	//the wrong value type is refused
+	assert( !(seg_load<int64_t, uint64_t>(seg, 0, 10, reinterpret_cast<int64_t*>(got))) );
+	seg.close();
+	//and with the footer gone too, the scan stops before it
+	assert( 0 == truncate(fname, size - sizeof(seg_trailer)) );
+	assert( w.open(fname) );
+	assert( 4500 == w.nvalues() && 5 == w.nframes() );
+	assert( w.close() );
+
+	//not a segment file
+	fp = fopen(fname, "wb");
+	fputs("hello, world", fp);
+	fclose(fp);
+	assert( !seg.open(fname) );
+	assert( !w.open(fname) );
+
+	free(got);
+	free(vals);
+	remove(fname);
+}
+
+void test_segment_store() {
+	SegmentStore store(".");
+	vector<vstream> streams = get_test_streams();
+	assert( streams.size() > 3 );
+	assert( "./testdata_cmu-robot-field_vs_1.seg" == store.path(streams[0]) );
+	for (unsigned sdx = 0; sdx < streams.size(); sdx += 3) {
+		const vstream &vs = streams[sdx];
+		assert( store.store(vs, ZLIB, true, 4096) );
+		assert( store.stored_bytes(vs) > 0 );
+		void *raw = read_fully(vs);
+		void *got = store.load(vs);
+		assert( NULL != got );
+		assert( 0 == memcmp(raw, got, static_cast<size_t>(vs.npoints) * vs.vsize) );
+		free(got);
+		got = store.load(vs, 5000, 9000);
+		assert( 0 == memcmp(static_cast<char*>(raw) + 5000*vs.vsize, got, 4000*vs.vsize) );
+		free(got);
+		free(raw);
+		remove(store.path(vs).c_str());
+	}
+	assert( NULL == store.load(streams[0]) );
+}
+
+void test_segstore() {
+	test_segment_recovery();
+	test_segment_store();
+}
+
+#endif /* SEGSTORE_HPP_ */
@@ -0,0 +1,125 @@
+/*
+ * strpool.hpp
+ * @brief arena-backed interned strings
+ * @author ishafer
+ */
+
+#ifndef STRPOOL_HPP_
+#define STRPOOL_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <set>
+#include <vector>
+
+#include "util.hpp"
+
+using namespace std;
+
+struct cstr_less {
+	bool operator()(const char *a, const char *b) const {
+		return strcmp(a, b) < 0;
+	}
+};
+
+/**
+ * @brief interns strings into large arena chunks.
+ * Equal strings share one copy, and nothing is freed until the pool is,
+ *  so interned pointers can be handed out freely.
+ */
+class StringPool {
+private:
+	static const size_t CHUNK_SIZE = 64*1024;
+
+	vector<char*> chunks;
+	char *cur;
+	size_t remaining;
+	set<const char*, cstr_less> interned;
+
+	char* alloc(size_t len) {
+		if (len > remaining) {
+			//not max(), which would bind CHUNK_SIZE to a reference and need
+			// an out-of-class definition
+			size_t chunklen = (len > CHUNK_SIZE) ? len : CHUNK_SIZE;
+			cur = static_cast<char*>(malloc(chunklen));
+			chunks.push_back(cur);
+			remaining = chunklen;
+		}
+		char *res = cur;
+		cur += len;
+		remaining -= len;
+		return res;
+	}
+
+public:
+	StringPool() :
+		cur(NULL),
+		remaining(0)
+	{
+	}
+
+	~StringPool() {
+		for (vector<char*>::iterator it = chunks.begin(); it != chunks.end(); ++it) {
+			free(*it);
+		}
+	}
+
+	/**
+	 * @returns the pooled copy of str
+	 */
+	const char* intern(const char *str) {
+		set<const char*, cstr_less>::iterator it = interned.find(str);
+		if (it != interned.end()) {
+			return *it;
+		}
+		size_t len = strlen(str) + 1;
+		char *copy = alloc(len);
+		memcpy(copy, str, len);
+		interned.insert(copy);
+		return copy;
+	}
+
+	/**
+	 * @returns number of distinct strings in the pool
+	 */
+	size_t size() const {
+		return interned.size();
+	}
+
+	/**
+	 * Pool for stream metadata; lives as long as the process
+	 */
+	static StringPool& global() {
+		static StringPool pool;
+		return pool;
+	}
+
+private:
+	DISALLOW_EVIL_CONSTRUCTORS(StringPool);
+};
+
+void test_strpool() {
+	StringPool pool;
+	char buf[] = "G:/tmp/ts/0";
+	const char *a = pool.intern(buf);
+	assert( a != buf );
+	assert( 0 == strcmp(a, buf) );
+
+	buf[0] = 'D';
+	assert( 0 == strcmp(a, "G:/tmp/ts/0") );
+
+	assert( pool.intern("G:/tmp/ts/0") == a );
+	assert( pool.intern("D:/tmp/ts/0") != a );
+	assert( pool.size() == 2 );
+
+	//strings bigger than a chunk get their own
+	vector<char> big(200*1024, 'x');
+	big.back() = '\0';
+	const char *b = pool.intern(&big[0]);
+	assert( strlen(b) == big.size() - 1 );
+	assert( pool.intern("") != pool.intern("x") );
+	assert( pool.size() == 5 );
+}
+
+#endif /* STRPOOL_HPP_ */
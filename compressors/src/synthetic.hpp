@@ -0,0 +1,406 @@
+/*
+ * synthetic.hpp
+ * @brief deterministic synthetic time series for codec measurements
+ * @author ishafer
+ */
+
+#ifndef SYNTHETIC_HPP_
+#define SYNTHETIC_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+
+#include "compressor.hpp"
+#include "resultstore.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+enum SynthShape {
+	SYNTH_WALK,
+	SYNTH_PERIODIC,
+	SYNTH_STEPS,
+	SYNTH_SPIKES,
+	SYNTH_COUNTER,
+	SYNTH_QFLOAT,
+	N_SYNTH_SHAPES
+};
+
+ostream& operator<<(ostream& os, const SynthShape& shape)
+{
+	switch(shape) {
+		case SYNTH_WALK: os << "walk"; break;
+		case SYNTH_PERIODIC: os << "periodic"; break;
+		case SYNTH_STEPS: os << "steps"; break;
+		case SYNTH_SPIKES: os << "spikes"; break;
+		case SYNTH_COUNTER: os << "counter"; break;
+		case SYNTH_QFLOAT: os << "qfloat"; break;
+		default: os << "unknown"; break;
+	}
+	return os;
+}
+
+/**
+ * @returns the shape called name, or N_SYNTH_SHAPES if there isn't one
+ */
+SynthShape parse_shape(const string &name) {
+	for (int s = 0; s < N_SYNTH_SHAPES; ++s) {
+		ostringstream os;
+		os << static_cast<SynthShape>(s);
+		if (os.str() == name) {
+			return static_cast<SynthShape>(s);
+		}
+	}
+	return N_SYNTH_SHAPES;
+}
+
+/**
+ * What to generate
+ */
+struct synth_spec {
+	SynthShape shape;
+	//bytes per value: 1, 2, 4 or 8
+	int width;
+	uint64_t npoints;
+	//random bits per value, roughly; 0 for a fully predictable series
+	int entropy;
+	uint64_t seed;
+
+	synth_spec(SynthShape _shape, int _width, uint64_t _npoints, int _entropy, uint64_t _seed = 1) :
+		shape(_shape),
+		width(_width),
+		npoints(_npoints),
+		entropy(_entropy),
+		seed(_seed)
+	{
+	}
+};
+
+/**
+ * @brief small, fast generator (splitmix64) so series are the same on every platform
+ */
+class SynthRng {
+private:
+	uint64_t state;
+
+public:
+	SynthRng(uint64_t seed) :
+		state(seed)
+	{
+	}
+
+	uint64_t next() {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	/**
+	 * @returns k uniform random bits
+	 */
+	uint64_t bits(int k) {
+		if (k <= 0) {
+			return 0;
+		}
+		uint64_t r = next();
+		return (k >= 64) ? r : (r >> (64 - k));
+	}
+
+	/**
+	 * @returns a value with k random bits, centered on zero
+	 */
+	int64_t noise(int k) {
+		if (k <= 0) {
+			return 0;
+		}
+		if (k >= 64) {
+			return static_cast<int64_t>(next());
+		}
+		return static_cast<int64_t>(bits(k)) - (static_cast<int64_t>(1) << (k - 1));
+	}
+
+	/**
+	 * @returns uniform in [0, 1)
+	 */
+	double uniform() {
+		return (next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	/**
+	 * @returns standard normal sample
+	 */
+	double gauss() {
+		double u1 = 1.0 - uniform();
+		double u2 = uniform();
+		return sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
+	}
+};
+
+/**
+ * @returns x clamped to the range of vT
+ */
+template<typename vT>
+vT synth_saturate(double x) {
+	double lo = static_cast<double>(numeric_limits<vT>::min());
+	double hi = static_cast<double>(numeric_limits<vT>::max());
+	if (x <= lo) {
+		return numeric_limits<vT>::min();
+	}
+	if (x >= hi) {
+		return numeric_limits<vT>::max();
+	}
+	return static_cast<vT>(llround(x));
+}
+
+/**
+ * Fill out with spec.npoints values of the given shape.
+ * Integer series wrap around the range of vT, like real counters do;
+ *  the analog ones (periodic, qfloat) saturate.
+ */
+template<typename vT>
+void synth_fill(vT *out, const synth_spec &spec) {
+	SynthRng rng(spec.seed);
+	int vbits = 8*sizeof(vT);
+	int e = min(max(spec.entropy, 0), vbits);
+	//a quarter of the value range
+	double amplitude = ldexp(1.0, vbits - 3);
+	const double period = 360;
+	double phase = rng.uniform() * period;
+
+	uint64_t x = 0;
+	uint64_t runleft = 0;
+	double drift = 0;
+	for (uint64_t i = 0; i < spec.npoints; ++i) {
+		switch (spec.shape) {
+		case SYNTH_WALK:
+			x += rng.noise(e);
+			out[i] = static_cast<vT>(x);
+			break;
+		case SYNTH_PERIODIC:
+			out[i] = synth_saturate<vT>(amplitude * sin(2 * M_PI * (i + phase) / period) +
+					static_cast<double>(rng.noise(min(e, vbits - 2))));
+			break;
+		case SYNTH_STEPS:
+			if (0 == runleft) {
+				//new level, held for 1..127 points
+				x += rng.noise(e);
+				runleft = 1 + rng.bits(7) % 127;
+			}
+			--runleft;
+			out[i] = static_cast<vT>(x);
+			break;
+		case SYNTH_SPIKES:
+			//about one point in 64 is off the baseline
+			out[i] = (0 == rng.bits(6)) ? static_cast<vT>(rng.noise(e)) : 0;
+			break;
+		case SYNTH_COUNTER:
+			x += 1 + rng.bits(e);
+			out[i] = static_cast<vT>(x);
+			break;
+		case SYNTH_QFLOAT: {
+			//a float sensor reading, quantised to 2^e steps over its range
+			drift += 0.01 * rng.gauss();
+			float reading = static_cast<float>(sin(2 * M_PI * (i + phase) / period) +
+					0.1 * drift + 0.01 * rng.gauss());
+			out[i] = synth_saturate<vT>(ldexp(static_cast<double>(reading), e - 1));
+			break;
+		}
+		default:
+			out[i] = 0;
+			break;
+		}
+	}
+}
+
+/**
+ * @returns spec.npoints values of spec.width bytes each; caller frees
+ */
+void* synth_alloc(const synth_spec &spec) {
+	void *buf = malloc(max(spec.npoints, static_cast<uint64_t>(1)) * spec.width);
+	switch (spec.width) {
+	case 1:
+		synth_fill(static_cast<int8_t*>(buf), spec);
+		break;
+	case 2:
+		synth_fill(static_cast<int16_t*>(buf), spec);
+		break;
+	case 4:
+		synth_fill(static_cast<int32_t*>(buf), spec);
+		break;
+	case 8:
+		synth_fill(static_cast<int64_t*>(buf), spec);
+		break;
+	default:
+		cerr << "Unknown value size:" << spec.width << endl;
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/**
+ * Generate the series and roundtrip it through a coder; prints
+ *  shape,width,npoints,entropy,seed, then the roundtrip columns
+ */
+roundtrip_result synth_roundtrip(bool deltaenc, CoderName name, const synth_spec &spec,
+		uint32_t nthreads = 1) {
+	roundtrip_result res;
+	void *bytes = synth_alloc(spec);
+	if (NULL == bytes) {
+		return res;
+	}
+	ostringstream os;
+	os << spec.shape << "," << spec.width << "," << spec.npoints << "," <<
+			spec.entropy << "," << spec.seed << ",";
+	string toprint = os.str();
+	switch (spec.width) {
+	case 1:
+		res = test_roundtrip_inner<int8_t, uint8_t>(toprint.c_str(), deltaenc, name, bytes, spec.npoints, nthreads);
+		break;
+	case 2:
+		res = test_roundtrip_inner<int16_t, uint16_t>(toprint.c_str(), deltaenc, name, bytes, spec.npoints, nthreads);
+		break;
+	case 4:
+		res = test_roundtrip_inner<int32_t, uint32_t>(toprint.c_str(), deltaenc, name, bytes, spec.npoints, nthreads);
+		break;
+	case 8:
+		res = test_roundtrip_inner<int64_t, uint64_t>(toprint.c_str(), deltaenc, name, bytes, spec.npoints, nthreads);
+		break;
+	}
+	free(bytes);
+	return res;
+}
+
+/**
+ * Sweep entropy at a fixed size, and size at a fixed entropy, for every coder
+ * @param shape shape to run, or N_SYNTH_SHAPES for all of them
+ * @param width value size to run, or 0 for all of them
+ * @param npoints size for the entropy sweep
+ */
+void synth_curves(SynthShape shape, int width, uint64_t npoints, bool deltaenc) {
+	const int widths[] = {1, 2, 4, 8};
+	cout << "shape,width,npoints,entropy,seed,codec,rawbytes,encbytes,enc_s,dec_s" << endl;
+	for (int s = 0; s < N_SYNTH_SHAPES; ++s) {
+		if (shape != N_SYNTH_SHAPES && shape != s) {
+			continue;
+		}
+		for (int w = 0; w < 4; ++w) {
+			if (width != 0 && width != widths[w]) {
+				continue;
+			}
+			int vbits = 8*widths[w];
+			for (int e = 0; e <= vbits; e = (e < 4) ? e + 1 : e + e/2) {
+				synth_spec spec(static_cast<SynthShape>(s), widths[w], npoints, e);
+				for (unsigned cdx = 0; cdx < N_CODERS; ++cdx) {
+					synth_roundtrip(deltaenc, ALL_CODERS[cdx], spec);
+				}
+			}
+			for (uint64_t n = 1024; n <= 4*npoints; n *= 4) {
+				synth_spec spec(static_cast<SynthShape>(s), widths[w], n, vbits/4);
+				for (unsigned cdx = 0; cdx < N_CODERS; ++cdx) {
+					synth_roundtrip(deltaenc, ALL_CODERS[cdx], spec);
+				}
+			}
+		}
+	}
+}
+
+void test_synth_rng() {
+	SynthRng a(7);
+	SynthRng b(7);
+	SynthRng c(8);
+	uint64_t x = a.next();
+	assert( x == b.next() );
+	assert( x != c.next() );
+	for (int i = 0; i < 1000; ++i) {
+		assert( a.bits(5) < 32 );
+		int64_t n = a.noise(4);
+		assert( n >= -8 && n < 8 );
+		double u = a.uniform();
+		assert( u >= 0 && u < 1 );
+	}
+	assert( 0 == a.bits(0) && 0 == a.noise(0) );
+}
+
+void test_synth_shapes() {
+	const uint64_t n = 5000;
+	int32_t buf[n];
+	int32_t again[n];
+
+	for (int s = 0; s < N_SYNTH_SHAPES; ++s) {
+		synth_spec spec(static_cast<SynthShape>(s), 4, n, 8, 3);
+		synth_fill(buf, spec);
+		synth_fill(again, spec);
+		assert( 0 == memcmp(buf, again, sizeof(buf)) );
+		spec.seed = 4;
+		synth_fill(again, spec);
+		assert( 0 != memcmp(buf, again, sizeof(buf)) );
+	}
+
+	//no entropy: walks and steps don't move, counters count by one
+	synth_fill(buf, synth_spec(SYNTH_WALK, 4, n, 0));
+	synth_fill(again, synth_spec(SYNTH_STEPS, 4, n, 0));
+	for (uint64_t i = 0; i < n; ++i) {
+		assert( buf[i] == 0 && again[i] == 0 );
+	}
+	synth_fill(buf, synth_spec(SYNTH_COUNTER, 4, n, 0));
+	for (uint64_t i = 1; i < n; ++i) {
+		assert( buf[i] == buf[i-1] + 1 );
+	}
+
+	//walk steps stay within the entropy
+	synth_fill(buf, synth_spec(SYNTH_WALK, 4, n, 6));
+	for (uint64_t i = 1; i < n; ++i) {
+		assert( abs(buf[i] - buf[i-1]) <= 32 );
+	}
+
+	//spikes are sparse
+	synth_fill(buf, synth_spec(SYNTH_SPIKES, 4, n, 16));
+	uint64_t nonzero = 0;
+	for (uint64_t i = 0; i < n; ++i) {
+		nonzero += (buf[i] != 0);
+	}
+	assert( nonzero > n/128 && nonzero < n/32 );
+
+	//analog shapes saturate rather than wrap
+	int8_t small[n];
+	synth_fill(small, synth_spec(SYNTH_QFLOAT, 1, n, 12));
+	int8_t lo = 0;
+	int8_t hi = 0;
+	for (uint64_t i = 0; i < n; ++i) {
+		lo = min(lo, small[i]);
+		hi = max(hi, small[i]);
+	}
+	assert( lo == -128 && hi == 127 );
+
+	assert( parse_shape("qfloat") == SYNTH_QFLOAT );
+	assert( parse_shape("nope") == N_SYNTH_SHAPES );
+}
+
+void test_synth_roundtrips() {
+	const int widths[] = {1, 2, 4, 8};
+	const CoderName names[] = {ELIAS_GAMMA, ELIAS_DELTA, LOG_HUFFMAN, ZLIB};
+	for (int s = 0; s < N_SYNTH_SHAPES; ++s) {
+		for (int w = 0; w < 4; ++w) {
+			synth_spec spec(static_cast<SynthShape>(s), widths[w], 3000, 2*widths[w]);
+			for (int c = 0; c < 4; ++c) {
+				assert( synth_roundtrip(true, names[c], spec).ok );
+			}
+		}
+	}
+}
+
+void test_synthetic() {
+	test_synth_rng();
+	test_synth_shapes();
+	test_synth_roundtrips();
+}
+
+#endif /* SYNTHETIC_HPP_ */